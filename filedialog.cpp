@@ -1,4 +1,5 @@
 #include "filedialog.h"
+#include "stream.h"
 #include "util.h"
 
 
@@ -82,22 +83,40 @@ extern std::string makeAbsolutePath(const std::string& path)
 #endif
 }
 
-extern bool extensionMatches(const std::string& file, const std::string& extension)
+static bool suffixMatches(const std::string& file, const std::string& suffix)
 {
 	size_t fl = file.length();
-	size_t el = extension.length();
-	if (el > 0 && fl > el) {
-		const char *e = extension.c_str();
-		const char *f = file.c_str() + fl - el;
+	size_t sl = suffix.length();
+	if (sl > 0 && fl > sl) {
+		const char *s = suffix.c_str();
+		const char *f = file.c_str() + fl - sl;
 #ifdef WIN32
-		return (_stricmp(e,f) == 0);
+		return (_stricmp(s,f) == 0);
 #else
-		return (strcasecmp(e,f) == 0);
+		return (strcasecmp(s,f) == 0);
 #endif
 	}
 	return false;
 }
 
+extern bool extensionMatches(const std::string& file, const std::string& extension)
+{
+	if (suffixMatches(file, extension)) {
+		return true;
+	}
+	if (extension.empty()) {
+		return false;
+	}
+	// also accept compressed variants, like .gpx.gz
+	const char *compressed;
+	for (int i=0; (compressed = gpxstream::getCompressedSuffix(i)); i++) {
+		if (suffixMatches(file, extension + compressed)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 #ifdef WIN32
 static void processDirectoryEntry(WIN32_FIND_DATAW& ffd, const std::string& path, std::vector<std::string>& subdirs, std::vector<std::string>& files)
 {
@@ -389,7 +408,14 @@ CFileDialogTracks::CFileDialogTracks(gpxvis::CAnimController& aniCtrl) :
 
 void CFileDialogTracks::Apply(const std::string& fullFilename)
 {
-	animCtrl.AddTrack(fullFilename.c_str());
+	// collect the files, they are loaded together in Update()
+	pendingFiles.push_back(fullFilename);
+}
+
+void CFileDialogTracks::Update()
+{
+	animCtrl.AddTracks(pendingFiles);
+	pendingFiles.clear();
 }
 
 const char *CFileDialogTracks::GetDialogName()
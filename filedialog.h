@@ -70,8 +70,10 @@ class CFileDialogTracks : public CFileDialogBase {
 
 	protected:
 		gpxvis::CAnimController& animCtrl;
+		std::vector<std::string> pendingFiles;
 
 		virtual void Apply(const std::string& fullFilename);
+		virtual void Update();
 		virtual const char *GetDialogName();
 };
 
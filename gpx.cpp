@@ -1,4 +1,5 @@
 #include "gpx.h"
+#include "stream.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -32,6 +33,15 @@ extern void unprojectMercator(double x, double y, double& lon, double& lat)
 	lat = lat * 180.0 / M_PI;
 }
 
+extern void mercatorToWebMercator(double x, double y, double& wx, double& wy)
+{
+	// the same projection on a sphere with the equatorial radius of WGS84,
+	// only our y is scaled with the meridian length instead
+	const double radius = 6378137.0;
+	wx = radius * (((x * 2.0 * M_PI) / mercatorScaleX) - M_PI);
+	wy = radius * (((y * 2.0 * M_PI) / mercatorScaleY) - M_PI);
+}
+
 extern double getProjectionScale(double lat)
 {
 	if (lat > 89.9) {
@@ -42,12 +52,72 @@ extern double getProjectionScale(double lat)
 	return cos(lat * M_PI / 180.0);
 }
 
+TTrackMetadata::TTrackMetadata() :
+	fileSize(0),
+	fileTime(0),
+	valid(false),
+	pointCount(0),
+	length(0.0),
+	duration(0.0),
+	projectionScale(1.0)
+{
+	memset(&startPoint, 0, sizeof(startPoint));
+	for (int i=0; i<3; i++) {
+		aabbLonLat[i] = 1.0;
+		aabbLonLat[3+i] = -1.0;
+	}
+}
+
+TTrackFilter::TTrackFilter() :
+	from(0),
+	to(0),
+	minLength(0.0),
+	minDuration(0.0)
+{
+	bbox[0] = bbox[1] = 1.0;
+	bbox[2] = bbox[3] = -1.0;
+}
+
+bool TTrackFilter::IsActive() const
+{
+	return HasTimeRange() || HasBBox() || minLength > 0.0 || minDuration > 0.0;
+}
+
+bool TTrackFilter::AcceptsStart(time_t start) const
+{
+	// tracks without timestamps can't be in any time range
+	if (HasTimeRange() && !start) {
+		return false;
+	}
+	return (!from || start >= from) && (!to || start < to);
+}
+
+bool TTrackFilter::Accepts(const CTrack& track) const
+{
+	if (!AcceptsStart(track.GetStartTimestamp()) || track.GetLength() < minLength || track.GetDuration() < minDuration) {
+		return false;
+	}
+	if (HasBBox()) {
+		const double *a = track.GetAABBLonLat().Get();
+		if (a[0] > bbox[2] || a[3] < bbox[0] || a[1] > bbox[3] || a[4] < bbox[1]) {
+			return false;
+		}
+	}
+	return true;
+}
+
 CTrack::CTrack() :
-	internalID(0)
+	internalID(0),
+	lastUse(0)
 {
 	Reset();
 }
 
+// block size for reading gpx files
+static const size_t gpxBlockSize = 256 * 1024;
+// maximum size of a single element we are willing to buffer
+static const size_t gpxMaxElementSize = 16 * 1024 * 1024;
+
 static double getDbl(const char *str)
 {
 	if (!str) {
@@ -99,83 +169,236 @@ static time_t getTime(const char *str)
 	return val;
 }
 
-bool CTrack::Load(const char *filename)
+extern time_t parseTimestamp(const char *str)
 {
-	FILE *file = gpxutil::fopen_wrapper(filename, "rt");
-	if(!file) {
-		gpxutil::warn("gpx file '%s' can't be opened", filename);
-		return false;
-	}
-	fseek(file, 0, SEEK_END);
-	long size = ftell(file);
-	if (size < 4 || size > 100*1024*1024) {
-		fclose(file);
-		gpxutil::warn("gpx file '%s' has invalid file size: %ld", filename, size);
-		return false;
+	if (!str || !isdigit((unsigned char)*str)) {
+		return (time_t)0;
 	}
-	char *source = (char*)malloc(size+1);
-	if (!source) {
-		fclose(file);
-		gpxutil::warn("gpx file '%s': out of memory when importing", filename);
-		return false;
+	return getTime(str);
+}
+
+void CTrack::ParsePoint(const char *element, const char *filename)
+{
+	const char *lat=strstr(element, "lat=");
+	const char *lon=strstr(element, "lon=");
+	const char *ele=strstr(element, "<ele>");
+	const char *time=strstr(element, "<time>");
+
+	if (lat && lon) {
+		TPoint pt;
+		pt.lon = getDbl(lon);
+		pt.lat = getDbl(lat);
+		projectMercator(pt.lon,pt.lat,pt.x,pt.y);
+		pt.h = getDbl(ele);
+		pt.timestamp = getTime(time);
+
+		pt.len = 0.0;
+		pt.duration = 0.0;
+		pt.posOnTrack = 0.0;
+		pt.timeOnTrack = 0.0;
+		points.push_back(pt);
+	} else {
+		gpxutil::warn("gpx file '%s': invalid trkpt occured", filename);
 	}
-	fseek(file, 0, SEEK_SET);
-	source[fread(source, 1, size, file)] = 0;
-	fclose(file);
+}
+
+size_t CTrack::ParseBlock(char *block, size_t size, bool final, const char *filename, const TTrackFilter *filter)
+{
+	// <trk>, <trkseg> and <trkpt> all share the same prefix
+	static const char tagPrefix[] = "<trk";
+	static const char tagPoint[] = "<trkpt";
+	static const char tagSegment[] = "<trkseg";
+	static const char tagEnd[] = "</trkpt>";
+	size_t pos = 0;
 
-	Reset();
-	long pos = 0;
 	while (pos < size) {
-		const char *start = strstr(source+pos, "<trkpt");
+		char *start = strstr(block+pos, tagPrefix);
 		if (!start) {
+			// keep the tail, it might contain the beginning of a tag
+			size_t keep = (final) ? 0 : sizeof(tagPrefix) - 2;
+			if (size > pos + keep) {
+				pos = size - keep;
+			}
 			break;
 		}
-		const char *end = strstr(start, "</trkpt>");
-		if (!end) {
+		size_t startPos = (size_t)(start - block);
+		if (!final && startPos + sizeof(tagSegment) > size) {
+			// not enough data to tell the tags apart
+			pos = startPos;
 			break;
 		}
-		pos = (long)(end - source);
-		source[pos++] = 0;
-		const char *lat=strstr(start, "lat=");
-		const char *lon=strstr(start, "lon=");
-                const char *ele=strstr(start, "<ele>");
-		const char *time=strstr(start, "<time>");
-
-		if (lat && lon) {
-			TPoint pt;
-			pt.lon = getDbl(lon);
-			pt.lat = getDbl(lat);
-			projectMercator(pt.lon,pt.lat,pt.x,pt.y);
-			pt.h = getDbl(ele);
-			pt.timestamp = getTime(time);
-
-			aabb.Add(pt.x,pt.y,pt.h);
-			aabbLonLat.Add(pt.lon, pt.lat, pt.h); 
-
-			pt.len = 0.0;
-			pt.duration = 0.0;
-			pt.posOnTrack = 0.0;
-			pt.timeOnTrack = 0.0;
-			points.push_back(pt);
+		if (!strncmp(start, tagPoint, sizeof(tagPoint)-1)) {
+			char *end = strstr(start, tagEnd);
+			if (!end) {
+				// incomplete element, needs the next block
+				pos = startPos;
+				break;
+			}
+			*end = 0;
+			ParsePoint(start, filename);
+			pos = (size_t)(end - block) + sizeof(tagEnd) - 1;
+			if (filter && points.size() == 1 && !filter->AcceptsStart(points[0].timestamp)) {
+				// the first point has the start time, no need to read further
+				rejected = true;
+				break;
+			}
 		} else {
-			gpxutil::warn("gpx file '%s': invalid trkpt occured", filename);
+			if (!strncmp(start, tagSegment, sizeof(tagSegment)-1)) {
+				StartSegment(false);
+			} else if (start[sizeof(tagPrefix)-1] == '>' || isspace((unsigned char)start[sizeof(tagPrefix)-1])) {
+				StartSegment(true);
+			}
+			pos = startPos + sizeof(tagPrefix) - 1;
+		}
+	}
+	return pos;
+}
+
+void CTrack::StartSegment(bool newSubTrack)
+{
+	// empty segments and tracks are collapsed
+	size_t idx = points.size();
+	if (segments.empty() || segments.back() != idx) {
+		segments.push_back(idx);
+	}
+	if (newSubTrack) {
+		size_t seg = segments.size() - 1;
+		if (subTracks.empty() || subTracks.back() != seg) {
+			subTracks.push_back(seg);
+		}
+	}
+}
+
+bool CTrack::Load(const char *filename, const TTrackFilter *filter)
+{
+	gpxstream::CInputStream *stream = gpxstream::CInputStream::Open(filename);
+	if(!stream) {
+		gpxutil::warn("gpx file '%s' can't be opened", filename);
+		return false;
+	}
+
+	// We read the file in blocks of fixed size and parse each block
+	// directly, so the memory we need does not depend on the file size.
+	// Elements crossing a block boundary are moved to the front of the
+	// buffer and completed by the next block. Compressed files are
+	// decompressed block by block by the stream.
+	size_t capacity = gpxBlockSize;
+	size_t fill = 0;
+	char *buffer = (char*)malloc(capacity+1);
+	if (!buffer) {
+		delete stream;
+		gpxutil::warn("gpx file '%s': out of memory when importing", filename);
+		return false;
+	}
+
+	Reset();
+	if (filter && !filter->IsActive()) {
+		filter = NULL;
+	}
+	bool final = false;
+	while (!final && !rejected) {
+		if (fill >= capacity) {
+			// a single element does not fit into the buffer
+			if (capacity >= gpxMaxElementSize) {
+				gpxutil::warn("gpx file '%s': element exceeds %u bytes, skipped", filename, (unsigned)gpxMaxElementSize);
+				fill = 0;
+			} else {
+				char *newBuffer = (char*)realloc(buffer, 2*capacity+1);
+				if (!newBuffer) {
+					free(buffer);
+					delete stream;
+					gpxutil::warn("gpx file '%s': out of memory when importing", filename);
+					return false;
+				}
+				buffer = newBuffer;
+				capacity *= 2;
+			}
+		}
+		size_t cnt = stream->Read(buffer+fill, capacity-fill);
+		if (cnt < capacity - fill) {
+			if (stream->Failed()) {
+				gpxutil::warn("gpx file '%s': read error", filename);
+			}
+			final = true;
+		}
+		fill += cnt;
+		buffer[fill] = 0;
+		size_t used = ParseBlock(buffer, fill, final, filename, filter);
+		if (used > 0) {
+			fill -= used;
+			memmove(buffer, buffer+used, fill);
+		}
+	}
+	free(buffer);
+	bool readFailed = stream->Failed();
+	delete stream;
+	if (readFailed) {
+		// the points read so far are not the whole track
+		Reset();
+		return false;
+	}
+
+	bool success = !rejected && Finalize(filename);
+	if (success && filter && !filter->Accepts(*this)) {
+		rejected = true;
+	}
+	if (rejected) {
+		Reset();
+		rejected = true;
+		gpxutil::info("gpx file '%s': rejected by the filter", filename);
+		return false;
+	}
+	reloadable = success;
+	return success;
+}
+
+bool CTrack::Finalize(const char *filename)
+{
+	// remove empty segments at the end, and make sure all points
+	// belong to some segment and track, even for files without <trkseg>
+	while (!segments.empty() && segments.back() >= points.size()) {
+		segments.pop_back();
+	}
+	if (segments.empty() || segments[0] != 0) {
+		segments.insert(segments.begin(), 0);
+		for (size_t i=0; i<subTracks.size(); i++) {
+			subTracks[i]++;
 		}
 	}
-	free(source);
+	while (!subTracks.empty() && subTracks.back() >= segments.size()) {
+		subTracks.pop_back();
+	}
+	if (subTracks.empty() || subTracks[0] != 0) {
+		subTracks.insert(subTracks.begin(), 0);
+	}
 
 	CalculateLineSegments();
+	pointCount = points.size();
 
 	if (points.size() < 2) {
 		gpxutil::warn("gpx file '%s': contains no track, only %u points found", filename, (unsigned)points.size());
 		return false;
 	}
 
+	aabb.Reset();
+	aabbLonLat.Reset();
+	for (size_t i=0; i < points.size(); i++) {
+		const TPoint& p = points[i];
+		aabb.Add(p.x, p.y, p.h);
+		aabbLonLat.Add(p.lon, p.lat, p.h);
+	}
+
 	double geoCenter[3];
 	projectionScale = 0.0;
 	if (aabbLonLat.GetCenter(geoCenter)) {
 		projectionScale = getProjectionScale(geoCenter[1]);
 	}
 
+	totalLen = 0.0;
+	totalDuration = 0.0;
+	points[0].posOnTrack = 0.0;
+	points[0].timeOnTrack = 0.0;
+	size_t nextSegment = 1;
 	for (size_t i=1;  i < points.size(); i++) {
 		TPoint& A = points[i-1];
 		TPoint& B = points[i];
@@ -183,10 +406,7 @@ bool CTrack::Load(const char *filename)
 		double dy = B.y - A.y;
 		// estimate scale for each line segment separately
 		double pScale = getProjectionScale(0.5 * A.lat + 0.5 * B.lat);
-		A.len = sqrt(dx*dx + dy*dy) * pScale;
 		projectionScale += pScale;
-		totalLen += A.len;
-		B.posOnTrack = totalLen;
 
 		double dur = (double)difftime(B.timestamp, A.timestamp);
 		if (dur < 0.0) {
@@ -194,31 +414,149 @@ bool CTrack::Load(const char *filename)
 			B.timestamp = A.timestamp;
 			dur = 0.0;
 		}
-		A.duration = dur;
-		totalDuration += dur;
+		if (nextSegment < segments.size() && segments[nextSegment] == i) {
+			// gaps between segments count neither as distance nor as time
+			nextSegment++;
+			A.len = 0.0;
+			A.duration = 0.0;
+		} else {
+			A.len = sqrt(dx*dx + dy*dy) * pScale;
+			A.duration = dur;
+		}
+		totalLen += A.len;
+		B.posOnTrack = totalLen;
+		totalDuration += A.duration;
 		B.timeOnTrack = totalDuration;
 	}
+	points[points.size()-1].len = 0.0;
+	points[points.size()-1].duration = 0.0;
 	projectionScale /= (double)points.size(); // average projection scale
 
 	const double *a = aabb.Get();
-	gpxutil::info("gpx file '%s': %llu points, total len: %f, duration: %f, aabb: (%f %f %f) - (%f %f %f), projection scale: %f",
-			filename, (unsigned long long)GetCount(), totalLen, totalDuration,
+	gpxutil::info("gpx file '%s': %llu points in %u segments, %u tracks, total len: %f, duration: %f, aabb: (%f %f %f) - (%f %f %f), projection scale: %f",
+			filename, (unsigned long long)GetCount(), (unsigned)segments.size(), (unsigned)subTracks.size(), totalLen, totalDuration,
 			a[0], a[1], a[2], a[3], a[4], a[5], projectionScale);
 	fullFilename = filename;
-	if (points.size() > 0) {
-		struct tm *tm;
+	startPoint = points[0];
+	loaded = true;
+	UpdateInfo();
+
+	return true;
+}
+
+void CTrack::UpdateInfo()
+{
+	if (pointCount > 0) {
+		struct tm tm;
 		char buf[64];
-		tm = localtime(&points[0].timestamp);
-		mysnprintf(buf, sizeof(buf), "%04d-%02d-%02d", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday);
+		gpxutil::localTime(startPoint.timestamp, tm);
+		mysnprintf(buf, sizeof(buf), "%04d-%02d-%02d", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
 		buf[sizeof(buf)-1] = 0;
 		info = buf;
 		gpxutil::durationToString(totalDuration, buf, sizeof(buf));
 		durationStr = buf;
 	}
+}
+
+void CTrack::SetMetadata(const TTrackMetadata& meta)
+{
+	Reset();
+	fullFilename = meta.filename;
+	pointCount = meta.pointCount;
+	startPoint = meta.startPoint;
+	projectMercator(startPoint.lon, startPoint.lat, startPoint.x, startPoint.y);
+	totalLen = meta.length;
+	totalDuration = meta.duration;
+	projectionScale = meta.projectionScale;
+	const double *a = meta.aabbLonLat;
+	double minX, minY, maxX, maxY;
+	projectMercator(a[0], a[1], minX, minY);
+	projectMercator(a[3], a[4], maxX, maxY);
+	aabbLonLat.Add(a[0], a[1], a[2]);
+	aabbLonLat.Add(a[3], a[4], a[5]);
+	aabb.Add(minX, minY, a[2]);
+	aabb.Add(maxX, maxY, a[5]);
+	loaded = false;
+	reloadable = true;
+	UpdateInfo();
+}
+
+void CTrack::GetMetadata(TTrackMetadata& meta) const
+{
+	meta.filename = fullFilename;
+	meta.valid = (pointCount >= 2);
+	meta.pointCount = pointCount;
+	meta.startPoint = startPoint;
+	meta.length = totalLen;
+	meta.duration = totalDuration;
+	meta.projectionScale = projectionScale;
+	const double *a = aabbLonLat.Get();
+	for (int i=0; i<6; i++) {
+		meta.aabbLonLat[i] = a[i];
+	}
+}
+
+bool CTrack::LoadPoints()
+{
+	if (loaded) {
+		return true;
+	}
+	TTrackMetadata meta;
+	GetMetadata(meta);
+	if (!Load(meta.filename.c_str())) {
+		// keep what the track list knows
+		SetMetadata(meta);
+		return false;
+	}
+	if (pointCount != meta.pointCount || !IsEqual(startPoint, meta.startPoint)) {
+		gpxutil::warn("gpx file '%s': changed since it was indexed", meta.filename.c_str());
+	}
+	return true;
+}
 
+bool CTrack::UnloadPoints()
+{
+	if (!loaded || !reloadable) {
+		return false;
+	}
+	// swap to really free the memory
+	std::vector<TPoint>().swap(points);
+	std::vector<size_t>().swap(segments);
+	std::vector<size_t>().swap(subTracks);
+	std::vector<TLineSegment>().swap(lineSegments);
+	loaded = false;
 	return true;
 }
 
+size_t CTrack::GetPointMemory() const
+{
+	// the segments are negligible
+	return pointCount * (sizeof(TPoint) + sizeof(TLineSegment));
+}
+
+bool CTrack::ExtractSubTrack(size_t idx, CTrack& result) const
+{
+	if (idx >= subTracks.size()) {
+		return false;
+	}
+	size_t firstSeg = subTracks[idx];
+	size_t endSeg = (idx + 1 < subTracks.size()) ? subTracks[idx+1] : segments.size();
+	size_t first = segments[firstSeg];
+	size_t end = GetSegmentEnd(endSeg - 1);
+
+	result.Reset();
+	result.points.assign(points.begin() + first, points.begin() + end);
+	for (size_t i=firstSeg; i<endSeg; i++) {
+		result.segments.push_back(segments[i] - first);
+	}
+	result.subTracks.push_back(0);
+
+	char buf[32];
+	mysnprintf(buf, sizeof(buf), "#%u", (unsigned)(idx+1));
+	buf[sizeof(buf)-1] = 0;
+	return result.Finalize((fullFilename + buf).c_str());
+}
+
 void CTrack::CalculateLineSegment(TLineSegment& ls, size_t idxA, size_t idxB) const
 {
 	const TPoint& A=points[idxA];
@@ -246,17 +584,23 @@ void CTrack::CalculateLineSegment(TLineSegment& ls, size_t idxA, size_t idxB) co
 
 void CTrack::CalculateLineSegments()
 {
-	size_t cnt = points.size();
-	if (cnt < 1) {
-		lineSegments.clear();
-	} else if (cnt == 1) {
-		lineSegments.resize(cnt);
-		CalculateLineSegment(lineSegments[0],0,0);
-	} else {
-		cnt--;
-		lineSegments.resize(cnt);
-		for (size_t i=0; i<cnt; i++) {
-			CalculateLineSegment(lineSegments[i],i,i+1);
+	// no line segments across the gaps between segments,
+	// segments with a single point get a degenerate line segment
+	lineSegments.clear();
+	if (points.empty()) {
+		return;
+	}
+	lineSegments.reserve(points.size());
+	for (size_t s=0; s<segments.size(); s++) {
+		size_t first = segments[s];
+		size_t last = GetSegmentEnd(s) - 1;
+		if (first == last) {
+			lineSegments.emplace_back();
+			CalculateLineSegment(lineSegments.back(), first, first);
+		}
+		for (size_t i=first; i<last; i++) {
+			lineSegments.emplace_back();
+			CalculateLineSegment(lineSegments.back(), i, i+1);
 		}
 	}
 }
@@ -264,6 +608,8 @@ void CTrack::CalculateLineSegments()
 void CTrack::Reset()
 {
 	points.clear();
+	segments.clear();
+	subTracks.clear();
 	lineSegments.clear();
 	aabb.Reset();
 	aabbLonLat.Reset();
@@ -273,6 +619,11 @@ void CTrack::Reset()
 	fullFilename.clear();
 	info = "(empty track)";
 	durationStr.clear();
+	pointCount = 0;
+	memset(&startPoint, 0, sizeof(startPoint));
+	loaded = true;
+	reloadable = false;
+	rejected = false;
 }
 
 void CTrack::GetVertices(bool withZ, const double *origin, const double *scale, std::vector<GLfloat>& data) const
@@ -286,9 +637,56 @@ void CTrack::GetVertices(bool withZ, const double *origin, const double *scale,
 	}
 }
 
+void CTrack::GetEncodedVertices(TVertexEncoding encoding, const double *origin, const double *scale, std::vector<GLuint>& data, double trackOrigin[2], double trackExtent[2]) const
+{
+	// the points are stored relative to the track's own bounding box,
+	// trackOrigin and trackExtent transform them into the same space
+	// GetVertices() uses
+	const double *a = aabb.Get();
+	double invExtent[2];
+	for (int j=0; j<2; j++) {
+		double extent = a[3+j] - a[j];
+		if (!(extent > 0.0)) {
+			extent = 1.0;
+		}
+		invExtent[j] = 1.0 / extent;
+		trackOrigin[j] = (a[j] - origin[j]) * scale[j];
+		trackExtent[j] = extent * scale[j];
+	}
+
+	if (encoding == VERTEX_ENCODING_UNORM16) {
+		data.reserve(data.size() + points.size());
+		for (size_t i=0; i<points.size(); i++) {
+			GLuint q[2];
+			double p[2] = {points[i].x, points[i].y};
+			for (int j=0; j<2; j++) {
+				double v = (p[j] - a[j]) * invExtent[j] * 65535.0 + 0.5;
+				if (v < 0.0) {
+					v = 0.0;
+				} else if (v > 65535.0) {
+					v = 65535.0;
+				}
+				q[j] = (GLuint)v;
+			}
+			data.push_back(q[0] | (q[1] << 16));
+		}
+	} else {
+		data.reserve(data.size() + 2 * points.size());
+		for (size_t i=0; i<points.size(); i++) {
+			GLfloat f[2];
+			GLuint u[2];
+			f[0] = (GLfloat)((points[i].x - a[0]) * invExtent[0]);
+			f[1] = (GLfloat)((points[i].y - a[1]) * invExtent[1]);
+			memcpy(u, f, sizeof(u));
+			data.push_back(u[0]);
+			data.push_back(u[1]);
+		}
+	}
+}
+
 float CTrack::GetPointByIndex(double idx) const
 {
-	size_t cnt = GetCount();
+	size_t cnt = points.size();
 	double maxIdx = (double)cnt - 1.0;
 
 	if (cnt < 2) {
@@ -307,7 +705,7 @@ float CTrack::GetPointByIndex(double idx) const
 
 float CTrack::GetPointByDistance(double distance) const
 {
-	size_t cnt = GetCount();
+	size_t cnt = points.size();
 
 	if (cnt < 2) {
 		return 0.0f;
@@ -356,7 +754,7 @@ float CTrack::GetPointByDistance(double distance) const
 
 float CTrack::GetPointByDuration(double duration) const
 {
-	size_t cnt = GetCount();
+	size_t cnt = points.size();
 
 	if (cnt < 2) {
 		return 0.0f;
@@ -434,8 +832,8 @@ double CTrack::GetDurationAt(float animPos) const
 
 time_t CTrack::GetStartTimestamp() const
 {
-	if (points.size() > 0) {
-		return points[0].timestamp;
+	if (pointCount > 0) {
+		return startPoint.timestamp;
 	}
 	return (time_t)0;
 }
@@ -480,7 +878,7 @@ void CTrack::GetStatLine(char *buf, size_t bufSize, const char *separator, const
 		suffix = "";
 	}
 
-	if (points.size() > 0) {
+	if (pointCount > 0) {
 		struct tm *tm;
 		time_t start = GetStartTimestamp();
 		tm = localtime(&start);
@@ -557,7 +955,11 @@ bool IsEqual(const TPoint& a, const TPoint& b)
 
 bool IsEqual(const CTrack& a, const CTrack& b)
 {
-	if (a.points.size() != b.points.size()) {
+	// decided from the metadata where possible, otherwise both must be loaded
+	if (a.pointCount != b.pointCount || !IsEqual(a.startPoint, b.startPoint)) {
+		return false;
+	}
+	if (a.points.size() != b.points.size() || a.segments != b.segments) {
 		return false;
 	}
 	for (size_t i=0; i<a.points.size(); i++) {
@@ -13,7 +13,9 @@ namespace gpx {
 
 extern void projectMercator(double lon, double lat, double& x, double&y);
 extern void unprojectMercator(double x, double y, double& lon, double& lat);
+extern void mercatorToWebMercator(double x, double y, double& wx, double& wy); // to EPSG:3857 meters
 extern double getProjectionScale(double lat);
+extern time_t parseTimestamp(const char *str); // "YYYY-MM-DD[Thh:mm:ss]" as local time, 0 if invalid
 
 struct TPoint {
 	double lon;
@@ -28,6 +30,11 @@ struct TPoint {
 	time_t timestamp;
 };
 
+typedef enum : int {
+	VERTEX_ENCODING_FLOAT,   // two floats per point
+	VERTEX_ENCODING_UNORM16, // two 16 bit normalized values per point, packed into 32 bits
+} TVertexEncoding;
+
 struct TLineSegment {
 	size_t idx[2];
 	double dir[2];
@@ -37,15 +44,70 @@ struct TLineSegment {
 	double invLen;
 };
 
+class CTrack;
+
+/* What the track list needs to know of a file without its points, see
+ * CTrackIndex. The projected bounding box follows from aabbLonLat. */
+struct TTrackMetadata {
+	std::string        filename;
+	unsigned long long fileSize;
+	long long          fileTime;      // modification time
+	bool               valid;         // false if the file has no track
+	size_t             pointCount;
+	TPoint             startPoint;    // lon, lat, h and timestamp
+	double             length;        // km
+	double             duration;      // seconds
+	double             projectionScale;
+	double             aabbLonLat[6];
+
+	TTrackMetadata();
+};
+
+/* Predicates evaluated while loading. A file is rejected as soon as it is
+ * clear that it can not pass: the time range after its first point, the
+ * rest after it is parsed completely. */
+struct TTrackFilter {
+	time_t from;        // the start of the track must be in [from, to), 0 for no limit
+	time_t to;
+	double bbox[4];     // min lon, min lat, max lon, max lat the track must overlap, unused if min > max
+	double minLength;   // in km
+	double minDuration; // in seconds
+
+	TTrackFilter();
+	bool IsActive() const;
+	bool HasTimeRange() const {return from || to;}
+	bool HasBBox() const {return bbox[0] <= bbox[2] && bbox[1] <= bbox[3];}
+	bool AcceptsStart(time_t start) const;
+	bool Accepts(const CTrack& track) const;
+};
+
 class CTrack {
 	public:
 		CTrack();
 
-		bool   Load(const char *filename);
+		bool   Load(const char *filename, const TTrackFilter *filter = NULL); // false if the file failed or was rejected
+		bool   WasRejected() const {return rejected;} // by the filter of the last Load()
 		void   Reset();
 
-		size_t GetCount() const  {return points.size();}
+		// A track created from metadata has everything but the points and
+		// segments, LoadPoints() reads them from the file when needed.
+		void   SetMetadata(const TTrackMetadata& meta);
+		void   GetMetadata(TTrackMetadata& meta) const; // without file size and time
+		bool   IsLoaded() const {return loaded;}
+		bool   LoadPoints();
+		bool   UnloadPoints(); // false if the points can not be read again, like those of a sub-track
+		size_t GetPointMemory() const; // of the loaded points, also if not loaded
+		void   SetLastUse(unsigned long long v) {lastUse = v;}
+		unsigned long long GetLastUse() const {return lastUse;}
+
+		size_t GetCount() const  {return pointCount;} // also if not loaded
+		size_t GetSegmentCount() const {return segments.size();}
+		size_t GetSubTrackCount() const {return subTracks.size();}
+		const std::vector<size_t>& GetSegments() const {return segments;} // index of the first point of each segment
+		size_t GetSegmentEnd(size_t idx) const {return (idx + 1 < segments.size()) ? segments[idx+1] : points.size();}
+		bool   ExtractSubTrack(size_t idx, CTrack& result) const;
 		void   GetVertices(bool withZ, const double *origin, const double *scale, std::vector<GLfloat>& data) const;
+		void   GetEncodedVertices(TVertexEncoding encoding, const double *origin, const double *scale, std::vector<GLuint>& data, double trackOrigin[2], double trackExtent[2]) const;
 		const gpxutil::CAABB& GetAABB() const {return aabb;}
 		const gpxutil::CAABB& GetAABBLonLat() const {return aabbLonLat;}
 		double GetLength() const {return totalLen;}
@@ -65,6 +127,7 @@ class CTrack {
 		const char* GetDurationString() const {return durationStr.c_str();}
 
 		time_t GetStartTimestamp() const;
+		const TPoint& GetStartPoint() const {return startPoint;} // also if not loaded
 		static void GetStatLineHeader(char *buf, size_t bufSize, const char *separator="\t", const char *prefix="", const char *suffix="\n");
 		void GetStatLine(char *buf, size_t bufSize, const char *separator="\t", const char *prefix="", const char *suffix="\n") const;
 
@@ -75,6 +138,8 @@ class CTrack {
 
 	private:
 		std::vector<TPoint>       points;
+		std::vector<size_t>       segments;  // index of first point of each <trkseg>
+		std::vector<size_t>       subTracks; // index of first segment of each <trk>
 		std::vector<TLineSegment> lineSegments;
 		gpxutil::CAABB            aabb;
 		gpxutil::CAABB            aabbLonLat;
@@ -82,12 +147,23 @@ class CTrack {
 		double                    totalDuration;
 		double                    projectionScale;
 		size_t                    internalID;
+		size_t                    pointCount;
+		TPoint                    startPoint;
+		bool                      loaded;
+		bool                      reloadable; // from Load() or SetMetadata()
+		bool                      rejected;
+		unsigned long long        lastUse;
 		std::string fullFilename;
 		std::string info;
 		std::string durationStr;
 
 		friend bool IsEqual(const CTrack& a, const CTrack& b);
 		
+		void   ParsePoint(const char *element, const char *filename);
+		size_t ParseBlock(char *block, size_t size, bool final, const char *filename, const TTrackFilter *filter);
+		void   StartSegment(bool newSubTrack);
+		bool   Finalize(const char *filename);
+		void   UpdateInfo();
 		void CalculateLineSegment(TLineSegment& ls, size_t idxA, size_t idxB) const;
 		void CalculateLineSegments();
 };
@@ -3,12 +3,30 @@
 #include "util.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#ifdef GPXVIS_WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 namespace gpximg {
 
+static void putBE32(unsigned char *ptr, unsigned long v)
+{
+	ptr[0] = (unsigned char)(v >> 24);
+	ptr[1] = (unsigned char)(v >> 16);
+	ptr[2] = (unsigned char)(v >> 8);
+	ptr[3] = (unsigned char)v;
+}
+
 const int getFileTypeIndex(const char *filetype, int defaultValue)
 {
 	const char *name;
@@ -33,7 +51,10 @@ const char *getFileTypeName(int index)
 		"tga",
 		"png",
 		"bmp",
-		"jpg"
+		"jpg",
+		"qoi",
+		"ppm",
+		"pam"
 	};
 
 	if (index < 0 || index >= (int)(sizeof(names)/sizeof(names[0]))) {
@@ -42,12 +63,105 @@ const char *getFileTypeName(int index)
 	return names[index];
 }
 
-CImg::CImg() :
+/****************************************************************************
+ * IMAGE BUFFER POOL                                                        *
+ ****************************************************************************/
+
+CImgPool::CImgPool(size_t maxCachedBytes) :
+	cachedBytes(0),
+	maxCached(maxCachedBytes),
+	allocations(0),
+	reuses(0)
+{
+}
+
+CImgPool::~CImgPool()
+{
+	Clear();
+}
+
+size_t CImgPool::GetSizeClass(size_t size)
+{
+	// the three bits below the leading one select the class, at most 12.5% are wasted
+	if (size <= 4096) {
+		return 4096;
+	}
+	int bits = 0;
+	for (size_t s = size - 1; s >= 16; s >>= 1) {
+		bits++;
+	}
+	return (((size - 1) >> bits) + 1) << bits;
+}
+
+unsigned char *CImgPool::Acquire(size_t size, size_t& capacity)
+{
+	capacity = GetSizeClass(size);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<size_t, std::vector<unsigned char*>>::iterator it = buffers.find(capacity);
+		if (it != buffers.end() && !it->second.empty()) {
+			unsigned char *buffer = it->second.back();
+			it->second.pop_back();
+			cachedBytes -= capacity;
+			reuses++;
+			return buffer;
+		}
+		allocations++;
+	}
+	unsigned char *buffer = (unsigned char*)malloc(capacity);
+	if (!buffer) {
+		capacity = 0;
+	}
+	return buffer;
+}
+
+void CImgPool::Release(unsigned char *buffer, size_t capacity)
+{
+	if (!buffer) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (cachedBytes + capacity <= maxCached) {
+			buffers[capacity].push_back(buffer);
+			cachedBytes += capacity;
+			return;
+		}
+	}
+	free(buffer);
+}
+
+void CImgPool::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (std::map<size_t, std::vector<unsigned char*>>::iterator it = buffers.begin(); it != buffers.end(); it++) {
+		for (size_t i=0; i<it->second.size(); i++) {
+			free(it->second[i]);
+		}
+	}
+	buffers.clear();
+	cachedBytes = 0;
+}
+
+size_t CImgPool::GetCachedBytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return cachedBytes;
+}
+
+/****************************************************************************
+ * IMAGES                                                                   *
+ ****************************************************************************/
+
+CImg::CImg(CImgPool *imgPool) :
 	data(NULL),
 	size(0),
+	capacity(0),
+	pool(imgPool),
 	width(0),
 	height(0),
-	channels(0)
+	channels(0),
+	bottomUp(true)
 {
 }
 
@@ -56,37 +170,94 @@ CImg::~CImg()
 	Destroy();
 }
 
+CImg::CImg(CImg&& other) :
+	data(other.data),
+	size(other.size),
+	capacity(other.capacity),
+	pool(other.pool),
+	width(other.width),
+	height(other.height),
+	channels(other.channels),
+	bottomUp(other.bottomUp)
+{
+	other.data = NULL;
+	other.capacity = 0;
+	other.Destroy();
+}
+
+CImg& CImg::operator=(CImg&& other)
+{
+	if (this != &other) {
+		Destroy();
+		data = other.data;
+		size = other.size;
+		capacity = other.capacity;
+		pool = other.pool;
+		width = other.width;
+		height = other.height;
+		channels = other.channels;
+		bottomUp = other.bottomUp;
+		other.data = NULL;
+		other.capacity = 0;
+		other.Destroy();
+	}
+	return *this;
+}
+
 bool CImg::Allocate(int w, int h, int c)
 {
-	Destroy();
 	if (w <= 0 || h <= 0 || c <= 0) {
 		gpxutil::warn("invalid image dims %dx%dx%d",w,h,c);
+		Destroy();
 		return false;
 	}
-	size = (size_t)w * (size_t)h * (size_t)c;
-	data = (unsigned char*)malloc(size);
-	if (!data) {
-		gpxutil::warn("out of memory for image %dx%dx%d",w,h,c);
-		size = 0;
-		return false;
+	size_t newSize = (size_t)w * (size_t)h * (size_t)c;
+	if (!data || newSize > capacity) {
+		Destroy();
+		if (pool) {
+			data = pool->Acquire(newSize, capacity);
+		} else {
+			data = (unsigned char*)malloc(newSize);
+			capacity = newSize;
+		}
+		if (!data) {
+			gpxutil::warn("out of memory for image %dx%dx%d",w,h,c);
+			capacity = 0;
+			return false;
+		}
 	}
+	size = newSize;
 	width = w;
 	height = h;
 	channels = c;
+	bottomUp = true;
 	return true;
 }
 
 void CImg::Destroy()
 {
 	if (data) {
-		free(data);
+		if (pool) {
+			pool->Release(data, capacity);
+		} else {
+			free(data);
+		}
 	}
 	data = NULL;
 	size = 0;
+	capacity = 0;
 	width = height = channels = 0;
+	bottomUp = true;
 }
 
-bool CImg::Write(const char *filename, const char *filetype) const
+static void appendToVector(void *context, void *data, int size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	std::vector<unsigned char> *result = (std::vector<unsigned char>*)context;
+	result->insert(result->end(), bytes, bytes + size);
+}
+
+bool CImg::Write(const char *filename, const char *filetype, const TPNGOptions& png) const
 {
 	int ft = getFileTypeIndex(filetype, -1);
 	int res = 0;
@@ -99,26 +270,1295 @@ bool CImg::Write(const char *filename, const char *filetype) const
 		gpxutil::warn("invalid file type '%s', will use '%s' instead", filetype, getFileTypeName(ft));
 	}
 
-	stbi_flip_vertically_on_write(1);
+	FILE *file;
+	if (ft == 5 || ft == 6) {
+		/* PPM, PAM: directly from the image */
+		char header[128];
+		if (GetRawHeader(ft, header, sizeof(header)) && (file = gpxutil::fopen_wrapper(filename, "wb"))) {
+			res = WriteRaw(file, header);
+			res = !fclose(file) && res;
+		}
+	} else {
+		std::vector<unsigned char> encoded;
+		if (Encode(encoded, getFileTypeName(ft), png) && (file = gpxutil::fopen_wrapper(filename, "wb"))) {
+			res = (fwrite(encoded.data(), encoded.size(), 1, file) == 1);
+			res = !fclose(file) && res;
+		}
+	}
+	if (!res) {
+		gpxutil::warn("failed to write image '%s'", filename);
+	}
+	return (res != 0);
+}
+
+bool CImg::Encode(std::vector<unsigned char>& result, const char *filetype, const TPNGOptions& png) const
+{
+	int ft = getFileTypeIndex(filetype, -1);
+	int res = 0;
+	result.clear();
+	if (!data || size < 1 || ft < 0) {
+		gpxutil::warn("invalid image or file type '%s', can't encode", filetype);
+		return false;
+	}
+
+	stbi_flip_vertically_on_write(bottomUp ? 1 : 0);
 	switch(ft) {
 		case 1: /* PNG */
-			stbi_write_png_compression_level = 9;
-			res = stbi_write_png(filename, width, height, channels, data, width*channels);
+			res = EncodePNG(result, png);
+			break;
+		case 4: /* QOI */
+			res = EncodeQOI(result);
+			break;
+		case 5: /* PPM */
+		case 6: /* PAM */
+			{
+				char header[128];
+				size_t rowSize = (size_t)width * (size_t)channels;
+				if (GetRawHeader(ft, header, sizeof(header))) {
+					size_t headerSize = strlen(header);
+					result.resize(headerSize + size);
+					memcpy(result.data(), header, headerSize);
+					for (int y=0; y<height; y++) {
+						memcpy(result.data() + headerSize + (size_t)y * rowSize, data + (size_t)(bottomUp ? (height - 1 - y) : y) * rowSize, rowSize);
+					}
+					res = 1;
+				}
+			}
 			break;
 		case 2: /* BMP */
-			res = stbi_write_bmp(filename, width, height, channels, data);
+			res = stbi_write_bmp_to_func(appendToVector, &result, width, height, channels, data);
 			break;
 		case 3: /* JPG */
-			res = stbi_write_jpg(filename, width, height, channels, data, 90);
+			res = stbi_write_jpg_to_func(appendToVector, &result, width, height, channels, data, 90);
 			break;
 		default: /* TGA */
-			res = stbi_write_tga(filename, width, height, channels, data);
-
+			res = stbi_write_tga_to_func(appendToVector, &result, width, height, channels, data);
 	}
 	if (!res) {
+		result.clear();
+	}
+	return (res != 0);
+}
+
+bool CImg::GetRawHeader(int ft, char *header, size_t headerSize) const
+{
+	static const char *tupleTypes[4] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+	if (ft == 5 && channels != 1 && channels != 3) {
+		gpxutil::warn("ppm: %d channels not supported", channels);
+		return false;
+	}
+	if (channels < 1 || channels > 4) {
+		gpxutil::warn("pam: %d channels not supported", channels);
+		return false;
+	}
+	if (ft == 5) {
+		mysnprintf(header, headerSize, "P%d\n%d %d\n255\n", (channels == 1) ? 5 : 6, width, height);
+	} else {
+		mysnprintf(header, headerSize, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+			width, height, channels, tupleTypes[channels - 1]);
+	}
+	return true;
+}
+
+bool CImg::WriteRaw(FILE *file, const char *header) const
+{
+	// top-down data goes out in a single write, otherwise row by row
+	size_t rowSize = (size_t)width * (size_t)channels;
+	if (fwrite(header, strlen(header), 1, file) != 1) {
+		return false;
+	}
+	if (!bottomUp) {
+		return (fwrite(data, size, 1, file) == 1);
+	}
+	for (int y=height-1; y>=0; y--) {
+		if (fwrite(data + (size_t)y * rowSize, rowSize, 1, file) != 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CImg::EncodeQOI(std::vector<unsigned char>& result) const
+{
+	// "The Quite OK Image Format" 1.0, in a single pass over the pixels
+	const unsigned char QOI_OP_INDEX = 0x00;
+	const unsigned char QOI_OP_DIFF = 0x40;
+	const unsigned char QOI_OP_LUMA = 0x80;
+	const unsigned char QOI_OP_RUN = 0xc0;
+	const unsigned char QOI_OP_RGB = 0xfe;
+	const unsigned char QOI_OP_RGBA = 0xff;
+	static const unsigned char padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+	unsigned char header[14] = {'q', 'o', 'i', 'f'};
+	unsigned char index[64][4];
+	unsigned char px[4] = {0, 0, 0, 255};
+	unsigned char prev[4] = {0, 0, 0, 255};
+	size_t rowSize = (size_t)width * (size_t)channels;
+	int run = 0;
+
+	result.clear();
+	if (channels != 3 && channels != 4) {
+		gpxutil::warn("qoi: %d channels not supported", channels);
+		return false;
+	}
+	putBE32(header + 4, (unsigned long)width);
+	putBE32(header + 8, (unsigned long)height);
+	header[12] = (unsigned char)channels;
+	header[13] = 0; // sRGB with linear alpha
+	result.reserve(sizeof(header) + size + size / 3 + sizeof(padding));
+	result.insert(result.end(), header, header + sizeof(header));
+	memset(index, 0, sizeof(index));
+
+	for (int y=0; y<height; y++) {
+		const unsigned char *row = data + (size_t)(bottomUp ? (height - 1 - y) : y) * rowSize;
+		for (int x=0; x<width; x++) {
+			memcpy(px, row + (size_t)x * channels, channels);
+			if (!memcmp(px, prev, 4)) {
+				if (++run == 62) {
+					result.push_back((unsigned char)(QOI_OP_RUN | (run - 1)));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				result.push_back((unsigned char)(QOI_OP_RUN | (run - 1)));
+				run = 0;
+			}
+			int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+			if (!memcmp(index[hash], px, 4)) {
+				result.push_back((unsigned char)(QOI_OP_INDEX | hash));
+			} else {
+				memcpy(index[hash], px, 4);
+				if (px[3] == prev[3]) {
+					signed char vr = (signed char)(px[0] - prev[0]);
+					signed char vg = (signed char)(px[1] - prev[1]);
+					signed char vb = (signed char)(px[2] - prev[2]);
+					signed char vgr = (signed char)(vr - vg);
+					signed char vgb = (signed char)(vb - vg);
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						result.push_back((unsigned char)(QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2)));
+					} else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+						result.push_back((unsigned char)(QOI_OP_LUMA | (vg + 32)));
+						result.push_back((unsigned char)(((vgr + 8) << 4) | (vgb + 8)));
+					} else {
+						result.push_back(QOI_OP_RGB);
+						result.insert(result.end(), px, px + 3);
+					}
+				} else {
+					result.push_back(QOI_OP_RGBA);
+					result.insert(result.end(), px, px + 4);
+				}
+			}
+			memcpy(prev, px, 4);
+		}
+	}
+	if (run > 0) {
+		result.push_back((unsigned char)(QOI_OP_RUN | (run - 1)));
+	}
+	result.insert(result.end(), padding, padding + sizeof(padding));
+	return true;
+}
+
+/****************************************************************************
+ * STREAMING IMAGE OUTPUT                                                   *
+ ****************************************************************************/
+
+const int getStreamFileTypeIndex(const char *filetype, int defaultValue)
+{
+	const char *name;
+	int i=0;
+
+	if (!filetype) {
+		return defaultValue;
+	}
+
+	while( (name = getStreamFileTypeName(i)) != NULL) {
+		if (!strcmp(name, filetype)) {
+			return i;
+		}
+		i++;
+	}
+	if (!strcmp(filetype, "tiff")) {
+		return 1;
+	}
+	return defaultValue;
+}
+
+const char *getStreamFileTypeName(int index)
+{
+	const char* names[] = {
+		"png",
+		"tif",
+		"npy"
+	};
+
+	if (index < 0 || index >= (int)(sizeof(names)/sizeof(names[0]))) {
+		return NULL;
+	}
+	return names[index];
+}
+
+static unsigned long pngCRC(unsigned long crc, const unsigned char *ptr, size_t size)
+{
+	static unsigned long table[256];
+	static bool initialized = false;
+
+	if (!initialized) {
+		for (unsigned long n=0; n<256; n++) {
+			unsigned long c = n;
+			for (int k=0; k<8; k++) {
+				c = (c & 1) ? (0xedb88320UL ^ (c >> 1)) : (c >> 1);
+			}
+			table[n] = c;
+		}
+		initialized = true;
+	}
+	crc ^= 0xffffffffUL;
+	for (size_t i=0; i<size; i++) {
+		crc = table[(crc ^ ptr[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffUL;
+}
+
+static void appendLE(std::vector<unsigned char>& buf, unsigned long long v, int bytes)
+{
+	for (int i=0; i<bytes; i++) {
+		buf.push_back((unsigned char)(v >> (8*i)));
+	}
+}
+
+static void appendDoubleLE(std::vector<unsigned char>& buf, double v)
+{
+	unsigned long long bits;
+	memcpy(&bits, &v, sizeof(bits));
+	appendLE(buf, bits, 8);
+}
+
+CImgStreamWriter::CImgStreamWriter() :
+	file(NULL),
+	type(STREAM_PNG),
+	sampleType(SAMPLE_UINT8),
+	width(0),
+	height(0),
+	channels(0),
+	sampleSize(1),
+	rowsWritten(0),
+	failed(false),
+	bigTIFF(false),
+	hasGeo(false),
+	rowSize(0),
+	dataSize(0),
+	adler(1),
+	zstream(NULL)
+{
+	memset(&geoRef, 0, sizeof(geoRef));
+}
+
+CImgStreamWriter::~CImgStreamWriter()
+{
+	if (file) {
+		gpxutil::warn("stream image closed before it was complete");
+		Abort();
+	}
+}
+
+void CImgStreamWriter::Abort()
+{
+#ifdef GPXVIS_WITH_ZLIB
+	if (zstream) {
+		deflateEnd((z_stream*)zstream);
+		delete (z_stream*)zstream;
+	}
+#endif
+	zstream = NULL;
+	if (file) {
+		fclose(file);
+		file = NULL;
+	}
+	prevRow.clear();
+	filtered.clear();
+	deflated.clear();
+}
+
+void CImgStreamWriter::WriteBytes(const void *ptr, size_t size)
+{
+	if (!failed && size > 0 && fwrite(ptr, size, 1, file) != 1) {
+		gpxutil::warn("failed to write %llu bytes to stream image", (unsigned long long)size);
+		failed = true;
+	}
+}
+
+bool CImgStreamWriter::Open(const char *filename, const char *filetype, int w, int h, int c, TSampleType sample, const TGeoReference *geo)
+{
+	int ft = getStreamFileTypeIndex(filetype, -1);
+
+	if (file) {
+		gpxutil::warn("stream image already open");
+		return false;
+	}
+	if (w <= 0 || h <= 0 || c <= 0 || c > 4) {
+		gpxutil::warn("invalid image dims %dx%dx%d",w,h,c);
+		return false;
+	}
+	if (ft < 0) {
+		ft = 0;
+		gpxutil::warn("invalid stream file type '%s', will use '%s' instead", filetype, getStreamFileTypeName(ft));
+	}
+	type = (ft == 2) ? STREAM_NPY : ((ft == 1) ? STREAM_TIFF : STREAM_PNG);
+	if (type == STREAM_PNG && sample != SAMPLE_UINT8) {
+		gpxutil::warn("stream image: %s only supports 8 bit samples", getStreamFileTypeName(ft));
+		return false;
+	}
+
+	file = gpxutil::fopen_wrapper(filename, "wb");
+	if (!file) {
+		gpxutil::warn("failed to open '%s' for writing", filename);
+		return false;
+	}
+	width = w;
+	height = h;
+	channels = c;
+	sampleType = sample;
+	sampleSize = (sample == SAMPLE_FLOAT32) ? 4 : 1;
+	rowsWritten = 0;
+	failed = false;
+	hasGeo = (geo != NULL);
+	if (geo) {
+		geoRef = *geo;
+	}
+	rowSize = (size_t)w * (size_t)c * (size_t)sampleSize;
+	dataSize = (unsigned long long)rowSize * (unsigned long long)h;
+
+	bool success;
+	switch (type) {
+		case STREAM_TIFF:
+			success = OpenTIFF();
+			break;
+		case STREAM_NPY:
+			success = OpenNPY(filename);
+			break;
+		default:
+			success = OpenPNG();
+	}
+	if (!success || failed) {
+		Abort();
+		return false;
+	}
+	gpxutil::info("writing %dx%dx%d image '%s' as %s%s", w, h, c, filename, getStreamFileTypeName(ft),
+		(sample == SAMPLE_FLOAT32) ? ", float" : "");
+	return true;
+}
+
+bool CImgStreamWriter::WriteRows(const void *rows, int count)
+{
+	if (!file || failed) {
+		return false;
+	}
+	if (count > height - rowsWritten) {
+		gpxutil::warn("stream image: too many rows");
+		count = height - rowsWritten;
+		failed = true;
+	}
+	for (int i=0; i<count; i++) {
+		const unsigned char *row = (const unsigned char*)rows + (size_t)i * rowSize;
+		if (type == STREAM_PNG) {
+			WriteRowPNG(row);
+		} else {
+			WriteBytes(row, rowSize);
+		}
+	}
+	rowsWritten += count;
+	return !failed;
+}
+
+bool CImgStreamWriter::Close()
+{
+	if (!file) {
+		return false;
+	}
+	bool success = false;
+	if (rowsWritten != height) {
+		gpxutil::warn("stream image: only %d of %d rows written", rowsWritten, height);
+	} else if (!failed) {
+		switch (type) {
+			case STREAM_TIFF:
+				success = CloseTIFF();
+				break;
+			case STREAM_NPY:
+				success = true; // the header said it all
+				break;
+			default:
+				success = ClosePNG();
+		}
+	}
+	if (fclose(file)) {
+		success = false;
+	}
+	file = NULL;
+	Abort();
+	return success && !failed;
+}
+
+void CImgStreamWriter::WritePNGChunk(const char *chunkType, const unsigned char *ptr, size_t size)
+{
+	unsigned char buf[8];
+	unsigned long crc;
+
+	putBE32(buf, (unsigned long)size);
+	memcpy(buf + 4, chunkType, 4);
+	crc = pngCRC(0, buf + 4, 4);
+	crc = pngCRC(crc, ptr, size);
+	WriteBytes(buf, 8);
+	WriteBytes(ptr, size);
+	putBE32(buf, crc);
+	WriteBytes(buf, 4);
+}
+
+void CImgStreamWriter::Deflate(const unsigned char *ptr, size_t size, bool finish)
+{
+#ifdef GPXVIS_WITH_ZLIB
+	z_stream *zs = (z_stream*)zstream;
+	unsigned char buf[65536];
+	int res;
+
+	zs->next_in = (Bytef*)ptr;
+	zs->avail_in = (uInt)size;
+	do {
+		zs->next_out = buf;
+		zs->avail_out = sizeof(buf);
+		res = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (res == Z_STREAM_ERROR) {
+			gpxutil::warn("stream image: deflate failed");
+			failed = true;
+			return;
+		}
+		deflated.insert(deflated.end(), buf, buf + (sizeof(buf) - zs->avail_out));
+	} while (zs->avail_out == 0 || (finish && res != Z_STREAM_END));
+#else
+	// uncompressed deflate blocks of at most 64KiB, adler32 at the end
+	const unsigned long adlerMod = 65521UL;
+	unsigned long a = adler & 0xffff;
+	unsigned long b = adler >> 16;
+	for (size_t i=0; i<size; i++) {
+		a += ptr[i];
+		b += a;
+		if ((i & 2047) == 2047) {
+			a %= adlerMod;
+			b %= adlerMod;
+		}
+	}
+	adler = ((b % adlerMod) << 16) | (a % adlerMod);
+
+	while (size > 0 || finish) {
+		size_t len = (size > 65535) ? 65535 : size;
+		bool last = finish && (len == size);
+		deflated.push_back(last ? 1 : 0);
+		deflated.push_back((unsigned char)len);
+		deflated.push_back((unsigned char)(len >> 8));
+		deflated.push_back((unsigned char)~len);
+		deflated.push_back((unsigned char)(~len >> 8));
+		deflated.insert(deflated.end(), ptr, ptr + len);
+		ptr += len;
+		size -= len;
+		if (last) {
+			unsigned char buf[4];
+			putBE32(buf, adler);
+			deflated.insert(deflated.end(), buf, buf + 4);
+			break;
+		}
+	}
+#endif
+}
+
+void CImgStreamWriter::FlushIDAT(bool force)
+{
+	const size_t chunkSize = 256 * 1024;
+	size_t pos = 0;
+
+	while (deflated.size() - pos >= chunkSize) {
+		WritePNGChunk("IDAT", deflated.data() + pos, chunkSize);
+		pos += chunkSize;
+	}
+	if (force && deflated.size() > pos) {
+		WritePNGChunk("IDAT", deflated.data() + pos, deflated.size() - pos);
+		pos = deflated.size();
+	}
+	deflated.erase(deflated.begin(), deflated.begin() + pos);
+}
+
+bool CImgStreamWriter::OpenPNG()
+{
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	static const unsigned char colorTypes[4] = {0, 4, 2, 6}; // gray, gray+alpha, RGB, RGBA
+	unsigned char ihdr[13];
+
+	putBE32(ihdr, (unsigned long)width);
+	putBE32(ihdr + 4, (unsigned long)height);
+	ihdr[8] = 8; // bits per channel
+	ihdr[9] = colorTypes[channels - 1];
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // no interlace
+	WriteBytes(signature, sizeof(signature));
+	WritePNGChunk("IHDR", ihdr, sizeof(ihdr));
+
+	prevRow.assign(rowSize, 0);
+	filtered.resize(rowSize + 1);
+	deflated.clear();
+	adler = 1;
+#ifdef GPXVIS_WITH_ZLIB
+	z_stream *zs = new z_stream;
+	memset(zs, 0, sizeof(*zs));
+	if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		gpxutil::warn("stream image: deflateInit failed");
+		delete zs;
+		return false;
+	}
+	zstream = zs;
+#else
+	deflated.push_back(0x78); // zlib header: deflate, 32K window, no compression
+	deflated.push_back(0x01);
+#endif
+	return true;
+}
+
+void CImgStreamWriter::WriteRowPNG(const unsigned char *row)
+{
+#ifdef GPXVIS_WITH_ZLIB
+	// the "up" filter: consecutive rows of the tracks are very similar
+	filtered[0] = 2;
+	for (size_t i=0; i<rowSize; i++) {
+		filtered[i+1] = (unsigned char)(row[i] - prevRow[i]);
+	}
+	memcpy(prevRow.data(), row, rowSize);
+#else
+	// no filter, it would not help without compression
+	filtered[0] = 0;
+	memcpy(filtered.data() + 1, row, rowSize);
+#endif
+	Deflate(filtered.data(), filtered.size(), false);
+	FlushIDAT(false);
+}
+
+bool CImgStreamWriter::ClosePNG()
+{
+	Deflate(NULL, 0, true);
+	FlushIDAT(true);
+	WritePNGChunk("IEND", NULL, 0);
+	return !failed;
+}
+
+bool CImgStreamWriter::OpenTIFF()
+{
+	// The pixel data follows the header directly, as a single strip, the
+	// IFD goes after it. So all offsets are known in advance and we never
+	// need to seek in the file.
+	std::vector<unsigned char> header;
+	unsigned long long ifdOffset = 8 + dataSize + (dataSize & 1);
+	bigTIFF = (ifdOffset + 512 > 0xffffffffULL);
+	header.push_back('I');
+	header.push_back('I');
+	if (bigTIFF) {
+		ifdOffset += 8;
+		appendLE(header, 43, 2);
+		appendLE(header, 8, 2); // size of offsets
+		appendLE(header, 0, 2);
+		appendLE(header, ifdOffset, 8);
+	} else {
+		appendLE(header, 42, 2);
+		appendLE(header, ifdOffset, 4);
+	}
+	WriteBytes(header.data(), header.size());
+	return true;
+}
+
+bool CImgStreamWriter::CloseTIFF()
+{
+	// The entries in ascending order of the tags. Values which do not fit
+	// into their entry go after the IFD.
+	struct TEntry {
+		unsigned tag;
+		unsigned fieldType;
+		unsigned long long count;
+		std::vector<unsigned char> value;
+	};
+	const unsigned SHORT = 3;
+	const unsigned LONG = 4;
+	const unsigned DOUBLE = 12;
+	const unsigned LONG8 = 16;
+	unsigned long long dataOffset = bigTIFF ? 16 : 8;
+	unsigned long long ifdOffset = dataOffset + dataSize + (dataSize & 1);
+	int offsetBytes = bigTIFF ? 8 : 4;
+	unsigned offsetType = bigTIFF ? LONG8 : LONG;
+	std::vector<TEntry> entries;
+
+	auto entry = [&](unsigned tag, unsigned fieldType, unsigned long long count) -> std::vector<unsigned char>& {
+		TEntry e;
+		e.tag = tag;
+		e.fieldType = fieldType;
+		e.count = count;
+		entries.push_back(e);
+		return entries.back().value;
+	};
+	auto single = [&](unsigned tag, unsigned fieldType, unsigned long long value) {
+		appendLE(entry(tag, fieldType, 1), value, (fieldType == SHORT) ? 2 : ((fieldType == LONG) ? 4 : 8));
+	};
+
+	if (dataSize & 1) {
+		unsigned char pad = 0;
+		WriteBytes(&pad, 1);
+	}
+	single(256, LONG, (unsigned long long)width);
+	single(257, LONG, (unsigned long long)height);
+	std::vector<unsigned char>& bits = entry(258, SHORT, channels);
+	for (int i=0; i<channels; i++) {
+		appendLE(bits, 8 * sampleSize, 2);
+	}
+	single(259, SHORT, 1); // no compression
+	single(262, SHORT, (channels >= 3) ? 2 : 1); // RGB or min-is-black
+	single(273, offsetType, dataOffset);
+	single(277, SHORT, (unsigned long long)channels);
+	single(278, LONG, (unsigned long long)height);
+	single(279, offsetType, dataSize);
+	single(284, SHORT, 1); // chunky
+	if (channels == 2 || channels == 4) {
+		single(338, SHORT, 2); // unassociated alpha
+	}
+	if (sampleType == SAMPLE_FLOAT32) {
+		std::vector<unsigned char>& format = entry(339, SHORT, channels);
+		for (int i=0; i<channels; i++) {
+			appendLE(format, 3, 2); // IEEE floating point
+		}
+	}
+	if (hasGeo) {
+		// GeoTIFF: pixel size, the upper left corner, and the CRS
+		double *b = geoRef.bounds;
+		std::vector<unsigned char>& scale = entry(33550, DOUBLE, 3);
+		appendDoubleLE(scale, (b[2] - b[0]) / width);
+		appendDoubleLE(scale, (b[3] - b[1]) / height);
+		appendDoubleLE(scale, 0.0);
+		std::vector<unsigned char>& tiepoint = entry(33922, DOUBLE, 6);
+		const double tie[6] = {0.0, 0.0, 0.0, b[0], b[3], 0.0};
+		for (int i=0; i<6; i++) {
+			appendDoubleLE(tiepoint, tie[i]);
+		}
+		const unsigned keys[16] = {
+			1, 1, 0, 3,                        // version 1.1.0, 3 keys
+			1024, 0, 1, 1,                     // GTModelTypeGeoKey: projected
+			1025, 0, 1, 1,                     // GTRasterTypeGeoKey: pixel is area
+			3072, 0, 1, (unsigned)geoRef.epsg  // ProjectedCSTypeGeoKey
+		};
+		std::vector<unsigned char>& directory = entry(34735, SHORT, 16);
+		for (int i=0; i<16; i++) {
+			appendLE(directory, keys[i], 2);
+		}
+	}
+
+	std::vector<unsigned char> ifd;
+	std::vector<unsigned char> external;
+	unsigned long long externalOffset = ifdOffset + (bigTIFF ? 8 : 2) + (unsigned long long)entries.size() * (bigTIFF ? 20 : 12) + offsetBytes;
+	appendLE(ifd, entries.size(), bigTIFF ? 8 : 2);
+	for (size_t i=0; i<entries.size(); i++) {
+		std::vector<unsigned char>& value = entries[i].value;
+		appendLE(ifd, entries[i].tag, 2);
+		appendLE(ifd, entries[i].fieldType, 2);
+		appendLE(ifd, entries[i].count, offsetBytes);
+		if (value.size() <= (size_t)offsetBytes) {
+			value.resize(offsetBytes, 0);
+			ifd.insert(ifd.end(), value.begin(), value.end());
+		} else {
+			appendLE(ifd, externalOffset + external.size(), offsetBytes);
+			external.insert(external.end(), value.begin(), value.end());
+			if (external.size() & 1) {
+				external.push_back(0);
+			}
+		}
+	}
+	appendLE(ifd, 0, offsetBytes); // no next IFD
+	WriteBytes(ifd.data(), ifd.size());
+	WriteBytes(external.data(), external.size());
+	return !failed;
+}
+
+bool CImgStreamWriter::OpenNPY(const char *filename)
+{
+	// format version 1.0: the header is padded so that the data starts
+	// at a multiple of 64 bytes
+	char dict[256];
+	int len;
+	const char *descr = (sampleType == SAMPLE_FLOAT32) ? "<f4" : "|u1";
+	if (channels > 1) {
+		len = mysnprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%d, %d, %d), }", descr, height, width, channels);
+	} else {
+		len = mysnprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%d, %d), }", descr, height, width);
+	}
+	std::vector<unsigned char> header;
+	static const unsigned char magic[8] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0};
+	size_t headerLen = ((10 + (size_t)len + 1 + 63) / 64) * 64 - 10;
+	header.insert(header.end(), magic, magic + 8);
+	appendLE(header, headerLen, 2);
+	header.insert(header.end(), dict, dict + len);
+	header.resize(10 + headerLen - 1, ' ');
+	header.push_back('\n');
+	WriteBytes(header.data(), header.size());
+
+	if (hasGeo) {
+		// numpy does not allow any further keys in the header
+		std::string geoName = std::string(filename) + ".json";
+		FILE *geoFile = gpxutil::fopen_wrapper(geoName.c_str(), "wt");
+		if (!geoFile) {
+			gpxutil::warn("failed to open '%s' for writing", geoName.c_str());
+			return false;
+		}
+		fprintf(geoFile, "{\n\t\"width\": %d,\n\t\"height\": %d,\n\t\"rows\": \"top-down\",\n\t\"epsg\": %d,\n"
+			"\t\"bounds\": [%.17g, %.17g, %.17g, %.17g]\n}\n",
+			width, height, geoRef.epsg, geoRef.bounds[0], geoRef.bounds[1], geoRef.bounds[2], geoRef.bounds[3]);
+		if (fclose(geoFile)) {
+			gpxutil::warn("failed to write '%s'", geoName.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+/****************************************************************************
+ * PARALLEL PNG OUTPUT                                                      *
+ ****************************************************************************/
+
+TPNGOptions::TPNGOptions() :
+	level(6),
+	filter(PNG_FILTER_ADAPTIVE),
+	stripeSize(256*1024)
+{
+}
+
+static inline int paethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return (pb <= pc) ? b : c;
+}
+
+/* filter a row of size bytes into out, prev is the row above, all zero for the first row */
+static void filterPNGRow(int filter, const unsigned char *row, const unsigned char *prev, size_t size, size_t bpp, unsigned char *out)
+{
+	size_t i;
+
+	switch (filter) {
+		case PNG_FILTER_SUB:
+			memcpy(out, row, bpp);
+			for (i=bpp; i<size; i++) {
+				out[i] = (unsigned char)(row[i] - row[i - bpp]);
+			}
+			break;
+		case PNG_FILTER_UP:
+			for (i=0; i<size; i++) {
+				out[i] = (unsigned char)(row[i] - prev[i]);
+			}
+			break;
+		case PNG_FILTER_AVERAGE:
+			for (i=0; i<bpp; i++) {
+				out[i] = (unsigned char)(row[i] - (prev[i] >> 1));
+			}
+			for (; i<size; i++) {
+				out[i] = (unsigned char)(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+			}
+			break;
+		case PNG_FILTER_PAETH:
+			for (i=0; i<bpp; i++) {
+				out[i] = (unsigned char)(row[i] - prev[i]);
+			}
+			for (; i<size; i++) {
+				out[i] = (unsigned char)(row[i] - paethPredictor(row[i - bpp], prev[i], prev[i - bpp]));
+			}
+			break;
+		default:
+			memcpy(out, row, size);
+	}
+}
+
+bool CImg::EncodePNG(std::vector<unsigned char>& result, const TPNGOptions& png) const
+{
+	result.clear();
+	if (!data || size < 1 || channels > 4) {
+		gpxutil::warn("invalid image, can't encode");
+		return false;
+	}
+	int level = (png.level < 0) ? 0 : ((png.level > 9) ? 9 : png.level);
+#ifdef GPXVIS_WITH_ZLIB
+	// In the style of pigz: the filtered rows are split into stripes which
+	// are deflated in parallel, each primed with the 32KiB of data before
+	// it. A sync flush ends each stripe on a byte boundary, so the pieces
+	// just need to be put together, and the adler32 sums combined.
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	static const unsigned char colorTypes[4] = {0, 4, 2, 6}; // gray, gray+alpha, RGB, RGBA
+	const size_t windowSize = 32768;
+	size_t rowSize = (size_t)width * (size_t)channels;
+	size_t filteredRowSize = rowSize + 1;
+	size_t stripeRows = (png.stripeSize > filteredRowSize) ? (png.stripeSize / filteredRowSize) : 1;
+	size_t stripes = ((size_t)height + stripeRows - 1) / stripeRows;
+	std::vector<unsigned char> filtered(filteredRowSize * (size_t)height);
+	std::vector<std::vector<unsigned char>> deflated(stripes);
+	std::vector<unsigned long> adlers(stripes);
+	std::atomic<bool> failed(false);
+
+	gpxutil::parallelFor(stripes, [&](size_t s) {
+		std::vector<unsigned char> zeros;
+		std::vector<unsigned char> candidate;
+		size_t end = std::min((s + 1) * stripeRows, (size_t)height);
+		for (size_t y=s * stripeRows; y<end; y++) {
+			const unsigned char *row = data + (bottomUp ? ((size_t)height - 1 - y) : y) * rowSize;
+			const unsigned char *prev = bottomUp ? (row + rowSize) : (row - rowSize);
+			unsigned char *out = &filtered[y * filteredRowSize];
+			if (y == 0) {
+				zeros.assign(rowSize, 0);
+				prev = zeros.data();
+			}
+			if (png.filter != PNG_FILTER_ADAPTIVE) {
+				out[0] = (unsigned char)png.filter;
+				filterPNGRow(png.filter, row, prev, rowSize, channels, out + 1);
+				continue;
+			}
+			// the smallest sum of the absolute signed values, as libpng does
+			unsigned long best = 0;
+			candidate.resize(rowSize);
+			for (int f=PNG_FILTER_NONE; f<PNG_FILTER_ADAPTIVE; f++) {
+				unsigned long sum = 0;
+				filterPNGRow(f, row, prev, rowSize, channels, candidate.data());
+				for (size_t i=0; i<rowSize; i++) {
+					sum += (unsigned long)abs((int)(signed char)candidate[i]);
+				}
+				if (f == PNG_FILTER_NONE || sum < best) {
+					best = sum;
+					out[0] = (unsigned char)f;
+					memcpy(out + 1, candidate.data(), rowSize);
+				}
+			}
+		}
+	});
+
+	gpxutil::parallelFor(stripes, [&](size_t s) {
+		size_t begin = s * stripeRows * filteredRowSize;
+		size_t len = std::min((s + 1) * stripeRows, (size_t)height) * filteredRowSize - begin;
+		bool last = (s + 1 == stripes);
+		std::vector<unsigned char>& out = deflated[s];
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			failed = true;
+			return;
+		}
+		if (begin > 0) {
+			size_t dictSize = std::min(begin, windowSize);
+			deflateSetDictionary(&zs, &filtered[begin - dictSize], (uInt)dictSize);
+		}
+		out.resize(deflateBound(&zs, (uLong)len) + 16);
+		zs.next_in = &filtered[begin];
+		zs.avail_in = (uInt)len;
+		zs.next_out = out.data();
+		zs.avail_out = (uInt)out.size();
+		int res = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if ((last && res != Z_STREAM_END) || (!last && (res != Z_OK || zs.avail_in > 0))) {
+			failed = true;
+		}
+		out.resize(zs.total_out);
+		deflateEnd(&zs);
+		adlers[s] = adler32(adler32(0L, Z_NULL, 0), &filtered[begin], (uInt)len);
+	});
+	if (failed) {
+		gpxutil::warn("png: deflate failed");
+		return false;
+	}
+
+	// zlib header with the level hint, the stripes, and the combined adler32
+	std::vector<unsigned char> zdata;
+	unsigned long adler = adlers[0];
+	unsigned char buf[13];
+	zdata.push_back(0x78);
+	zdata.push_back((level < 2) ? 0x01 : ((level < 6) ? 0x5e : ((level == 6) ? 0x9c : 0xda)));
+	for (size_t s=0; s<stripes; s++) {
+		if (s > 0) {
+			size_t len = std::min((s + 1) * stripeRows, (size_t)height) * filteredRowSize - s * stripeRows * filteredRowSize;
+			adler = adler32_combine(adler, adlers[s], (z_off_t)len);
+		}
+		zdata.insert(zdata.end(), deflated[s].begin(), deflated[s].end());
+	}
+	putBE32(buf, adler);
+	zdata.insert(zdata.end(), buf, buf + 4);
+
+	auto chunk = [&result](const char *chunkType, const unsigned char *ptr, size_t chunkSize) {
+		unsigned char header[8];
+		putBE32(header, (unsigned long)chunkSize);
+		memcpy(header + 4, chunkType, 4);
+		uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+		if (chunkSize > 0) {
+			crc = crc32(crc, ptr, (uInt)chunkSize); // a NULL pointer would reset it
+		}
+		result.insert(result.end(), header, header + 8);
+		result.insert(result.end(), ptr, ptr + chunkSize);
+		putBE32(header, crc);
+		result.insert(result.end(), header, header + 4);
+	};
+	const size_t maxChunk = 1024 * 1024;
+	result.reserve(zdata.size() + zdata.size() / maxChunk * 12 + 64);
+	result.insert(result.end(), signature, signature + 8);
+	putBE32(buf, (unsigned long)width);
+	putBE32(buf + 4, (unsigned long)height);
+	buf[8] = 8; // bits per channel
+	buf[9] = colorTypes[channels - 1];
+	buf[10] = 0; // deflate
+	buf[11] = 0; // adaptive filtering
+	buf[12] = 0; // no interlace
+	chunk("IHDR", buf, 13);
+	for (size_t pos = 0; pos < zdata.size(); pos += maxChunk) {
+		chunk("IDAT", zdata.data() + pos, std::min(maxChunk, zdata.size() - pos));
+	}
+	chunk("IEND", NULL, 0);
+	return true;
+#else
+	// stb does it all on a single thread
+	int len = 0;
+	stbi_flip_vertically_on_write(bottomUp ? 1 : 0);
+	stbi_write_png_compression_level = level;
+	stbi_write_force_png_filter = (png.filter == PNG_FILTER_ADAPTIVE) ? -1 : (int)png.filter;
+	unsigned char *encoded = stbi_write_png_to_mem(data, width * channels, width, height, channels, &len);
+	stbi_write_force_png_filter = -1;
+	if (!encoded) {
+		gpxutil::warn("png: encoding failed");
+		return false;
+	}
+	result.assign(encoded, encoded + len);
+	STBIW_FREE(encoded);
+	return true;
+#endif
+}
+
+extern void benchmarkPNG(const TPNGOptions& png)
+{
+	// Something like a frame: a dark gradient, some noise and a bunch of
+	// bright lines. The stb path is what Write() used before, at level 9.
+	const int sizes[4][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}, {7680, 4320}};
+	const int repetitions = 3;
+
+	gpxutil::info("png benchmark: level %d, filter %d, stripes of %u bytes, %u threads",
+		png.level, (int)png.filter, (unsigned)png.stripeSize, gpxutil::getWorkerThreadCount());
+	for (int i=0; i<4; i++) {
+		CImg img;
+		int w = sizes[i][0];
+		int h = sizes[i][1];
+		if (!img.Allocate(w, h, 3)) {
+			return;
+		}
+		unsigned char *ptr = img.GetData();
+		unsigned long seed = 12345;
+		for (int y=0; y<h; y++) {
+			for (int x=0; x<w; x++) {
+				seed = seed * 1103515245UL + 12345UL;
+				unsigned char noise = (unsigned char)((seed >> 16) & 3);
+				ptr[0] = (unsigned char)(16 + (x * 32) / w + noise);
+				ptr[1] = (unsigned char)(16 + (y * 32) / h + noise);
+				ptr[2] = (unsigned char)(48 + noise);
+				ptr += 3;
+			}
+		}
+		for (int l=0; l<200; l++) {
+			seed = seed * 1103515245UL + 12345UL;
+			int x0 = (int)((seed >> 8) % (unsigned long)w);
+			int y0 = (int)((seed >> 4) % (unsigned long)h);
+			int len = (int)((seed >> 12) % 400) + 50;
+			for (int j=0; j<len; j++) {
+				int x = x0 + j;
+				int y = y0 + (j * (l % 7 - 3)) / 4;
+				if (x >= 0 && x < w && y >= 0 && y < h) {
+					unsigned char *p = img.GetData() + ((size_t)y * w + x) * 3;
+					p[0] = 255;
+					p[1] = (unsigned char)(160 + l % 64);
+					p[2] = 32;
+				}
+			}
+		}
+
+		double bytes = (double)img.GetSize() * repetitions;
+		std::vector<unsigned char> result;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int r=0; r<repetitions; r++) {
+			img.EncodePNG(result, png);
+		}
+		double parallelTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		size_t parallelSize = result.size();
+
+		int len = 0;
+		stbi_flip_vertically_on_write(1);
+		stbi_write_png_compression_level = 9;
+		stbi_write_force_png_filter = -1;
+		start = std::chrono::steady_clock::now();
+		for (int r=0; r<repetitions; r++) {
+			unsigned char *encoded = stbi_write_png_to_mem(img.GetData(), w * 3, w, h, 3, &len);
+			STBIW_FREE(encoded);
+		}
+		double stbTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		gpxutil::info("png benchmark %dx%d: parallel %.1f ms (%.1f MB/s, %.2f%%), stb %.1f ms (%.1f MB/s, %.2f%%), speedup %.1f",
+			w, h, 1000.0 * parallelTime / repetitions, bytes / parallelTime / 1.0e6, 100.0 * parallelSize / img.GetSize(),
+			1000.0 * stbTime / repetitions, bytes / stbTime / 1.0e6, 100.0 * len / img.GetSize(),
+			stbTime / parallelTime);
+	}
+}
+
+/****************************************************************************
+ * FRAME SEQUENCE OUTPUT                                                    *
+ ****************************************************************************/
+
+TPipelineStats::TPipelineStats()
+{
+	Reset();
+}
+
+void TPipelineStats::Reset()
+{
+	for (int i=0; i<PIPELINE_STAGE_COUNT; i++) {
+		frames[i] = 0;
+		busy[i] = 0.0;
+		stall[i] = 0.0;
+	}
+	bytesWritten = 0;
+	duplicates = 0;
+	elapsed = 0.0;
+}
+
+void TPipelineStats::Add(TPipelineStage stage, double busySeconds, double stallSeconds)
+{
+	frames[stage]++;
+	busy[stage] += busySeconds;
+	stall[stage] += stallSeconds;
+}
+
+TPipelineStats TPipelineStats::Since(const TPipelineStats& earlier) const
+{
+	TPipelineStats result;
+	for (int i=0; i<PIPELINE_STAGE_COUNT; i++) {
+		result.frames[i] = frames[i] - earlier.frames[i];
+		result.busy[i] = busy[i] - earlier.busy[i];
+		result.stall[i] = stall[i] - earlier.stall[i];
+	}
+	result.bytesWritten = bytesWritten - earlier.bytesWritten;
+	result.duplicates = duplicates - earlier.duplicates;
+	result.elapsed = elapsed - earlier.elapsed;
+	return result;
+}
+
+TPipelineStage TPipelineStats::GetBottleneck() const
+{
+	int best = PIPELINE_RENDER;
+	for (int i=1; i<PIPELINE_STAGE_COUNT; i++) {
+		if (busy[i] + stall[i] > busy[best] + stall[best]) {
+			best = i;
+		}
+	}
+	return (TPipelineStage)best;
+}
+
+const char *TPipelineStats::GetStageName(TPipelineStage stage)
+{
+	static const char *names[PIPELINE_STAGE_COUNT] = {"render", "readback", "encode", "write"};
+	return ((int)stage >= 0 && stage < PIPELINE_STAGE_COUNT) ? names[stage] : "unknown";
+}
+
+void TPipelineStats::Log() const
+{
+	char buf[512];
+	size_t len = 0;
+	double fps = (elapsed > 0.0) ? (double)frames[PIPELINE_WRITE] / elapsed : 0.0;
+	len += mysnprintf(buf + len, sizeof(buf) - len, "pipeline: %.1ffps, %.1fMB/s, %lu dup", fps,
+		(elapsed > 0.0) ? (double)bytesWritten / (1024.0 * 1024.0 * elapsed) : 0.0, duplicates);
+	for (int i=0; i<PIPELINE_STAGE_COUNT && len < sizeof(buf); i++) {
+		double n = (frames[i] > 0) ? (double)frames[i] : 1.0;
+		len += mysnprintf(buf + len, sizeof(buf) - len, ", %s %.2f+%.2fms", GetStageName((TPipelineStage)i),
+			1000.0 * busy[i] / n, 1000.0 * stall[i] / n);
+	}
+	gpxutil::info("%s (busy+stall per frame), bound by %s", buf, GetStageName(GetBottleneck()));
+}
+
+bool TPipelineStats::WriteJSON(const char *filename) const
+{
+	FILE *file = gpxutil::fopen_wrapper(filename, "wt");
+	if (!file) {
+		gpxutil::warn("failed to open '%s' for writing", filename);
+		return false;
+	}
+	fprintf(file, "{\n\t\"elapsed\": %.6f,\n\t\"bytes_written\": %llu,\n\t\"duplicates\": %lu,\n\t\"bottleneck\": \"%s\",\n\t\"stages\": {\n",
+		elapsed, bytesWritten, duplicates, GetStageName(GetBottleneck()));
+	for (int i=0; i<PIPELINE_STAGE_COUNT; i++) {
+		fprintf(file, "\t\t\"%s\": {\"frames\": %lu, \"busy\": %.6f, \"stall\": %.6f}%s\n", GetStageName((TPipelineStage)i),
+			frames[i], busy[i], stall[i], (i + 1 < PIPELINE_STAGE_COUNT) ? "," : "");
+	}
+	fprintf(file, "\t}\n}\n");
+	if (fclose(file)) {
+		gpxutil::warn("failed to write '%s'", filename);
+		return false;
+	}
+	gpxutil::info("wrote pipeline stats to '%s'", filename);
+	return true;
+}
+
+CFrameWriter::CFrameWriter() :
+	deduplicate(true),
+	stats(NULL),
+	concatFile(NULL),
+	frameDuration(1.0/60.0),
+	lastRepeat(0),
+	frames(0),
+	duplicates(0)
+{
+}
+
+CFrameWriter::~CFrameWriter()
+{
+	Finish();
+}
+
+bool CFrameWriter::OpenConcatList(const char *filename, double duration)
+{
+	Finish();
+	concatFile = gpxutil::fopen_wrapper(filename, "wt");
+	if (!concatFile) {
+		gpxutil::warn("failed to open concat list '%s'", filename);
+		return false;
+	}
+	frameDuration = duration;
+	concatDir = gpxutil::getAbsolutePath(filename);
+	concatDir.erase(concatDir.find_last_of("/\\") + 1);
+	fprintf(concatFile, "ffconcat version 1.0\n");
+	gpxutil::info("writing concat list '%s', %f s per frame", filename, duration);
+	return true;
+}
+
+bool CFrameWriter::IsDuplicate(const CImg& img) const
+{
+	// compared exactly, GetImage() always delivers the same row order
+	if (!deduplicate || !last.GetData() || img.GetWidth() != last.GetWidth() || img.GetHeight() != last.GetHeight() ||
+	    img.GetChannels() != last.GetChannels() || img.IsBottomUp() != last.IsBottomUp()) {
+		return false;
+	}
+	return !memcmp(img.GetData(), last.GetData(), img.GetSize());
+}
+
+void CFrameWriter::FlushConcatEntry(bool closing)
+{
+	if (!concatFile || !lastRepeat) {
+		return;
+	}
+	// the demuxer resolves relative names from the directory of the list,
+	// frames outside of it get their absolute path
+	std::string name = gpxutil::getAbsolutePath(lastFilename);
+	if (name.empty()) {
+		name = lastFilename;
+	} else if (!concatDir.empty() && !name.compare(0, concatDir.length(), concatDir)) {
+		name.erase(0, concatDir.length());
+	}
+	// single quotes are escaped as '\''
+	std::string escaped;
+	for (const char *c = name.c_str(); *c; c++) {
+		if (*c == '\'') {
+			escaped += "'\\''";
+		} else {
+			escaped += *c;
+		}
+	}
+	fprintf(concatFile, "file '%s'\nduration %.9g\n", escaped.c_str(), frameDuration * (double)lastRepeat);
+	if (closing) {
+		// the demuxer ignores the duration of the very last entry
+		fprintf(concatFile, "file '%s'\n", escaped.c_str());
+	}
+	lastRepeat = 0;
+}
+
+bool CFrameWriter::WriteFile(const char *filename, const std::vector<unsigned char>& encoded)
+{
+	FILE *file = gpxutil::fopen_wrapper(filename, "wb");
+	if (!file) {
+		gpxutil::warn("failed to open '%s' for writing", filename);
+		return false;
+	}
+	bool success = (fwrite(encoded.data(), encoded.size(), 1, file) == 1);
+	success = !fclose(file) && success;
+	if (!success) {
 		gpxutil::warn("failed to write image '%s'", filename);
+	} else if (stats) {
+		stats->bytesWritten += encoded.size();
+	}
+	return success;
+}
+
+bool CFrameWriter::WriteFrame(CImg&& img, const char *filename, const char *filetype, const TPNGOptions& png)
+{
+	double start = gpxutil::getTime();
+	frames++;
+	if (IsDuplicate(img)) {
+		duplicates++;
+		bool reused = (concatFile != NULL);
+		if (reused) {
+			lastRepeat++;
+		} else if (!(reused = gpxutil::linkFile(lastFilename, filename))) {
+			gpxutil::warn("failed to link '%s' to '%s', writing it again", filename, lastFilename.c_str());
+		}
+		if (reused) {
+			if (stats) {
+				stats->duplicates++;
+				stats->Add(PIPELINE_ENCODE, 0.0);
+				stats->Add(PIPELINE_WRITE, gpxutil::getTime() - start);
+			}
+			return true;
+		}
+	}
+
+	// encoded in memory, so that the disk time is measured on its own
+	std::vector<unsigned char> encoded;
+	bool success = img.Encode(encoded, filetype, png);
+	double encodedTime = gpxutil::getTime();
+	if (stats) {
+		stats->Add(PIPELINE_ENCODE, encodedTime - start);
+	}
+	if (success) {
+		FlushConcatEntry(false);
+		success = WriteFile(filename, encoded);
+		if (stats) {
+			stats->Add(PIPELINE_WRITE, gpxutil::getTime() - encodedTime);
+		}
+	}
+	if (!success) {
+		last.Destroy();
+		return false;
+	}
+	lastFilename = filename;
+	lastRepeat = 1;
+	if (deduplicate) {
+		// the previous image goes back to its pool
+		last = std::move(img);
 	}
 	return true;
 }
 
+void CFrameWriter::Finish()
+{
+	if (frames > 0) {
+		gpxutil::info("frame output: %lu frames, %lu duplicates", frames, duplicates);
+	}
+	FlushConcatEntry(true);
+	if (concatFile) {
+		fclose(concatFile);
+		concatFile = NULL;
+	}
+	concatDir.clear();
+	last.Destroy();
+	lastFilename.clear();
+	lastRepeat = 0;
+	frames = 0;
+	duplicates = 0;
+}
+
 } // namespace gpximg
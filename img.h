@@ -1,27 +1,85 @@
 #ifndef GPXVIS_IMG_H
 #define GPXVIS_IMG_H
 
+#include <stdio.h>
 #include <stdlib.h>
 
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace gpximg {
 
 const int getFileTypeIndex(const char *filetype, int defaultValue = 0);
 const char *getFileTypeName(int index);
 
+typedef enum {
+	PNG_FILTER_NONE,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+	PNG_FILTER_ADAPTIVE // the best of all per row, like stb and libpng do
+} TPNGFilter;
+
+struct TPNGOptions {
+	int        level;      // zlib compression level, 0 to 9
+	TPNGFilter filter;     // a fixed filter skips the search per row
+	size_t     stripeSize; // of the filtered data each worker deflates, in bytes
+
+	TPNGOptions();
+};
+
+/* Keeps the buffers of destroyed images for the next ones, so that a frame
+ * loop does not malloc and page in a whole frame each time. The buffers are
+ * grouped into size classes of 1/8 octave, an image takes one of the class
+ * of its size. Thread-safe, images may be destroyed on any thread. */
+class CImgPool {
+	public:
+		CImgPool(size_t maxCachedBytes = 512 * 1024 * 1024);
+		~CImgPool();
+
+		CImgPool(const CImgPool& other) = delete;
+		CImgPool(CImgPool&& other) = delete;
+		CImgPool& operator=(const CImgPool& other) = delete;
+		CImgPool& operator=(CImgPool&& other) = delete;
+
+		unsigned char *Acquire(size_t size, size_t& capacity);
+		void Release(unsigned char *buffer, size_t capacity);
+		void Clear();
+
+		size_t GetCachedBytes() const;
+		unsigned long GetAllocationCount() const {return allocations;}
+		unsigned long GetReuseCount() const {return reuses;}
+
+		static size_t GetSizeClass(size_t size);
+	private:
+		mutable std::mutex mutex;
+		std::map<size_t, std::vector<unsigned char*>> buffers; // by capacity
+		size_t cachedBytes;
+		size_t maxCached;
+		unsigned long allocations;
+		unsigned long reuses;
+};
+
 class CImg {
 	public:
-		CImg();
+		explicit CImg(CImgPool *imgPool = NULL); // without a pool, the buffers are malloc()ed and free()d
 		~CImg();
 
 		CImg(const CImg& other) = delete;
-		CImg(CImg&& other) = delete;
+		CImg(CImg&& other);
 		CImg& operator=(const CImg& other) = delete;
-		CImg& operator=(CImg&& other) = delete;
+		CImg& operator=(CImg&& other);
 
-		bool Allocate(int w, int h, int c);
+		bool Allocate(int w, int h, int c); // keeps the buffer if it is large enough
 		void Destroy();
 
-		bool Write(const char *filename, const char *filetype) const;
+		bool Write(const char *filename, const char *filetype, const TPNGOptions& png = TPNGOptions()) const;
+		bool Encode(std::vector<unsigned char>& result, const char *filetype, const TPNGOptions& png = TPNGOptions()) const; // the whole file
+		bool EncodePNG(std::vector<unsigned char>& result, const TPNGOptions& png = TPNGOptions()) const;
 
 		int GetWidth() const {return width;}
 		int GetHeight() const {return height;}
@@ -29,12 +87,184 @@ class CImg {
 		size_t GetSize() const {return size;}
 		const unsigned char* GetData() const {return data;}
 		unsigned char* GetData() {return data;}
+		bool IsBottomUp() const {return bottomUp;}
+		void SetBottomUp(bool enabled) {bottomUp = enabled;} // the row order of the data, bottom-up as the GL delivers it by default
 	private:
 		unsigned char *data;
 		size_t size;
+		size_t capacity;
+		CImgPool *pool;
 		int  width;
 		int  height;
 		int  channels;
+		bool bottomUp;
+
+		bool GetRawHeader(int ft, char *header, size_t headerSize) const; // PPM or PAM
+		bool WriteRaw(FILE *file, const char *header) const;
+		bool EncodeQOI(std::vector<unsigned char>& result) const;
+};
+
+/* encode synthetic frames of several sizes with EncodePNG() and with stb,
+ * and log the throughput */
+extern void benchmarkPNG(const TPNGOptions& png);
+
+/****************************************************************************
+ * STREAMING IMAGE OUTPUT                                                   *
+ ****************************************************************************/
+
+/* file types supported by CImgStreamWriter */
+const int getStreamFileTypeIndex(const char *filetype, int defaultValue = 0);
+const char *getStreamFileTypeName(int index);
+
+typedef enum {
+	SAMPLE_UINT8,
+	SAMPLE_FLOAT32
+} TSampleType;
+
+/* the area the image covers, in a projected coordinate system */
+struct TGeoReference {
+	int    epsg;      // e.g. 3857 for web mercator
+	double bounds[4]; // min x, min y, max x, max y of the outer pixel edges
+};
+
+/* Write an image row by row, top to bottom, without ever holding the whole
+ * image in memory. PNG is deflated with zlib if available, otherwise it uses
+ * uncompressed deflate blocks. TIFF is uncompressed and switches to BigTIFF
+ * if the file would exceed 4GiB, with a geo reference it becomes a GeoTIFF.
+ * NPY is a numpy array of shape (h, w) or (h, w, c), its geo reference goes
+ * into a JSON file next to it. Only PNG is limited to 8 bit samples. */
+class CImgStreamWriter {
+	public:
+		CImgStreamWriter();
+		~CImgStreamWriter();
+
+		CImgStreamWriter(const CImgStreamWriter& other) = delete;
+		CImgStreamWriter(CImgStreamWriter&& other) = delete;
+		CImgStreamWriter& operator=(const CImgStreamWriter& other) = delete;
+		CImgStreamWriter& operator=(CImgStreamWriter&& other) = delete;
+
+		bool Open(const char *filename, const char *filetype, int w, int h, int c, TSampleType sample = SAMPLE_UINT8, const TGeoReference *geo = NULL);
+		bool WriteRows(const void *rows, int count); // count rows of w*c samples each
+		bool Close(); // fails if not all rows were written
+
+		bool IsOpen() const {return file != NULL;}
+		int GetWidth() const {return width;}
+		int GetHeight() const {return height;}
+		int GetChannels() const {return channels;}
+		int GetRowsWritten() const {return rowsWritten;}
+	private:
+		typedef enum {
+			STREAM_PNG,
+			STREAM_TIFF,
+			STREAM_NPY
+		} TStreamType;
+
+		FILE *file;
+		TStreamType type;
+		TSampleType sampleType;
+		int  width;
+		int  height;
+		int  channels;
+		int  sampleSize;
+		int  rowsWritten;
+		bool failed;
+		bool bigTIFF;
+		bool hasGeo;
+		TGeoReference geoRef;
+		size_t rowSize;
+		unsigned long long dataSize;
+		unsigned long adler;
+		void *zstream; // z_stream if compiled with zlib
+		std::vector<unsigned char> prevRow;
+		std::vector<unsigned char> filtered;
+		std::vector<unsigned char> deflated;
+
+		void Abort();
+		void WriteBytes(const void *ptr, size_t size);
+		void WritePNGChunk(const char *chunkType, const unsigned char *ptr, size_t size);
+		void Deflate(const unsigned char *ptr, size_t size, bool finish);
+		void FlushIDAT(bool force);
+		bool OpenPNG();
+		bool OpenTIFF();
+		bool OpenNPY(const char *filename);
+		void WriteRowPNG(const unsigned char *row);
+		bool ClosePNG();
+		bool CloseTIFF();
+};
+
+/****************************************************************************
+ * FRAME SEQUENCE OUTPUT                                                    *
+ ****************************************************************************/
+
+typedef enum {
+	PIPELINE_RENDER,   // animation step and draw calls
+	PIPELINE_READBACK, // copying the frame from the GPU
+	PIPELINE_ENCODE,
+	PIPELINE_WRITE,    // files, links and the concat list
+	PIPELINE_STAGE_COUNT
+} TPipelineStage;
+
+/* Where the frame output spends its time. The stages run one after the other
+ * on the main thread, so there are no queues between them: a stage which has
+ * to wait for the GPU (the swap, or the readback waiting for the rendering)
+ * counts that time as stalled instead of busy. */
+struct TPipelineStats {
+	unsigned long frames[PIPELINE_STAGE_COUNT]; // which passed the stage
+	double busy[PIPELINE_STAGE_COUNT];          // in seconds
+	double stall[PIPELINE_STAGE_COUNT];         // in seconds
+	unsigned long long bytesWritten;
+	unsigned long duplicates;
+	double elapsed;                             // wall clock seconds, maintained by the owner
+
+	TPipelineStats();
+	void Reset();
+	void Add(TPipelineStage stage, double busySeconds, double stallSeconds = 0.0);
+	TPipelineStats Since(const TPipelineStats& earlier) const;
+	TPipelineStage GetBottleneck() const; // the stage with the most busy plus stall time
+	void Log() const;
+	bool WriteJSON(const char *filename) const;
+
+	static const char *GetStageName(TPipelineStage stage);
+};
+
+/* Writes the frames of an animation. A frame identical to the previous one
+ * is not encoded again, its file becomes a hard link to the previous file.
+ * With a concat list for ffmpeg's concat demuxer, the duplicates do not get
+ * any file at all, they just extend the duration of the previous entry. */
+class CFrameWriter {
+	public:
+		CFrameWriter();
+		~CFrameWriter();
+
+		CFrameWriter(const CFrameWriter& other) = delete;
+		CFrameWriter(CFrameWriter&& other) = delete;
+		CFrameWriter& operator=(const CFrameWriter& other) = delete;
+		CFrameWriter& operator=(CFrameWriter&& other) = delete;
+
+		void SetDeduplicate(bool enabled) {deduplicate = enabled;}
+		void SetStats(TPipelineStats *pipelineStats) {stats = pipelineStats;} // to add the encode and write times to, may be NULL
+		bool OpenConcatList(const char *filename, double frameDuration);
+		// takes over the image, it is kept until the next frame to compare with
+		bool WriteFrame(CImg&& img, const char *filename, const char *filetype, const TPNGOptions& png = TPNGOptions());
+		void Finish(); // completes the concat list, the next frame starts a new sequence
+
+		unsigned long GetFrameCount() const {return frames;}
+		unsigned long GetDuplicateCount() const {return duplicates;}
+	private:
+		bool deduplicate;
+		TPipelineStats *stats;
+		CImg last;
+		std::string lastFilename;
+		FILE *concatFile;
+		std::string concatDir; // absolute, with a trailing separator
+		double frameDuration;
+		unsigned long lastRepeat; // frames of the pending concat entry
+		unsigned long frames;
+		unsigned long duplicates;
+
+		bool IsDuplicate(const CImg& img) const;
+		void FlushConcatEntry(bool closing);
+		bool WriteFile(const char *filename, const std::vector<unsigned char>& encoded);
 };
 
 } // namespace gpximg
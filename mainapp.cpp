@@ -48,7 +48,25 @@ struct AppConfig {
 	int slowLast;
 	const char *outputFrames;
 	const char *imageFileType;
+	gpximg::TPNGOptions pngOptions;
+	bool pngBenchmark;
+	double outputFps;
+	bool frameDedup;
+	const char *outputConcat;
+	const char *outputPipelineStats;
 	const char *outputStats;
+	const char *outputPoster;
+	const char *posterFileType;
+	int posterWidth;
+	int posterHeight;
+	int posterTileSize;
+	const char *outputDensity;
+	const char *densityFileType;
+	const char *shaderCache;
+	bool useShaderCache;
+	const char *historyPyramid;
+	int pyramidLevels;
+	const char *jobFile;
 
 	AppConfig() :
 		posx(100),
@@ -70,7 +88,24 @@ struct AppConfig {
 		slowLast(0),
 		outputFrames(NULL),
 		imageFileType("tga"),
-		outputStats(NULL)
+		pngBenchmark(false),
+		outputFps(60.0),
+		frameDedup(true),
+		outputConcat(NULL),
+		outputPipelineStats(NULL),
+		outputStats(NULL),
+		outputPoster(NULL),
+		posterFileType("png"),
+		posterWidth(0),
+		posterHeight(0),
+		posterTileSize(4096),
+		outputDensity(NULL),
+		densityFileType("tif"),
+		shaderCache(NULL),
+		useShaderCache(true),
+		historyPyramid(NULL),
+		pyramidLevels(4),
+		jobFile(NULL)
 	{
 #ifndef NDEBUG
 		debugOutputLevel = DEBUG_OUTPUT_ERRORS_ONLY;
@@ -119,12 +154,17 @@ typedef struct {
 	int maxGlSize;
 	// actual visualizer
 	gpxvis::CAnimController animCtrl;
+	// writes the animation frames, the pool must outlive the images the writer keeps
+	gpximg::CImgPool imgPool;
+	gpximg::CFrameWriter frameWriter;
+	gpximg::TPipelineStats pipelineStats;
 #ifdef GPXVIS_WITH_IMGUI
 	filedialog::CFileDialogTracks *fileDialog;
 	filedialog::CFileDialogSelectDir *dirDialog;
 	std::string outputDir;
 	std::string outputPrefix;
 	std::string outputFilename;
+	std::string presetFilename;
 
 	/* further menu-controlled state */
 	bool showTrackManager;
@@ -232,6 +272,14 @@ static void initGLState(MainApp* app, const AppConfig& cfg)
 	glClearDepth(1.0f);
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
+	if (cfg.useShaderCache) {
+		if (cfg.shaderCache) {
+			gpxutil::programCacheSetDirectory(cfg.shaderCache);
+		} else {
+			gpxutil::programCacheSetDirectory(gpxutil::getDefaultCacheDirectory().c_str());
+		}
+	}
+
 	app->maxGlTextureSize = 4096;
 	GLint maxViewport[2] = { 4096, 4096};
 	GLint maxFB[2] = {4096, 4096};
@@ -317,9 +365,7 @@ static void windowToMainFramebufferNormalized(const MainApp* app, const double p
 static void transformUpdate(MainApp* app, gpxvis::CAnimController& animCtrl, gpxvis::CVis& vis)
 {
 	(void)app;
-	vis.UpdateTransform();
-	animCtrl.RestoreHistory(true, true);
-	animCtrl.RefreshCurrentTrack(true);
+	animCtrl.RefreshStages(vis.UpdateTransform(), true);
 }
 
 /* change the zoom factor */
@@ -545,6 +591,25 @@ static void switchToLastN(MainApp *app, size_t n=1, bool slow=true)
 	updateCloseTracks(app, true);
 }
 
+/* --switch-to: start with the track of that index, negative counts from the end */
+static void applySwitchTo(MainApp *app, const AppConfig& cfg)
+{
+	if (cfg.switchTo) {
+		size_t cnt = app->animCtrl.GetTrackCount();
+		size_t idx;
+		if (cfg.switchTo > 0) {
+			idx = (size_t)cfg.switchTo;
+		} else {
+			idx = (size_t)-cfg.switchTo;
+			if (idx > cnt) {
+				idx = cnt;
+			}
+			idx = cnt - idx;
+		}
+		app->animCtrl.SwitchToTrack(idx);
+	}
+}
+
 /****************************************************************************
  * GLOBAL INITIALIZATION AND CLEANUP                                        *
  ****************************************************************************/
@@ -573,6 +638,7 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	app->outputDir = ".";
 	app->outputPrefix = "gpxvis_";
 	app->outputFilename = filedialog::makePath(app->outputDir, app->outputPrefix);
+	app->presetFilename = "gpxvis_preset.ini";
 #endif
 
 	/* initialize GLFW library */
@@ -730,20 +796,7 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	/* initialize the GL context */
 	initGLState(app, cfg);
 
-	if (cfg.switchTo) {
-		size_t cnt = app->animCtrl.GetTrackCount();
-		size_t idx;
-		if (cfg.switchTo > 0) {
-			idx = (size_t)cfg.switchTo;
-		} else {
-			idx = (size_t)-cfg.switchTo;
-			if (idx > cnt) {
-				idx = cnt;
-			}
-			idx = cnt - idx;
-		}
-		app->animCtrl.SwitchToTrack(idx);
-	}
+	applySwitchTo(app, cfg);
 
 	// initialize the animation controller
 	if (!app->animCtrl.Prepare(app->width,app->height)) {
@@ -760,6 +813,15 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 		app->animCtrl.StatsToCSV(cfg.outputStats);
 	}
 
+	if (cfg.historyPyramid) {
+		if (app->animCtrl.OpenHistoryPyramid(cfg.historyPyramid) && app->animCtrl.UpdateHistoryPyramid(cfg.pyramidLevels)) {
+			// start with the overview from the first level
+			gpxvis::CVis& vis = app->animCtrl.GetVis();
+			vis.GetConfig().zoomFactor = app->animCtrl.GetHistoryPyramidZoom(vis.GetConfig().zoomFactor, true);
+			vis.UpdateTransform();
+		}
+	}
+
 	/* initialize the timer */
 	app->timeCur=glfwGetTime();
 
@@ -795,7 +857,7 @@ static void destroyMainApp(MainApp *app)
  * DRAWING FUNCTION                                                         *
  ****************************************************************************/
 
-static void saveCurrentFrame(gpxvis::CAnimController& animCtrl, const char *filetype, const char *namePrefix, const char *additionalPrefix, unsigned long number)
+static void saveCurrentFrame(gpxvis::CAnimController& animCtrl, const char *filetype, const gpximg::TPNGOptions& png, const char *namePrefix, const char *additionalPrefix, unsigned long number)
 {
 	if (!namePrefix) {
 		namePrefix = "gpxvis_";
@@ -805,16 +867,38 @@ static void saveCurrentFrame(gpxvis::CAnimController& animCtrl, const char *file
 	}
 
 	gpximg::CImg img;
-	if (animCtrl.GetVis().GetImage(img)) {
+	if (animCtrl.GetVis().GetImage(img, true)) {
 		char buf[4096];
 		mysnprintf(buf, sizeof(buf), "%s%s%06lu.%s", namePrefix, additionalPrefix, number, filetype);
-		img.Write(buf,filetype);
+		img.Write(buf,filetype,png);
 	}
 }
 
-static void saveCurrentFrame(gpxvis::CAnimController& animCtrl, const char *filetype, const char *namePrefix)
+static void saveOutputFrame(MainApp *app, const AppConfig& cfg)
 {
-	saveCurrentFrame(animCtrl, filetype, namePrefix, NULL, animCtrl.GetFrame());
+	gpximg::CImg img(&app->imgPool);
+
+	// the readback has to wait for the rendering, that part is a stall
+	double start = gpxutil::getTime();
+	GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	GLenum waitResult;
+	do {
+		waitResult = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	} while (waitResult == GL_TIMEOUT_EXPIRED);
+	if (waitResult == GL_WAIT_FAILED) {
+		// the readback still waits implicitly, only the times are off
+		gpxutil::warn("waiting for the frame to be rendered failed");
+	}
+	glDeleteSync(fence);
+	double rendered = gpxutil::getTime();
+	bool success = app->animCtrl.GetVis().GetImage(img, true);
+	app->pipelineStats.Add(gpximg::PIPELINE_READBACK, gpxutil::getTime() - rendered, rendered - start);
+
+	if (success) {
+		char buf[4096];
+		mysnprintf(buf, sizeof(buf), "%s%06lu.%s", cfg.outputFrames, app->animCtrl.GetFrame(), cfg.imageFileType);
+		app->frameWriter.WriteFrame(std::move(img), buf, cfg.imageFileType, cfg.pngOptions);
+	}
 }
 
 #ifdef GPXVIS_WITH_IMGUI
@@ -895,6 +979,13 @@ static void drawTrackManager(MainApp* app, gpxvis::CAnimController& animCtrl, gp
 		ImGui::Text("region height: %.1fkm", rSize[1]);
 		ImGui::TableNextColumn();
 		ImGui::Text("scale variation: %.2f%%", rSize[2]);
+		const gpxvis::CAnimController::TTrackMemoryStats& mem = animCtrl.GetTrackMemoryStats();
+		ImGui::TableNextColumn();
+		ImGui::Text("points: %.1fMiB", (double)mem.loadedBytes / (1024.0 * 1024.0));
+		ImGui::TableNextColumn();
+		ImGui::Text("hits/misses: %llu/%llu", mem.hits, mem.misses);
+		ImGui::TableNextColumn();
+		ImGui::Text("evictions: %llu", mem.evictions);
 		ImGui::EndTable();
 	}
 	ImGui::EndDisabled();
@@ -1034,6 +1125,10 @@ static void drawTrackManager(MainApp* app, gpxvis::CAnimController& animCtrl, gp
 			app->fileDialog->Open();
 		}
 	}
+	bool splitSubTracks = animCtrl.GetSplitSubTracks();
+	if (ImGui::Checkbox("Split Files into Separate <trk> Tracks", &splitSubTracks)) {
+		animCtrl.SetSplitSubTracks(splitSubTracks);
+	}
 	ImGui::EndDisabled();
 
 	if (modified) {
@@ -1180,6 +1275,9 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 
 	gpxvis::CAnimController::TAnimConfig& animCfg = animCtrl.GetAnimConfig();
 	gpxvis::CVis::TConfig& visCfg=vis.GetConfig();
+	if (animCtrl.IsRestoringHistory()) {
+		ImGui::ProgressBar(animCtrl.GetRestoreProgress(), ImVec2(-1.0f, 0.0f), "rebuilding history");
+	}
 	ImGui::BeginDisabled(disabled);
 	if (ImGui::BeginTable("tracksplit", 3)) {
 		ImGui::TableNextColumn();
@@ -1259,17 +1357,14 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 	if (ImGui::TreeNodeEx("View Transformation", 0)) {
 		ImGui::BeginDisabled(disabled);
 		if (ImGui::SliderFloat("zoom factor", &visCfg.zoomFactor, 0.01f, 100.0f, "%.02fx", ImGuiSliderFlags_Logarithmic)) {
-			modifiedHistory = true;
 			modifiedTransform = true;
 			modified = true;
 		}
 		if (ImGui::SliderFloat("position x", &visCfg.centerNormalized[0], 0.0f, 1.0f, "%.03f")) {
-			modifiedHistory = true;
 			modifiedTransform = true;
 			modified = true;
 		}
 		if (ImGui::SliderFloat("position y", &visCfg.centerNormalized[1], 0.0f, 1.0f, "%.03f")) {
-			modifiedHistory = true;
 			modifiedTransform = true;
 			modified = true;
 		}
@@ -1277,7 +1372,6 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 			ImGui::TableNextColumn();
 			if (ImGui::Button("Reset Zoom", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 				visCfg.zoomFactor = 1.0f;
-				modifiedHistory = true;
 				modifiedTransform = true;
 				modified = true;
 			}
@@ -1285,14 +1379,12 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 			if (ImGui::Button("Reset Position", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 				visCfg.centerNormalized[0] = 0.5f;
 				visCfg.centerNormalized[1] = 0.5f;
-				modifiedHistory = true;
 				modifiedTransform = true;
 				modified = true;
 			}
 			ImGui::TableNextColumn();
 			if (ImGui::Button("Reset View", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 				visCfg.ResetTransform();
-				modifiedHistory = true;
 				modifiedTransform = true;
 				modified = true;
 			}
@@ -1603,6 +1695,74 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 				animCfg.neighborhoodMode = (gpxvis::CAnimController::TBackgroundMode)nhMode;
 				modifiedHistory = true;
 			}
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted("Backend:");
+			ImGui::TableNextColumn();
+			int backend = (int)animCfg.historyBackend;
+			if (ImGui::RadioButton("raster##3", &backend, gpxvis::CAnimController::HISTORY_BACKEND_RASTER)) {
+				animCfg.historyBackend = (gpxvis::CAnimController::THistoryBackend)backend;
+				modifiedHistory = true;
+			}
+			ImGui::TableNextColumn();
+			if (ImGui::RadioButton("compute##3", &backend, gpxvis::CAnimController::HISTORY_BACKEND_COMPUTE)) {
+				animCfg.historyBackend = (gpxvis::CAnimController::THistoryBackend)backend;
+				modifiedHistory = true;
+			}
+			ImGui::TableNextColumn();
+			if (ImGui::RadioButton("cpu##3", &backend, gpxvis::CAnimController::HISTORY_BACKEND_CPU)) {
+				animCfg.historyBackend = (gpxvis::CAnimController::THistoryBackend)backend;
+				modifiedHistory = true;
+			}
+			ImGui::EndTable();
+		}
+		ImGui::Checkbox("Progressive history rebuild", &animCfg.progressiveHistory);
+		ImGui::BeginDisabled(!animCfg.progressiveHistory);
+		float progressiveBudget = (float)animCfg.progressiveBudget;
+		if (ImGui::SliderFloat("rebuild budget", &progressiveBudget, 1.0f, 100.0f, "%.1fms/frame", ImGuiSliderFlags_Logarithmic)) {
+			animCfg.progressiveBudget = (double)progressiveBudget;
+		}
+		int progressiveTracks = (int)animCfg.progressiveTracks;
+		if (ImGui::SliderInt("tracks per step", &progressiveTracks, 1, 1024, "%d", ImGuiSliderFlags_Logarithmic)) {
+			animCfg.progressiveTracks = (size_t)progressiveTracks;
+		}
+		ImGui::EndDisabled();
+		const gpxvis::CHistoryPyramid& pyramid = animCtrl.GetHistoryPyramid();
+		if (pyramid.IsOpen()) {
+			ImGui::SeparatorText("History Pyramid");
+			ImGui::Text("%s: %d levels, %u tiles%s", pyramid.GetDirectory(), pyramid.GetParams().levels,
+				(unsigned)pyramid.GetTileCount(), pyramid.HasOutdatedRegions() ? ", outdated" : "");
+			if (ImGui::Checkbox("Use history pyramid", &animCfg.historyPyramid)) {
+				modifiedHistory = true;
+			}
+			if (ImGui::BeginTable("pyramidsplit1", 2)) {
+				ImGui::TableNextColumn();
+				if (ImGui::Button("Update Pyramid", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
+					animCtrl.UpdateHistoryPyramid();
+					modifiedHistory = true;
+				}
+				ImGui::TableNextColumn();
+				if (ImGui::Button("Snap Zoom to Pyramid", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
+					visCfg.zoomFactor = animCtrl.GetHistoryPyramidZoom(visCfg.zoomFactor);
+					modifiedTransform = true;
+					modified = true;
+				}
+				ImGui::EndTable();
+			}
+		}
+		ImGui::SeparatorText("Density Export");
+		if (ImGui::BeginTable("densitysplit1", 2)) {
+			const char *densityTypes[2] = {"tif", "npy"};
+			for (int i=0; i<2; i++) {
+				char label[64];
+				mysnprintf(label, sizeof(label), "Export as %s", densityTypes[i]);
+				ImGui::TableNextColumn();
+				if (ImGui::Button(label, ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
+					char buf[4096];
+					GLsizei tileSize = (cfg.posterTileSize < app->maxGlSize) ? (GLsizei)cfg.posterTileSize : (GLsizei)app->maxGlSize;
+					mysnprintf(buf, sizeof(buf), "gpxvis_density_%06lu.%s", animCtrl.GetFrame(), densityTypes[i]);
+					animCtrl.RenderHistoryDensityTiled(vis.GetWidth(), vis.GetHeight(), tileSize, buf, densityTypes[i]);
+				}
+			}
 			ImGui::EndTable();
 		}
 		ImGui::EndDisabled();
@@ -1615,12 +1775,10 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 		int historyLineMode = (int)(visCfg.historyWideLine);
 		if (ImGui::ColorEdit3("track history", visCfg.colorBase)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::BeginDisabled(visCfg.historyAdditive < gpxvis::CVis::BACKGROUND_ADD_MIXED_COLORS);
 		if (ImGui::ColorEdit3("track history add", visCfg.colorHistoryAdd)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::EndDisabled();
 		if (ImGui::ColorEdit3("gradient new", &visCfg.colorGradient[0][0])) {
@@ -1637,12 +1795,10 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 		}
 		if (ImGui::ColorEdit3("background", visCfg.colorBackground)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		if (ImGui::Button("Reset Colors", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 			visCfg.ResetColors();
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::SeparatorText("Line Parameters");
 		if (ImGui::SliderFloat("track width", &visCfg.trackWidth, 0.0f, 32.0f)) {
@@ -1659,11 +1815,9 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 		}
 		if (ImGui::SliderFloat("neighborhood width", &visCfg.neighborhoodWidth, 0.0f, 32.0f)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		if (ImGui::SliderFloat("neighborhood sharpness", &visCfg.neighborhoodExp, 0.1f, 10.0f, "%0.2f", ImGuiSliderFlags_Logarithmic)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		if (ImGui::BeginTable("visoptionshistorylinesplit", 3)) {
 			ImGui::TableNextColumn();
@@ -1672,13 +1826,11 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 			if (ImGui::RadioButton("thin", &historyLineMode, 0)) {
 				visCfg.historyWideLine = false;
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::TableNextColumn();
 			if (ImGui::RadioButton("wide", &historyLineMode, 1)) {
 				visCfg.historyWideLine = true;
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::EndTable();
 		}
@@ -1690,54 +1842,45 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 			if (ImGui::RadioButton("off", &histAddMode, gpxvis::CVis::BACKGROUND_ADD_NONE)) {
 				visCfg.historyAdditive = (gpxvis::CVis::TBackgroundAdditiveMode)histAddMode; 
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::TableNextColumn();
 			if (ImGui::RadioButton("simple", &histAddMode, gpxvis::CVis::BACKGROUND_ADD_SIMPLE)) {
 				visCfg.historyAdditive = (gpxvis::CVis::TBackgroundAdditiveMode)histAddMode; 
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::TableNextColumn();
 			if (ImGui::RadioButton("mixed", &histAddMode, gpxvis::CVis::BACKGROUND_ADD_MIXED_COLORS)) {
 				visCfg.historyAdditive = (gpxvis::CVis::TBackgroundAdditiveMode)histAddMode; 
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::TableNextColumn();
 			if (ImGui::RadioButton("gradient", &histAddMode, gpxvis::CVis::BACKGROUND_ADD_GRADIENT)) {
 				visCfg.historyAdditive = (gpxvis::CVis::TBackgroundAdditiveMode)histAddMode; 
 				modified = true;
-				modifiedHistory = true;
 			}
 			ImGui::EndTable();
 		}
 		ImGui::BeginDisabled(!visCfg.historyWideLine);
 		if (ImGui::SliderFloat("history width", &visCfg.historyWidth, 0.0f, 32.0f)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		if (ImGui::SliderFloat("history sharpness", &visCfg.historyExp, 0.1f, 10.0f, "%0.2f", ImGuiSliderFlags_Logarithmic)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::EndDisabled();
 		ImGui::BeginDisabled(visCfg.historyAdditive == gpxvis::CVis::BACKGROUND_ADD_NONE);
 		if (ImGui::SliderFloat("additive exponent", &visCfg.historyAddExp, 0.01f, 100.0f, "%0.3f", ImGuiSliderFlags_Logarithmic)) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::EndDisabled();
 		ImGui::BeginDisabled(visCfg.historyAdditive != gpxvis::CVis::BACKGROUND_ADD_GRADIENT);
 		if (ImGui::SliderFloat("gradient slope", &visCfg.historyAddSaturationOffset, 1.0f, 100.0f, "%0.1f")) {
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::EndDisabled();
 		if (ImGui::Button("Reset Line Parameters", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 			visCfg.ResetWidths();
 			modified = true;
-			modifiedHistory = true;
 		}
 		ImGui::EndDisabled();
 		ImGui::TreePop();
@@ -1890,7 +2033,23 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 			ImGui::TableNextColumn();
 			if (ImGui::Button("Save current frame", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
 				app->outputFilename = filedialog::makePath(app->outputDir, app->outputPrefix);
-				saveCurrentFrame(animCtrl, cfg.imageFileType, app->outputFilename.c_str(), "current_", app->currentFrameIdx++);
+				saveCurrentFrame(animCtrl, cfg.imageFileType, cfg.pngOptions, app->outputFilename.c_str(), "current_", app->currentFrameIdx++);
+			}
+			ImGui::EndTable();
+		}
+		ImGui::SeparatorText("Presets");
+		ImGui::InputText("preset file", &app->presetFilename);
+		if (ImGui::BeginTable("presetbuttonssplit", 2)) {
+			ImGui::TableNextColumn();
+			if (ImGui::Button("Save Preset", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
+				animCtrl.SaveConfig(app->presetFilename.c_str());
+			}
+			ImGui::TableNextColumn();
+			if (ImGui::Button("Load Preset", ImVec2(ImGui::GetContentRegionAvail().x, 0.0f))) {
+				if (animCtrl.LoadConfig(app->presetFilename.c_str())) {
+					animCtrl.ApplyConfig();
+					updateCloseTracks(app, true);
+				}
 			}
 			ImGui::EndTable();
 		}
@@ -1899,19 +2058,27 @@ static void drawMainWindow(MainApp* app, AppConfig& cfg, gpxvis::CAnimController
 	}
 	ImGui::End();
 
+	// only rebuild the stages the changes actually invalidate
+	unsigned stages = 0;
+	unsigned configStages = 0;
 	if (modifiedTransform) {
-		vis.UpdateTransform();
+		stages |= vis.UpdateTransform();
 	}
 	if (modified) {
-		vis.UpdateConfig();
+		configStages = vis.UpdateConfig();
+		stages |= configStages;
 	}
 	if (modifiedHistory) {
-		//size_t curTrackIdx = animCtrl.GetCurrentTrackIndex();
-		animCtrl.RestoreHistory();
-		updateCloseTracks(app, true);
-	}
-	if (modified) {
-		animCtrl.RefreshCurrentTrack(modifiedHistory);
+		stages |= gpxvis::CVis::STAGE_ALL;
+	}
+	if (stages) {
+		// a pure view change can show the old history warped in the meantime
+		bool reproject = modifiedTransform && !modifiedHistory &&
+		                 !(configStages & (gpxvis::CVis::STAGE_BACKGROUND | gpxvis::CVis::STAGE_NEIGHBORHOOD));
+		animCtrl.RefreshStages(stages, reproject);
+		if (stages & (gpxvis::CVis::STAGE_BACKGROUND | gpxvis::CVis::STAGE_NEIGHBORHOOD)) {
+			updateCloseTracks(app, true);
+		}
 	}
 
 	if (app->showTrackManager) {
@@ -2015,15 +2182,19 @@ drawScene(MainApp *app, AppConfig& cfg)
 static bool
 displayFunc(MainApp *app, AppConfig& cfg)
 {
-	// Render an animation frame
+	// Render an animation frame, the recorded frames must not depend on the frame rate
+	bool recording = (cfg.outputFrames != NULL);
+	double start = gpxutil::getTime();
+	app->animCtrl.SetSynchronousHistory(recording);
 	bool cycleFinished = app->animCtrl.UpdateStep(app->timeDelta);
 	drawScene(app, cfg);
+	double rendered = gpxutil::getTime();
 
 	if (cfg.outputFrames) {
-		gpximg::CImg img;
-		saveCurrentFrame(app->animCtrl, cfg.imageFileType, cfg.outputFrames);
+		saveOutputFrame(app, cfg);
 		if (cycleFinished) {
 			cfg.outputFrames = NULL;
+			app->frameWriter.Finish();
 			if (cfg.exitAfterOutputFrames) {
 				return false;
 			}
@@ -2032,7 +2203,13 @@ displayFunc(MainApp *app, AppConfig& cfg)
 
 	/* finished with drawing, swap FRONT and BACK buffers to show what we
 	 * have rendered */
+	double swapStart = gpxutil::getTime();
 	glfwSwapBuffers(app->win);
+	if (recording) {
+		double end = gpxutil::getTime();
+		app->pipelineStats.Add(gpximg::PIPELINE_RENDER, rendered - start, end - swapStart);
+		app->pipelineStats.elapsed += end - start;
+	}
 
 	/* In DEBUG builds, we also check for GL errors in the display
 	 * function, to make sure no GL error goes unnoticed. */
@@ -2052,6 +2229,7 @@ static void mainLoop(MainApp *app, AppConfig& cfg)
 	unsigned int frame=0;
 	double start_time=glfwGetTime();
 	double last_time=start_time;
+	gpximg::TPipelineStats lastStats = app->pipelineStats;
 
 	gpxutil::info("entering main loop");
 	while (!glfwWindowShouldClose(app->win)) {
@@ -2071,7 +2249,12 @@ static void mainLoop(MainApp *app, AppConfig& cfg)
 			/* update window title */
 			mysnprintf(WinTitle, sizeof(WinTitle), APP_TITLE "   /// AVG: %4.2fms/frame (%.1ffps)", app->avg_frametime, app->avg_fps);
 			glfwSetWindowTitle(app->win, WinTitle);
-			gpxutil::info("frame time: %4.2fms/frame (%.1ffps)",app->avg_frametime, app->avg_fps);
+			if (app->pipelineStats.frames[gpximg::PIPELINE_RENDER] != lastStats.frames[gpximg::PIPELINE_RENDER]) {
+				app->pipelineStats.Since(lastStats).Log();
+				lastStats = app->pipelineStats;
+			} else {
+				gpxutil::info("frame time: %4.2fms/frame (%.1ffps)",app->avg_frametime, app->avg_fps);
+			}
 		}
 
 		/* This is needed for GLFW event handling. This function
@@ -2101,12 +2284,83 @@ static void mainLoop(MainApp *app, AppConfig& cfg)
 		(double)app->frame/(app->timeCur-start_time) );
 }
 
+/* The main loop with the frame output set up before and finished after it */
+static void runMainLoop(MainApp *app, AppConfig& cfg)
+{
+	app->frameWriter.SetDeduplicate(cfg.frameDedup);
+	app->frameWriter.SetStats(&app->pipelineStats);
+	app->pipelineStats.Reset();
+	if (cfg.outputFrames && cfg.outputConcat) {
+		app->frameWriter.OpenConcatList(cfg.outputConcat, 1.0/cfg.outputFps);
+	}
+	mainLoop(app, cfg);
+	app->frameWriter.Finish();
+	if (app->animCtrl.GetTrackMemoryBudget()) {
+		const gpxvis::CAnimController::TTrackMemoryStats& mem = app->animCtrl.GetTrackMemoryStats();
+		gpxutil::info("track points: %.1fMiB loaded, %llu hits, %llu misses, %llu evictions",
+			(double)mem.loadedBytes / (1024.0 * 1024.0), mem.hits, mem.misses, mem.evictions);
+	}
+	if (app->pipelineStats.frames[gpximg::PIPELINE_RENDER] > 0) {
+		app->pipelineStats.Log();
+		if (cfg.outputPipelineStats) {
+			app->pipelineStats.WriteJSON(cfg.outputPipelineStats);
+		}
+	}
+}
+
+/****************************************************************************
+ * POSTER OUTPUT                                                            *
+ ****************************************************************************/
+
+/* Render the fully drawn current track and its history at a resolution
+ * independent of the GL limits, in tiles. */
+static bool renderPoster(MainApp *app, const AppConfig& cfg)
+{
+	gpxvis::CAnimController& animCtrl = app->animCtrl;
+	const gpxvis::CVis& vis = animCtrl.GetVis();
+	GLsizei w = (cfg.posterWidth > 0) ? (GLsizei)cfg.posterWidth : vis.GetWidth();
+	GLsizei h = (cfg.posterHeight > 0) ? (GLsizei)cfg.posterHeight : vis.GetHeight();
+	GLsizei tileSize = (GLsizei)cfg.posterTileSize;
+
+	if (!animCtrl.IsPrepared()) {
+		return false;
+	}
+	if (tileSize > app->maxGlSize) {
+		tileSize = app->maxGlSize;
+	}
+	animCtrl.SetCurrentTrackUpTo(-1.0f);
+	return animCtrl.RenderTiled(w, h, tileSize, cfg.outputPoster, cfg.posterFileType);
+}
+
+/* The raw values of the history with their mercator bounds, at the poster
+ * resolution, or the one of the current view. */
+static bool renderDensity(MainApp *app, const AppConfig& cfg, const char *filename, const char *filetype)
+{
+	gpxvis::CAnimController& animCtrl = app->animCtrl;
+	const gpxvis::CVis& vis = animCtrl.GetVis();
+	GLsizei w = (cfg.posterWidth > 0) ? (GLsizei)cfg.posterWidth : vis.GetWidth();
+	GLsizei h = (cfg.posterHeight > 0) ? (GLsizei)cfg.posterHeight : vis.GetHeight();
+	GLsizei tileSize = (GLsizei)cfg.posterTileSize;
+
+	if (!animCtrl.IsPrepared()) {
+		return false;
+	}
+	if (tileSize > app->maxGlSize) {
+		tileSize = app->maxGlSize;
+	}
+	return animCtrl.RenderHistoryDensityTiled(w, h, tileSize, filename, filetype);
+}
+
 /****************************************************************************
  * SIMPLE COMMAND LINE PARSER                                               *
  ****************************************************************************/
 
-void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
+/* apply the options in argv[1] to argv[argc-1], everything which is not an
+ * option ends up in others. Returns false if an option failed, like a config
+ * file which can't be loaded, the other options are still applied. */
+static bool parseOptions(AppConfig& cfg, MainApp& app, int argc, char**argv, std::vector<std::string>& others)
 {
+	bool success = true;
 	gpxvis::CAnimController::TAnimConfig& animCfg = app.animCtrl.GetAnimConfig();
 	//gpxvis::CVis::TConfig& visCfg = app.animCtrl.GetVis().GetConfig();
 
@@ -2126,6 +2380,12 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 			animCfg.paused = true;
 		} else if (!strcmp(argv[i], "--slow-last")) {
 			cfg.slowLast = 1;
+		} else if (!strcmp(argv[i], "--split-tracks")) {
+			app.animCtrl.SetSplitSubTracks(true);
+		} else if (!strcmp(argv[i], "--no-shader-cache")) {
+			cfg.useShaderCache = false;
+		} else if (!strcmp(argv[i], "--png-benchmark")) {
+			cfg.pngBenchmark = true;
 		} else {
 			bool unhandled = false;
 			if (i + 1 < argc) {
@@ -2146,9 +2406,26 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 					cfg.withGUI = false;
 				} else if (!strcmp(argv[i], "--output-filetype")) {
 					cfg.imageFileType = argv[++i];
+				} else if (!strcmp(argv[i], "--png-level")) {
+					cfg.pngOptions.level = (int)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--png-filter")) {
+					long filter = strtol(argv[++i], NULL, 10);
+					if (filter < gpximg::PNG_FILTER_NONE || filter > gpximg::PNG_FILTER_ADAPTIVE) {
+						gpxutil::warn("invalid png filter %ld, using adaptive", filter);
+						filter = gpximg::PNG_FILTER_ADAPTIVE;
+					}
+					cfg.pngOptions.filter = (gpximg::TPNGFilter)filter;
+				} else if (!strcmp(argv[i], "--png-stripe-size")) {
+					cfg.pngOptions.stripeSize = (size_t)strtoul(argv[++i], NULL, 10);
 				} else if (!strcmp(argv[i], "--output-fps")) {
-					double fps = strtod(argv[++i], NULL);
-					app.animCtrl.SetAnimSpeed(1.0/fps);
+					cfg.outputFps = strtod(argv[++i], NULL);
+					app.animCtrl.SetAnimSpeed(1.0/cfg.outputFps);
+				} else if (!strcmp(argv[i], "--no-frame-dedup")) {
+					cfg.frameDedup = false;
+				} else if (!strcmp(argv[i], "--output-concat")) {
+					cfg.outputConcat = argv[++i];
+				} else if (!strcmp(argv[i], "--output-pipeline-stats")) {
+					cfg.outputPipelineStats = argv[++i];
 				} else if (!strcmp(argv[i], "--track-speed")) {
 					animCfg.trackSpeed = strtod(argv[++i], NULL) * 3600.0;
 				} else if (!strcmp(argv[i], "--fade-time")) {
@@ -2165,6 +2442,82 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 					cfg.outputStats = argv[++i];
 				} else if (!strcmp(argv[i], "--anim-mode")) {
 					animCfg.mode = (gpxvis::CAnimController::TAnimMode)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--vertex-encoding")) {
+					long encoding = strtol(argv[++i], NULL, 10);
+					if (encoding != gpx::VERTEX_ENCODING_FLOAT && encoding != gpx::VERTEX_ENCODING_UNORM16) {
+						gpxutil::warn("invalid vertex encoding %ld, using float", encoding);
+						encoding = gpx::VERTEX_ENCODING_FLOAT;
+					}
+					animCfg.vertexEncoding = (gpx::TVertexEncoding)encoding;
+				} else if (!strcmp(argv[i], "--history-backend")) {
+					long backend = strtol(argv[++i], NULL, 10);
+					if (backend < gpxvis::CAnimController::HISTORY_BACKEND_RASTER || backend > gpxvis::CAnimController::HISTORY_BACKEND_CPU) {
+						gpxutil::warn("invalid history backend %ld, using raster", backend);
+						backend = gpxvis::CAnimController::HISTORY_BACKEND_RASTER;
+					}
+					animCfg.historyBackend = (gpxvis::CAnimController::THistoryBackend)backend;
+				} else if (!strcmp(argv[i], "--output-poster")) {
+					cfg.outputPoster = argv[++i];
+					cfg.withGUI = false;
+				} else if (!strcmp(argv[i], "--poster-filetype")) {
+					cfg.posterFileType = argv[++i];
+				} else if (!strcmp(argv[i], "--poster-width")) {
+					cfg.posterWidth = (int)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--poster-height")) {
+					cfg.posterHeight = (int)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--poster-tile-size")) {
+					cfg.posterTileSize = (int)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--output-density")) {
+					cfg.outputDensity = argv[++i];
+					cfg.withGUI = false;
+				} else if (!strcmp(argv[i], "--density-filetype")) {
+					cfg.densityFileType = argv[++i];
+				} else if (!strcmp(argv[i], "--shader-cache")) {
+					cfg.shaderCache = argv[++i];
+				} else if (!strcmp(argv[i], "--history-pyramid")) {
+					cfg.historyPyramid = argv[++i];
+				} else if (!strcmp(argv[i], "--pyramid-levels")) {
+					cfg.pyramidLevels = (int)strtol(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--job-file")) {
+					cfg.jobFile = argv[++i];
+				} else if (!strcmp(argv[i], "--from")) {
+					const char *date = argv[++i];
+					app.animCtrl.GetTrackFilter().from = gpx::parseTimestamp(date);
+					if (!app.animCtrl.GetTrackFilter().from) {
+						gpxutil::warn("invalid date '%s' ignored", date);
+					}
+				} else if (!strcmp(argv[i], "--to")) {
+					const char *date = argv[++i];
+					time_t& to = app.animCtrl.GetTrackFilter().to;
+					to = gpx::parseTimestamp(date);
+					if (!to) {
+						gpxutil::warn("invalid date '%s' ignored", date);
+					} else if (strlen(date) <= 10) {
+						// a date alone includes that day
+						to += 24 * 3600;
+					}
+				} else if (!strcmp(argv[i], "--bbox")) {
+					double *b = app.animCtrl.GetTrackFilter().bbox;
+					if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &b[0], &b[1], &b[2], &b[3]) != 4) {
+						gpxutil::warn("--bbox needs min lon,min lat,max lon,max lat");
+						b[0] = b[1] = 1.0;
+						b[2] = b[3] = -1.0;
+					}
+				} else if (!strcmp(argv[i], "--min-length")) {
+					app.animCtrl.GetTrackFilter().minLength = strtod(argv[++i], NULL);
+				} else if (!strcmp(argv[i], "--min-duration")) {
+					app.animCtrl.GetTrackFilter().minDuration = strtod(argv[++i], NULL) * 60.0;
+				} else if (!strcmp(argv[i], "--track-index")) {
+					app.animCtrl.OpenTrackIndex(argv[++i]);
+				} else if (!strcmp(argv[i], "--track-memory")) {
+					// in MiB, the files are loaded in batches within the budget,
+					// with --track-index only the metadata is loaded at all
+					app.animCtrl.SetTrackMemoryBudget((size_t)(strtod(argv[++i], NULL) * 1024.0 * 1024.0));
+				} else if (!strcmp(argv[i], "--config")) {
+					// the options after it override the file
+					if (!app.animCtrl.LoadConfig(argv[++i])) {
+						success = false;
+					}
 				} else {
 					unhandled = true;
 				}
@@ -2172,10 +2525,173 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 				unhandled = true;
 			}
 			if (unhandled) {
-				app.animCtrl.AddTrack(argv[i]);
+				others.push_back(argv[i]);
 			}
 		}
 	}
+	return success;
+}
+
+bool parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
+{
+	std::vector<std::string> trackFiles;
+	if (!parseOptions(cfg, app, argc, argv, trackFiles)) {
+		return false;
+	}
+	app.animCtrl.AddTracks(trackFiles);
+	return true;
+}
+
+/****************************************************************************
+ * BATCH JOBS                                                               *
+ ****************************************************************************/
+
+/* A job file lists several renderings of the tracks loaded from the command
+ * line, as an INI file. Each [section] is a job, its keys are the command
+ * line options without the leading "--", a key without a value is an option
+ * without an argument. The entries before the first section apply to all
+ * jobs. Example:
+ *
+ *	output-filetype = png
+ *	[overview]
+ *	output-poster = overview.png
+ *	poster-width = 8000
+ *	[last year]
+ *	output-frames = frames/year_
+ *	switch-to = -52
+ *	anim-mode = 1
+ */
+typedef struct {
+	std::string name;
+	std::vector<std::string> args; // argv[0] is the name
+} TJob;
+
+static bool loadJobFile(const char *filename, std::vector<TJob>& jobs)
+{
+	std::vector<gpxutil::TIniSection> sections;
+	if (!gpxutil::readIniFile(filename, sections)) {
+		return false;
+	}
+	for (size_t i=1; i<sections.size(); i++) {
+		TJob job;
+		job.name = sections[i].name;
+		job.args.push_back(job.name);
+		for (size_t s=0; s<2; s++) {
+			const gpxutil::TIniSection& section = sections[s ? i : 0];
+			for (size_t j=0; j<section.entries.size(); j++) {
+				job.args.push_back(std::string("--") + section.entries[j].key);
+				if (!section.entries[j].value.empty()) {
+					job.args.push_back(section.entries[j].value);
+				}
+			}
+		}
+		jobs.push_back(job);
+	}
+	gpxutil::info("job file '%s': %u jobs", filename, (unsigned)jobs.size());
+	return true;
+}
+
+/* The options which select and load the tracks or open the caches only work
+ * on the command line: all jobs share the tracks loaded there. */
+static const char *jobRejectedOptions[] = {
+	"--split-tracks", "--from", "--to", "--bbox", "--min-length", "--min-duration",
+	"--track-index", "--track-memory", "--history-pyramid", "--pyramid-levels",
+	"--shader-cache", "--no-shader-cache", "--job-file",
+};
+
+/* Each job starts from the configuration after initialization. The tracks,
+ * their GL buffers and the shader programs are kept, only the framebuffers
+ * follow the resolution of the job. */
+static bool runJob(MainApp *app, const AppConfig& baseCfg, const gpxvis::CAnimController::TAnimConfig& baseAnimCfg,
+		   const gpxvis::CVis::TConfig& baseVisCfg, const TJob& job)
+{
+	gpxvis::CAnimController& animCtrl = app->animCtrl;
+	AppConfig cfg = baseCfg;
+	std::vector<char*> argv;
+	std::vector<std::string> others;
+
+	animCtrl.GetAnimConfig() = baseAnimCfg;
+	animCtrl.GetVis().GetConfig() = baseVisCfg;
+	for (size_t i=0; i<job.args.size(); i++) {
+		for (size_t j=0; j<sizeof(jobRejectedOptions)/sizeof(jobRejectedOptions[0]); j++) {
+			if (i > 0 && job.args[i] == jobRejectedOptions[j]) {
+				gpxutil::warn("job '%s': option '%s' only works on the command line", job.name.c_str(), jobRejectedOptions[j]);
+				return false;
+			}
+		}
+		argv.push_back((char*)job.args[i].c_str());
+	}
+	if (!parseOptions(cfg, *app, (int)argv.size(), argv.data(), others)) {
+		gpxutil::warn("job '%s': invalid options", job.name.c_str());
+		return false;
+	}
+	if (!others.empty()) {
+		gpxutil::warn("job '%s': unknown option '%s'", job.name.c_str(), others[0].c_str());
+		return false;
+	}
+	if (!cfg.outputFrames && !cfg.outputPoster && !cfg.outputDensity) {
+		gpxutil::warn("job '%s': no output", job.name.c_str());
+		return false;
+	}
+
+	gpxutil::info("job '%s'", job.name.c_str());
+	if (!animCtrl.Prepare((GLsizei)cfg.width, (GLsizei)cfg.height)) {
+		return false;
+	}
+	animCtrl.ResetAnimation();
+	applySwitchTo(app, cfg);
+	if (cfg.slowLast > 0) {
+		switchToLastN(app, (size_t)cfg.slowLast, true);
+	}
+
+	bool success = true;
+	if (cfg.outputPoster) {
+		success = renderPoster(app, cfg) && success;
+	}
+	if (cfg.outputDensity) {
+		success = renderDensity(app, cfg, cfg.outputDensity, cfg.densityFileType) && success;
+	}
+	if (cfg.outputFrames) {
+		cfg.exitAfterOutputFrames = true;
+		cfg.withGUI = false;
+		animCtrl.Play();
+		app->frame = 0;
+		app->timeCur = glfwGetTime();
+		runMainLoop(app, cfg);
+	}
+	return success;
+}
+
+/* All jobs run one after the other in the GL context of the application.
+ * Returns false if any of them failed. */
+static bool runJobs(MainApp *app, const AppConfig& cfg)
+{
+	std::vector<TJob> jobs;
+	if (!loadJobFile(cfg.jobFile, jobs)) {
+		return false;
+	}
+
+	const gpxvis::CAnimController::TAnimConfig baseAnimCfg = app->animCtrl.GetAnimConfig();
+	const gpxvis::CVis::TConfig baseVisCfg = app->animCtrl.GetVis().GetConfig();
+	AppConfig baseCfg = cfg;
+	baseCfg.jobFile = NULL;
+	baseCfg.outputFrames = NULL;
+	baseCfg.outputPoster = NULL;
+	baseCfg.outputDensity = NULL;
+
+	size_t failed = 0;
+	for (size_t i=0; i<jobs.size(); i++) {
+		if (glfwWindowShouldClose(app->win)) {
+			gpxutil::warn("window closed, skipping the remaining %u jobs", (unsigned)(jobs.size() - i));
+			break;
+		}
+		if (!runJob(app, baseCfg, baseAnimCfg, baseVisCfg, jobs[i])) {
+			gpxutil::warn("job '%s' failed", jobs[i].name.c_str());
+			failed++;
+		}
+	}
+	gpxutil::info("finished %u jobs, %u failed", (unsigned)jobs.size(), (unsigned)failed);
+	return (failed == 0);
 }
 
 /****************************************************************************
@@ -2197,20 +2713,41 @@ int REALMAIN (int argc, char **argv)
 	filedialog::CFileDialogSelectDir dirDialog;
 #endif
 
-	parseCommandlineArgs(cfg, app, argc, argv);
+	if (!parseCommandlineArgs(cfg, app, argc, argv)) {
+		return 1;
+	}
+	if (cfg.pngBenchmark) {
+		/* no GL needed */
+		gpximg::benchmarkPNG(cfg.pngOptions);
+		return 0;
+	}
 
+	bool success = false;
 	if (initMainApp(&app, cfg)) {
 #ifdef GPXVIS_WITH_IMGUI
 		app.fileDialog = &fileDialog;
 		app.dirDialog = &dirDialog;
 #endif
-		/* initialization succeeded, enter the main loop */
-		mainLoop(&app, cfg);
+		success = true;
+		if (cfg.jobFile) {
+			success = runJobs(&app, cfg);
+		} else if (cfg.outputPoster || cfg.outputDensity) {
+			/* render a single large image and quit */
+			if (cfg.outputPoster) {
+				success = renderPoster(&app, cfg) && success;
+			}
+			if (cfg.outputDensity) {
+				success = renderDensity(&app, cfg, cfg.outputDensity, cfg.densityFileType) && success;
+			}
+		} else {
+			/* initialization succeeded, enter the main loop */
+			runMainLoop(&app, cfg);
+		}
 	}
 	/* clean everything up */
 	destroyMainApp(&app);
 
-	return 0;
+	return success ? 0 : 1;
 }
 
 #ifdef WIN32
@@ -0,0 +1,559 @@
+#include "pyramid.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace gpxvis {
+
+/****************************************************************************
+ * PRECOMPUTED HISTORY TILES ON DISK                                        *
+ ****************************************************************************/
+
+static const char pyramidIndexMagic[] = "gpxvis-history-pyramid 1";
+static const char pyramidTileMagic[8] = {'G','P','X','V','T','I','L','E'};
+
+/* 64 bit FNV-1a */
+static void hashBytes(unsigned long long& hash, const void *data, size_t size)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= ptr[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+/* identify a track across runs: the file and its first point, which also
+ * tells the sub-tracks of a file apart */
+static unsigned long long getTrackKey(const gpx::CTrack& track)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	const std::string& filename = track.GetFilenameStr();
+	unsigned long long count = (unsigned long long)track.GetCount();
+	hashBytes(hash, filename.c_str(), filename.length() + 1);
+	hashBytes(hash, &count, sizeof(count));
+	if (count > 0) {
+		const gpx::TPoint& p = track.GetStartPoint();
+		long long timestamp = (long long)p.timestamp;
+		hashBytes(hash, &p.lon, sizeof(p.lon));
+		hashBytes(hash, &p.lat, sizeof(p.lat));
+		hashBytes(hash, &timestamp, sizeof(timestamp));
+	}
+	return hash;
+}
+
+static bool rectsOverlap(const double a[4], const double b[4])
+{
+	return (a[0] <= b[2]) && (a[2] >= b[0]) && (a[1] <= b[3]) && (a[3] >= b[1]);
+}
+
+static void removeFile(const std::string& filename)
+{
+#ifdef WIN32
+	_wremove(gpxutil::utf8ToWide(filename).c_str());
+#else
+	remove(filename.c_str());
+#endif
+}
+
+// replace filename by the completely written tmpname, which is removed on errors
+static bool replaceFile(const std::string& tmpname, const std::string& filename)
+{
+#ifdef WIN32
+	std::wstring tmpname_wide = gpxutil::utf8ToWide(tmpname);
+	std::wstring filename_wide = gpxutil::utf8ToWide(filename);
+	_wremove(filename_wide.c_str());
+	bool success = (_wrename(tmpname_wide.c_str(), filename_wide.c_str()) == 0);
+#else
+	bool success = (rename(tmpname.c_str(), filename.c_str()) == 0);
+#endif
+	if (!success) {
+		removeFile(tmpname);
+	}
+	return success;
+}
+
+TPyramidParams::TPyramidParams() :
+	kmPerPixel(0.0),
+	tileSize(256),
+	levels(4),
+	radius(1.0f),
+	exponent(1.0f),
+	additive(true)
+{
+}
+
+bool TPyramidParams::IsValid() const
+{
+	return (kmPerPixel > 0.0) && (tileSize > 0) && (levels > 0) && (radius > 0.0f);
+}
+
+bool TPyramidParams::HasSameLines(const TPyramidParams& other) const
+{
+	// the line width is relative to the view, which follows the aspect of
+	// the data, so a little tolerance keeps the tiles when tracks are added
+	return (fabs(radius - other.radius) <= 0.05f * radius) &&
+	       (exponent == other.exponent) &&
+	       (additive == other.additive);
+}
+
+bool TPyramidParams::Matches(const TPyramidParams& other) const
+{
+	return HasSameLines(other) &&
+	       (fabs(kmPerPixel - other.kmPerPixel) <= 1e-9 * kmPerPixel) &&
+	       (tileSize == other.tileSize) &&
+	       (levels == other.levels);
+}
+
+bool TPyramidTile::operator<(const TPyramidTile& other) const
+{
+	if (level != other.level) {
+		return level < other.level;
+	}
+	if (x != other.x) {
+		return x < other.x;
+	}
+	return y < other.y;
+}
+
+CHistoryPyramid::CHistoryPyramid() :
+	complete(false)
+{
+}
+
+bool CHistoryPyramid::Open(const char *dir)
+{
+	Close();
+	if (!dir || !dir[0]) {
+		return false;
+	}
+	directory = dir;
+	gpxutil::makeDirectories(directory);
+	if (!LoadIndex()) {
+		gpxutil::info("history pyramid '%s': no valid index, starting empty", dir);
+		complete = false;
+		trackEntries.clear();
+		outdated.clear();
+		tiles.clear();
+	} else {
+		gpxutil::info("history pyramid '%s': %u levels, %u tiles, %u outdated regions", dir,
+			(unsigned)params.levels, (unsigned)tiles.size(), (unsigned)outdated.size());
+	}
+	return true;
+}
+
+void CHistoryPyramid::Close()
+{
+	directory.clear();
+	params = TPyramidParams();
+	complete = false;
+	trackEntries.clear();
+	outdated.clear();
+	tiles.clear();
+}
+
+std::string CHistoryPyramid::GetIndexFilename() const
+{
+	return directory + "/index.txt";
+}
+
+std::string CHistoryPyramid::GetTileFilename(const TPyramidTile& tile) const
+{
+	char buf[64];
+	mysnprintf(buf, sizeof(buf), "/%d/%d_%d.tile", tile.level, tile.x, tile.y);
+	return directory + buf;
+}
+
+bool CHistoryPyramid::LoadIndex()
+{
+	FILE *file = gpxutil::fopen_wrapper(GetIndexFilename().c_str(), "rt");
+	if (!file) {
+		return false;
+	}
+
+	char line[512];
+	bool valid = false;
+	if (fgets(line, sizeof(line), file) && !strncmp(line, pyramidIndexMagic, strlen(pyramidIndexMagic))) {
+		valid = true;
+	}
+	complete = false;
+	trackEntries.clear();
+	outdated.clear();
+	tiles.clear();
+	while (valid && fgets(line, sizeof(line), file)) {
+		int additive = 0;
+		unsigned long long key = 0;
+		TTrackEntry entry;
+		unsigned long entryCount = 0;
+		TRegion region;
+		TPyramidTile tile;
+		if (sscanf(line, "params %lf %d %d %f %f %d", &params.kmPerPixel, &params.tileSize, &params.levels,
+			   &params.radius, &params.exponent, &additive) == 6) {
+			params.additive = (additive != 0);
+			complete = params.IsValid();
+		} else if (sscanf(line, "track %llx %lu %lf %lf %lf %lf", &key, &entryCount,
+				  &entry.aabb[0], &entry.aabb[1], &entry.aabb[2], &entry.aabb[3]) == 6) {
+			entry.count = (size_t)entryCount;
+			trackEntries[key] = entry;
+		} else if (sscanf(line, "outdated %lf %lf %lf %lf", &region.rect[0], &region.rect[1], &region.rect[2], &region.rect[3]) == 4) {
+			outdated.push_back(region);
+		} else if (sscanf(line, "tile %d %d %d", &tile.level, &tile.x, &tile.y) == 3) {
+			tiles.insert(tile);
+		} else if (line[0] != '\n' && line[0] != '#') {
+			gpxutil::warn("history pyramid index: invalid line '%s'", line);
+			valid = false;
+		}
+	}
+	fclose(file);
+	return valid && complete;
+}
+
+bool CHistoryPyramid::SaveIndex() const
+{
+	if (!IsOpen()) {
+		return false;
+	}
+	// replace the old index only when the new one is complete
+	std::string filename = GetIndexFilename();
+	std::string tmpname = gpxutil::getTempFilename(filename);
+	FILE *file = gpxutil::fopen_wrapper(tmpname.c_str(), "wt");
+	if (!file) {
+		gpxutil::warn("failed to write history pyramid index '%s'", tmpname.c_str());
+		return false;
+	}
+	fprintf(file, "%s\n", pyramidIndexMagic);
+	if (complete) {
+		fprintf(file, "params %.17g %d %d %.9g %.9g %d\n", params.kmPerPixel, params.tileSize, params.levels,
+			(double)params.radius, (double)params.exponent, params.additive ? 1 : 0);
+	}
+	for (auto it = trackEntries.begin(); it != trackEntries.end(); it++) {
+		const double *r = it->second.aabb;
+		fprintf(file, "track %016llx %lu %.17g %.17g %.17g %.17g\n", it->first, (unsigned long)it->second.count, r[0], r[1], r[2], r[3]);
+	}
+	for (size_t i=0; i<outdated.size(); i++) {
+		const double *r = outdated[i].rect;
+		fprintf(file, "outdated %.17g %.17g %.17g %.17g\n", r[0], r[1], r[2], r[3]);
+	}
+	for (auto it = tiles.begin(); it != tiles.end(); it++) {
+		fprintf(file, "tile %d %d %d\n", it->level, it->x, it->y);
+	}
+	bool success = !ferror(file);
+	success = (fclose(file) == 0) && success;
+	if (!success) {
+		removeFile(tmpname);
+	} else {
+		success = replaceFile(tmpname, filename);
+	}
+	if (!success) {
+		gpxutil::warn("failed to write history pyramid index '%s'", filename.c_str());
+	}
+	return success;
+}
+
+void CHistoryPyramid::Synchronize(const std::vector<gpx::CTrack>& tracks)
+{
+	std::map<unsigned long long, TTrackEntry> current;
+	for (size_t i=0; i<tracks.size(); i++) {
+		const gpxutil::CAABB& aabb = tracks[i].GetAABB();
+		if (!aabb.IsValid()) {
+			continue;
+		}
+		unsigned long long key = getTrackKey(tracks[i]);
+		auto it = current.find(key);
+		if (it != current.end()) {
+			it->second.count++;
+		} else {
+			const double *a = aabb.Get();
+			TTrackEntry entry;
+			entry.aabb[0] = a[0];
+			entry.aabb[1] = a[1];
+			entry.aabb[2] = a[3];
+			entry.aabb[3] = a[4];
+			entry.count = 1;
+			current[key] = entry;
+		}
+	}
+
+	// both added and removed tracks change the tiles in their bounding boxes
+	size_t changed = 0;
+	for (auto it = current.begin(); it != current.end(); it++) {
+		auto old = trackEntries.find(it->first);
+		if (old == trackEntries.end() || old->second.count != it->second.count) {
+			TRegion region;
+			memcpy(region.rect, it->second.aabb, sizeof(region.rect));
+			outdated.push_back(region);
+			changed++;
+		}
+	}
+	for (auto it = trackEntries.begin(); it != trackEntries.end(); it++) {
+		if (current.find(it->first) == current.end()) {
+			TRegion region;
+			memcpy(region.rect, it->second.aabb, sizeof(region.rect));
+			outdated.push_back(region);
+			changed++;
+		}
+	}
+	trackEntries.swap(current);
+	if (changed && IsOpen()) {
+		gpxutil::info("history pyramid: %u tracks changed", (unsigned)changed);
+		SaveIndex();
+	}
+}
+
+double CHistoryPyramid::GetKmPerPixel(int level) const
+{
+	return ldexp(params.kmPerPixel, -level);
+}
+
+int CHistoryPyramid::FindLevel(double kmPerPixel, double tolerance) const
+{
+	if (!complete || kmPerPixel <= 0.0) {
+		return -1;
+	}
+	for (int l=0; l<params.levels; l++) {
+		if (fabs(kmPerPixel / GetKmPerPixel(l) - 1.0) <= tolerance) {
+			return l;
+		}
+	}
+	return -1;
+}
+
+bool CHistoryPyramid::IsUpToDate(int level, const double rect[4]) const
+{
+	if (!complete) {
+		return false;
+	}
+	// the lines reach out by the radius
+	double r = params.radius * GetKmPerPixel(level);
+	double enlarged[4] = {rect[0] - r, rect[1] - r, rect[2] + r, rect[3] + r};
+	for (size_t i=0; i<outdated.size(); i++) {
+		if (rectsOverlap(enlarged, outdated[i].rect)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void CHistoryPyramid::GetTiles(int level, const double rect[4], std::vector<TPyramidTile>& result) const
+{
+	result.clear();
+	double tileKm = GetKmPerPixel(level) * params.tileSize;
+	int minX = (int)floor(rect[0] / tileKm);
+	int minY = (int)floor(rect[1] / tileKm);
+	int maxX = (int)floor(rect[2] / tileKm);
+	int maxY = (int)floor(rect[3] / tileKm);
+
+	TPyramidTile first = {level, minX, INT_MIN};
+	for (auto it = tiles.lower_bound(first); it != tiles.end() && it->level == level && it->x <= maxX; it++) {
+		if (it->y >= minY && it->y <= maxY) {
+			result.push_back(*it);
+		}
+	}
+}
+
+void CHistoryPyramid::GetTileRect(const TPyramidTile& tile, double rect[4]) const
+{
+	double tileKm = GetKmPerPixel(tile.level) * params.tileSize;
+	rect[0] = tile.x * tileKm;
+	rect[1] = tile.y * tileKm;
+	rect[2] = (tile.x + 1) * tileKm;
+	rect[3] = (tile.y + 1) * tileKm;
+}
+
+bool CHistoryPyramid::IsTileOutdated(const TPyramidTile& tile) const
+{
+	double rect[4];
+	GetTileRect(tile, rect);
+	return !IsUpToDate(tile.level, rect);
+}
+
+void CHistoryPyramid::CollectLines(const std::vector<gpx::CTrack>& tracks, int level, bool all, TTileLines& result) const
+{
+	// every line is assigned to the tiles its enlarged bounding box
+	// overlaps, consecutive lines of a track become a single run
+	double kmPerPixel = GetKmPerPixel(level);
+	double tileKm = kmPerPixel * params.tileSize;
+	double r = params.radius * kmPerPixel;
+	std::map<TPyramidTile, bool> needed;
+
+	for (size_t i=0; i<tracks.size(); i++) {
+		const std::vector<gpx::TPoint>& points = tracks[i].GetPoints();
+		for (size_t s=0; s<tracks[i].GetSegmentCount(); s++) {
+			size_t end = tracks[i].GetSegmentEnd(s);
+			for (size_t j=tracks[i].GetSegments()[s]; j+1<end; j++) {
+				const gpx::TPoint& a = points[j];
+				const gpx::TPoint& b = points[j+1];
+				int minX = (int)floor((std::min(a.x, b.x) - r) / tileKm);
+				int minY = (int)floor((std::min(a.y, b.y) - r) / tileKm);
+				int maxX = (int)floor((std::max(a.x, b.x) + r) / tileKm);
+				int maxY = (int)floor((std::max(a.y, b.y) + r) / tileKm);
+				for (int y=minY; y<=maxY; y++) {
+					for (int x=minX; x<=maxX; x++) {
+						TPyramidTile tile = {level, x, y};
+						if (!all) {
+							auto it = needed.find(tile);
+							if (it == needed.end()) {
+								it = needed.insert(std::make_pair(tile, IsTileOutdated(tile))).first;
+							}
+							if (!it->second) {
+								continue;
+							}
+						}
+						std::vector<THistoryLineRun>& runs = result[tile];
+						if (!runs.empty() && runs.back().track == i && runs.back().end == j) {
+							runs.back().end = j + 1;
+						} else {
+							THistoryLineRun run = {i, j, j + 1};
+							runs.push_back(run);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void CHistoryPyramid::RasterizeTile(const std::vector<gpx::CTrack>& tracks, const TPyramidTile& tile, const std::vector<THistoryLineRun>& runs, std::vector<float>& data) const
+{
+	THistoryRasterParams raster;
+	double kmPerPixel = GetKmPerPixel(tile.level);
+	raster.transform[0] = 1.0 / kmPerPixel;
+	raster.transform[1] = 1.0 / kmPerPixel;
+	raster.transform[2] = -(double)tile.x * params.tileSize;
+	raster.transform[3] = -(double)tile.y * params.tileSize;
+	raster.radius = params.radius;
+	raster.exponent = params.exponent;
+	raster.additive = params.additive;
+	data.assign((size_t)params.tileSize * params.tileSize, 0.0f);
+	rasterizeHistoryLines(tracks, runs, raster, 0, 0, params.tileSize, params.tileSize, data.data(), (size_t)params.tileSize);
+}
+
+bool CHistoryPyramid::WriteTile(const TPyramidTile& tile, const std::vector<float>& data) const
+{
+	std::string filename = GetTileFilename(tile);
+	FILE *file = gpxutil::fopen_wrapper(filename.c_str(), "wb");
+	if (!file) {
+		gpxutil::warn("failed to create history tile '%s'", filename.c_str());
+		return false;
+	}
+	unsigned int header[2] = {(unsigned int)params.tileSize, 0}; // size, format: 0 is float32
+	bool success = (fwrite(pyramidTileMagic, sizeof(pyramidTileMagic), 1, file) == 1) &&
+		       (fwrite(header, sizeof(header), 1, file) == 1) &&
+		       (fwrite(data.data(), sizeof(float) * data.size(), 1, file) == 1);
+	success = (fclose(file) == 0) && success;
+	if (!success) {
+		gpxutil::warn("failed to write history tile '%s'", filename.c_str());
+		removeFile(filename);
+	}
+	return success;
+}
+
+void CHistoryPyramid::RemoveTile(const TPyramidTile& tile) const
+{
+	removeFile(GetTileFilename(tile));
+}
+
+bool CHistoryPyramid::LoadTile(const TPyramidTile& tile, std::vector<float>& data) const
+{
+	std::string filename = GetTileFilename(tile);
+	FILE *file = gpxutil::fopen_wrapper(filename.c_str(), "rb");
+	if (!file) {
+		gpxutil::warn("failed to open history tile '%s'", filename.c_str());
+		return false;
+	}
+	char magic[sizeof(pyramidTileMagic)];
+	unsigned int header[2];
+	data.resize((size_t)params.tileSize * params.tileSize);
+	bool success = (fread(magic, sizeof(magic), 1, file) == 1) &&
+		       (fread(header, sizeof(header), 1, file) == 1) &&
+		       !memcmp(magic, pyramidTileMagic, sizeof(magic)) &&
+		       (header[0] == (unsigned int)params.tileSize) && (header[1] == 0) &&
+		       (fread(data.data(), sizeof(float) * data.size(), 1, file) == 1);
+	fclose(file);
+	if (!success) {
+		gpxutil::warn("invalid history tile '%s'", filename.c_str());
+	}
+	return success;
+}
+
+bool CHistoryPyramid::Update(const std::vector<gpx::CTrack>& tracks, const TPyramidParams& newParams)
+{
+	if (!IsOpen() || !newParams.IsValid()) {
+		return false;
+	}
+	auto startTime = std::chrono::steady_clock::now();
+	bool all = !complete || !params.Matches(newParams);
+	if (all) {
+		for (auto it = tiles.begin(); it != tiles.end(); it++) {
+			RemoveTile(*it);
+		}
+		tiles.clear();
+		trackEntries.clear();
+		outdated.clear();
+		params = newParams;
+		complete = false;
+	}
+	Synchronize(tracks);
+	if (!all && outdated.empty()) {
+		return true;
+	}
+
+	std::vector<TTileLines> levelLines((size_t)params.levels);
+	gpxutil::parallelFor(levelLines.size(), [&](size_t l) {
+		CollectLines(tracks, (int)l, all, levelLines[l]);
+	});
+
+	// outdated tiles without any lines now
+	for (auto it = tiles.begin(); it != tiles.end(); ) {
+		if (IsTileOutdated(*it) && levelLines[it->level].find(*it) == levelLines[it->level].end()) {
+			RemoveTile(*it);
+			it = tiles.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	std::vector<TTileLines::const_iterator> jobs;
+	for (int l=0; l<params.levels; l++) {
+		gpxutil::makeDirectories(directory + "/" + std::to_string(l));
+		for (auto it = levelLines[l].cbegin(); it != levelLines[l].cend(); it++) {
+			jobs.push_back(it);
+		}
+	}
+	std::vector<char> ok(jobs.size(), 0);
+	gpxutil::parallelFor(jobs.size(), [&](size_t i) {
+		std::vector<float> data;
+		RasterizeTile(tracks, jobs[i]->first, jobs[i]->second, data);
+		ok[i] = WriteTile(jobs[i]->first, data) ? 1 : 0;
+	});
+
+	size_t failed = 0;
+	outdated.clear();
+	for (size_t i=0; i<jobs.size(); i++) {
+		if (ok[i]) {
+			tiles.insert(jobs[i]->first);
+		} else {
+			// stays outdated
+			TRegion region;
+			GetTileRect(jobs[i]->first, region.rect);
+			outdated.push_back(region);
+			tiles.erase(jobs[i]->first);
+			failed++;
+		}
+	}
+	complete = true;
+	bool success = SaveIndex() && !failed;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	gpxutil::info("history pyramid: %s, %u tiles written (%u failed) in %.3fs, %u tiles in total",
+		all ? "rebuilt" : "updated", (unsigned)(jobs.size() - failed), (unsigned)failed, seconds, (unsigned)tiles.size());
+	return success;
+}
+
+} // namespace gpxvis
@@ -0,0 +1,102 @@
+#ifndef GPXVIS_PYRAMID_H
+#define GPXVIS_PYRAMID_H
+
+#include "gpx.h"
+#include "raster.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace gpxvis {
+
+/****************************************************************************
+ * PRECOMPUTED HISTORY TILES ON DISK                                        *
+ ****************************************************************************/
+
+// The history of all tracks as the wide-line path draws it (per track the
+// maximum of its lines, the tracks summed up or combined by max), rasterized
+// on the CPU into square float tiles in the mercator space. Level L has a
+// resolution of kmPerPixel/2^L, tile (x,y) of a level starts at pixel
+// (x*tileSize, y*tileSize) counted from the projection origin. Each tile is
+// a file of its own, an index file keeps the parameters, the tracks the
+// tiles were built from and the regions which are outdated since.
+
+struct TPyramidParams {
+	double kmPerPixel; // resolution of level 0
+	int    tileSize;   // in pixels
+	int    levels;
+	float  radius;     // of the lines, in pixels
+	float  exponent;   // the intensity is 1 - (d/radius)^exponent
+	bool   additive;   // sum up the tracks, otherwise the maximum
+
+	TPyramidParams();
+	bool IsValid() const;
+	bool HasSameLines(const TPyramidParams& other) const; // radius within 5%, exponent and additive
+	bool Matches(const TPyramidParams& other) const;      // the same tiles
+};
+
+struct TPyramidTile {
+	int level;
+	int x;
+	int y;
+
+	bool operator<(const TPyramidTile& other) const;
+};
+
+class CHistoryPyramid {
+	public:
+		CHistoryPyramid();
+
+		bool Open(const char *dir); // loads the index if there is one, otherwise the pyramid is empty
+		void Close();
+		bool IsOpen() const {return !directory.empty();}
+		const char *GetDirectory() const {return directory.c_str();}
+		const TPyramidParams& GetParams() const {return params;}
+		size_t GetTileCount() const {return tiles.size();}
+		bool HasOutdatedRegions() const {return !complete || !outdated.empty();}
+
+		// mark the regions of the tracks added or removed since the last Update() as outdated
+		void Synchronize(const std::vector<gpx::CTrack>& tracks);
+		// rebuild the outdated tiles, all of them if the parameters changed
+		bool Update(const std::vector<gpx::CTrack>& tracks, const TPyramidParams& newParams);
+
+		double GetKmPerPixel(int level) const;
+		int    FindLevel(double kmPerPixel, double tolerance) const; // -1 if no level matches
+		bool   IsUpToDate(int level, const double rect[4]) const;    // rect in km: min x, min y, max x, max y
+		void   GetTiles(int level, const double rect[4], std::vector<TPyramidTile>& result) const; // the non-empty tiles overlapping rect
+		void   GetTileRect(const TPyramidTile& tile, double rect[4]) const;
+		bool   LoadTile(const TPyramidTile& tile, std::vector<float>& data) const;
+
+	private:
+		struct TTrackEntry {
+			double aabb[4];
+			size_t count; // identical tracks
+		};
+		struct TRegion {
+			double rect[4];
+		};
+		typedef std::map<TPyramidTile, std::vector<THistoryLineRun>> TTileLines;
+
+		std::string directory;
+		TPyramidParams params;
+		bool complete; // false: no tiles for params yet
+		std::map<unsigned long long, TTrackEntry> trackEntries;
+		std::vector<TRegion> outdated;
+		std::set<TPyramidTile> tiles;
+
+		std::string GetIndexFilename() const;
+		std::string GetTileFilename(const TPyramidTile& tile) const;
+		bool LoadIndex();
+		bool SaveIndex() const;
+		bool IsTileOutdated(const TPyramidTile& tile) const;
+		void CollectLines(const std::vector<gpx::CTrack>& tracks, int level, bool all, TTileLines& result) const;
+		void RasterizeTile(const std::vector<gpx::CTrack>& tracks, const TPyramidTile& tile, const std::vector<THistoryLineRun>& runs, std::vector<float>& data) const;
+		bool WriteTile(const TPyramidTile& tile, const std::vector<float>& data) const;
+		void RemoveTile(const TPyramidTile& tile) const;
+};
+
+} // namespace gpxvis
+
+#endif // GPXVIS_PYRAMID_H
@@ -0,0 +1,154 @@
+#include "raster.h"
+#include "util.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace gpxvis {
+
+/****************************************************************************
+ * CPU RASTERIZATION OF THE HISTORY DENSITY                                 *
+ ****************************************************************************/
+
+THistoryRasterParams::THistoryRasterParams() :
+	radius(1.0f),
+	exponent(1.0f),
+	additive(true)
+{
+	transform[0] = transform[1] = 1.0;
+	transform[2] = transform[3] = 0.0;
+}
+
+extern void rasterizeHistoryLines(const std::vector<gpx::CTrack>& tracks, const std::vector<THistoryLineRun>& runs, const THistoryRasterParams& params,
+				  int x0, int y0, int width, int height, float *data, size_t rowLength)
+{
+	// everything relative to the rectangle, pixel centers are at i + 0.5
+	const double *t = params.transform;
+	const double originX = t[2] - x0;
+	const double originY = t[3] - y0;
+	const double radius = params.radius;
+	const double r2 = radius * radius;
+	std::vector<double> minDist2((size_t)width * height, r2);
+
+	size_t runIdx = 0;
+	while (runIdx < runs.size()) {
+		size_t track = runs[runIdx].track;
+		const std::vector<gpx::TPoint>& points = tracks[track].GetPoints();
+		int touched[4] = {width, height, -1, -1};
+		for (; runIdx < runs.size() && runs[runIdx].track == track; runIdx++) {
+			for (size_t j=runs[runIdx].first; j<runs[runIdx].end; j++) {
+				double ax = points[j].x * t[0] + originX;
+				double ay = points[j].y * t[1] + originY;
+				double dx = points[j+1].x * t[0] + originX - ax;
+				double dy = points[j+1].y * t[1] + originY - ay;
+				double len2 = dx * dx + dy * dy;
+				double invLen2 = (len2 > 0.0) ? (1.0 / len2) : 0.0;
+				int minX = std::max((int)ceil(std::min(ax, ax + dx) - radius - 0.5), 0);
+				int minY = std::max((int)ceil(std::min(ay, ay + dy) - radius - 0.5), 0);
+				int maxX = std::min((int)floor(std::max(ax, ax + dx) + radius - 0.5), width - 1);
+				int maxY = std::min((int)floor(std::max(ay, ay + dy) + radius - 0.5), height - 1);
+				if (minX > maxX || minY > maxY) {
+					continue;
+				}
+				touched[0] = std::min(touched[0], minX);
+				touched[1] = std::min(touched[1], minY);
+				touched[2] = std::max(touched[2], maxX);
+				touched[3] = std::max(touched[3], maxY);
+				for (int y=minY; y<=maxY; y++) {
+					double ry = (y + 0.5) - ay;
+					double *row = &minDist2[(size_t)y * width];
+					for (int x=minX; x<=maxX; x++) {
+						double rx = (x + 0.5) - ax;
+						double h = (rx * dx + ry * dy) * invLen2;
+						h = (h < 0.0) ? 0.0 : ((h > 1.0) ? 1.0 : h);
+						double px = rx - h * dx;
+						double py = ry - h * dy;
+						double d2 = px * px + py * py;
+						if (d2 < row[x]) {
+							row[x] = d2;
+						}
+					}
+				}
+			}
+		}
+		// combine the track with the others, and reset its area
+		for (int y=touched[1]; y<=touched[3]; y++) {
+			double *row = &minDist2[(size_t)y * width];
+			float *dst = &data[(size_t)(y0 + y) * rowLength + x0];
+			for (int x=touched[0]; x<=touched[2]; x++) {
+				if (row[x] < r2) {
+					float value = (float)(1.0 - pow(sqrt(row[x]) / radius, (double)params.exponent));
+					if (params.additive) {
+						dst[x] += value;
+					} else if (value > dst[x]) {
+						dst[x] = value;
+					}
+					row[x] = r2;
+				}
+			}
+		}
+	}
+}
+
+extern void rasterizeHistory(const std::vector<gpx::CTrack>& tracks, size_t first, size_t end, const THistoryRasterParams& params,
+			     int width, int height, std::vector<float>& data)
+{
+	// One worker per tile, so that no two threads write the same pixel.
+	// The lines are assigned to the tiles their enlarged bounding boxes
+	// overlap, consecutive lines of a track become a single run.
+	const int tileSize = 64;
+	const double *t = params.transform;
+	const double r = params.radius;
+	int tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+	std::vector<std::vector<THistoryLineRun>> tileRuns((size_t)tilesX * tilesY);
+
+	data.assign((size_t)width * height, 0.0f);
+	for (size_t i=first; i<end && i<tracks.size(); i++) {
+		const std::vector<gpx::TPoint>& points = tracks[i].GetPoints();
+		for (size_t s=0; s<tracks[i].GetSegmentCount(); s++) {
+			size_t segEnd = tracks[i].GetSegmentEnd(s);
+			for (size_t j=tracks[i].GetSegments()[s]; j+1<segEnd; j++) {
+				double ax = points[j].x * t[0] + t[2];
+				double ay = points[j].y * t[1] + t[3];
+				double bx = points[j+1].x * t[0] + t[2];
+				double by = points[j+1].y * t[1] + t[3];
+				double minX = floor((std::min(ax, bx) - r) / tileSize);
+				double minY = floor((std::min(ay, by) - r) / tileSize);
+				double maxX = floor((std::max(ax, bx) + r) / tileSize);
+				double maxY = floor((std::max(ay, by) + r) / tileSize);
+				if (maxX < 0.0 || maxY < 0.0 || minX >= tilesX || minY >= tilesY) {
+					continue;
+				}
+				int x0 = (int)std::max(minX, 0.0);
+				int y0 = (int)std::max(minY, 0.0);
+				int x1 = (int)std::min(maxX, (double)(tilesX - 1));
+				int y1 = (int)std::min(maxY, (double)(tilesY - 1));
+				for (int y=y0; y<=y1; y++) {
+					for (int x=x0; x<=x1; x++) {
+						std::vector<THistoryLineRun>& runs = tileRuns[(size_t)y * tilesX + x];
+						if (!runs.empty() && runs.back().track == i && runs.back().end == j) {
+							runs.back().end = j + 1;
+						} else {
+							THistoryLineRun run = {i, j, j + 1};
+							runs.push_back(run);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	gpxutil::parallelFor(tileRuns.size(), [&](size_t i) {
+		if (tileRuns[i].empty()) {
+			return;
+		}
+		int x = (int)(i % tilesX) * tileSize;
+		int y = (int)(i / tilesX) * tileSize;
+		rasterizeHistoryLines(tracks, tileRuns[i], params, x, y,
+			std::min(tileSize, width - x), std::min(tileSize, height - y), data.data(), (size_t)width);
+	});
+}
+
+} // namespace gpxvis
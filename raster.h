@@ -0,0 +1,45 @@
+#ifndef GPXVIS_RASTER_H
+#define GPXVIS_RASTER_H
+
+#include "gpx.h"
+
+#include <vector>
+
+namespace gpxvis {
+
+/****************************************************************************
+ * CPU RASTERIZATION OF THE HISTORY DENSITY                                 *
+ ****************************************************************************/
+
+// The same as the wide history lines of line.fs and history.cs: per track
+// the nearest line counts, the tracks are summed up or combined by max.
+
+struct THistoryRasterParams {
+	double transform[4]; // mercator km to pixels: x * transform[0] + transform[2], y * transform[1] + transform[3]
+	float  radius;       // of the lines, in pixels
+	float  exponent;     // the intensity is 1 - (d/radius)^exponent
+	bool   additive;
+
+	THistoryRasterParams();
+};
+
+struct THistoryLineRun { // lines first to end-1 of a track, line i connects point i and i+1
+	size_t track;
+	size_t first;
+	size_t end;
+};
+
+// Rasterize the runs into the rectangle (x, y, width, height) of the image
+// data with rowLength floats per row, bottom-up. The runs of a track must be
+// consecutive. The data is combined with what is there already.
+extern void rasterizeHistoryLines(const std::vector<gpx::CTrack>& tracks, const std::vector<THistoryLineRun>& runs, const THistoryRasterParams& params,
+				  int x, int y, int width, int height, float *data, size_t rowLength);
+
+// The history of the tracks first to end-1 as a width x height image,
+// bottom-up. The image is split into tiles which are computed in parallel.
+extern void rasterizeHistory(const std::vector<gpx::CTrack>& tracks, size_t first, size_t end, const THistoryRasterParams& params,
+			     int width, int height, std::vector<float>& data);
+
+} // namespace gpxvis
+
+#endif // GPXVIS_RASTER_H
@@ -18,7 +18,9 @@ layout(std140, binding=1) uniform lineParamUBO
 
 void main()
 {
-	float history = texture(texBackground, texCoord).r;
+	// same size as the target, the textures may be larger
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float history = texelFetch(texBackground, pixel, 0).r;
 	float standardHistory = min(history, 1.0);
 	float historyExp = pow(history,lineParam.distExp.x);
 	float extraHistory = max(historyExp - 1.0, 0.0);
@@ -28,7 +30,7 @@ void main()
 	int sel = int(gradient);
 	vec4 bgB = min(mix(lineParam.colorGradient[sel],lineParam.colorGradient[sel+1],fract(gradient)), 1.0);
 	vec4 bg = lineParam.distCoeff[0] * bgA + lineParam.distCoeff[1]* bgB;
-	vec4 fg = texture(texOverlay, texCoord);
+	vec4 fg = texelFetch(texOverlay, pixel, 0);
 	float alpha = baseAlpha * fg.a;
 	color = vec4(mix(bg.rgb, fg.rgb, alpha), alpha);
 }
@@ -0,0 +1,287 @@
+#version 430 core
+
+// Splat the wide history lines of many tracks at once.
+// One work group handles a tile of 16x16 pixels for a slice of the tracks.
+// The lines are culled against the tile hierarchically: groups of chunks,
+// chunks of consecutive lines, and finally the lines themselves. The
+// compaction keeps the order, so the lines arrive sorted by track. Each
+// line gets a mask of the 4x4 pixel sub-tiles it touches, so that most
+// pixels can skip the distance calculation.
+// Per track, a pixel gets the maximum of all of the track's lines (like the
+// GL_MAX blending into the scratch buffer of the raster path), so each track
+// counts only once per pixel. The tracks of the slice are then summed up
+// (or combined by max in non-additive mode) in registers, and the result is
+// added to the accumulation image with a single atomic per pixel.
+// There are no float image atomics in core GL, so the accumulation is in
+// fixed point with 16 fractional bits.
+
+#define TILE_SIZE 16
+#define BATCH_SIZE (TILE_SIZE * TILE_SIZE)
+#define CHUNK_LINES 32  // must match CHistoryBatch::chunkLines
+#define GROUP_CHUNKS 32 // must match CHistoryBatch::groupChunks
+#define CHUNKS_PER_BATCH (BATCH_SIZE / CHUNK_LINES)
+#define GROUPS_PER_BATCH (BATCH_SIZE / GROUP_CHUNKS)
+#define SUBTILE_SIZE 4
+#define SUBTILES (TILE_SIZE / SUBTILE_SIZE)
+#define FIXED_POINT_SCALE 65536.0
+
+layout(local_size_x=TILE_SIZE, local_size_y=TILE_SIZE) in;
+
+layout(std140, binding=0) uniform transformParamUBO
+{
+	vec4 scale_offset;
+	vec4 size;
+	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
+} transformParam;
+
+layout(std140, binding=1) uniform lineParamUBO
+{
+	vec4 colorBase;
+	vec4 colorGradient[4];
+	vec4 distCoeff;
+	vec4 distExp;
+	vec4 lineWidths;
+} lineParam;
+
+struct chunk {
+	vec4 bbox;  // min.xy, max.xy in data space
+	uint first; // first line of a chunk, first chunk of a group
+	uint count;
+	uint track;
+	uint reserved;
+};
+
+layout(std430, binding=1) readonly buffer historyVertexBuffer
+{
+	vec2 vertices[];
+};
+
+layout(std430, binding=2) readonly buffer historyChunkBuffer
+{
+	chunk chunks[];
+};
+
+layout(std430, binding=3) readonly buffer historyGroupBuffer
+{
+	chunk groups[];
+};
+
+layout(std430, binding=4) readonly buffer historyTrackBuffer
+{
+	uint trackFirstGroup[]; // one additional end marker
+};
+
+layout(binding=0, r32ui) uniform uimage2D accu;
+
+// x: number of tracks, y: tracks per slice, z: additive
+layout(location=0) uniform ivec4 trackInfo;
+
+shared uint sharedScan[BATCH_SIZE];
+shared uint sharedRowSum[TILE_SIZE];
+shared uint sharedGroups[BATCH_SIZE];
+shared uint sharedChunks[BATCH_SIZE];
+shared vec4 sharedLines[BATCH_SIZE]; // start point, direction, in units of the line width
+shared float sharedLineInvLen2[BATCH_SIZE];
+shared uint sharedLineTrack[BATCH_SIZE];
+shared uint sharedLineMask[BATCH_SIZE];
+
+vec2 pixelToZoomed(vec2 pixel)
+{
+	vec2 ndc = 2.0 * pixel * transformParam.size.zw - vec2(1.0);
+	return (ndc - transformParam.scale_offset.zw) / transformParam.scale_offset.xy;
+}
+
+vec2 zoomedToPixel(vec2 pos)
+{
+	vec2 ndc = transformParam.scale_offset.xy * pos + transformParam.scale_offset.zw;
+	return (0.5 * ndc + vec2(0.5)) * transformParam.size.xy;
+}
+
+vec2 dataToZoomed(vec2 pos)
+{
+	return transformParam.zoomShift.xy * pos + transformParam.zoomShift.zw;
+}
+
+bool overlapsTile(vec2 minPos, vec2 maxPos, vec2 tileMin, vec2 tileMax)
+{
+	return all(lessThanEqual(minPos, tileMax)) && all(greaterThanEqual(maxPos, tileMin));
+}
+
+// Order-preserving compaction: returns the position of this invocation's
+// element among all kept elements of the work group, and their total count.
+// Must be called in uniform control flow.
+uint compactIndex(bool keep, out uint total)
+{
+	uint local = gl_LocalInvocationIndex;
+	uint flag = keep ? 1u : 0u;
+	sharedScan[local] = flag;
+	memoryBarrierShared();
+	barrier();
+	if (local < TILE_SIZE) {
+		// inclusive prefix sum of a row
+		uint sum = 0;
+		for (uint i = 0; i < TILE_SIZE; i++) {
+			sum += sharedScan[local * TILE_SIZE + i];
+			sharedScan[local * TILE_SIZE + i] = sum;
+		}
+		sharedRowSum[local] = sum;
+	}
+	memoryBarrierShared();
+	barrier();
+	uint row = local / TILE_SIZE;
+	uint rowBase = 0;
+	total = 0;
+	for (uint i = 0; i < TILE_SIZE; i++) {
+		rowBase += (i < row) ? sharedRowSum[i] : 0u;
+		total += sharedRowSum[i];
+	}
+	uint idx = rowBase + sharedScan[local] - flag;
+	barrier();
+	return idx;
+}
+
+float getIntensity(float dist2)
+{
+	// same function of the distance as line.fs
+	if (dist2 > 1.0) {
+		return 0.0;
+	}
+	return lineParam.distCoeff.x * (1.0 - pow(sqrt(dist2), lineParam.distExp.x)) + lineParam.distCoeff.y;
+}
+
+float combine(float result, float value)
+{
+	return (trackInfo.z != 0) ? (result + value) : max(result, value);
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+	uint local = gl_LocalInvocationIndex;
+	float width = lineParam.lineWidths.x;
+	float invWidth = 1.0 / width;
+
+	// everything is compared in the zoomed space the line shaders use,
+	// the tile is enlarged by the line width
+	vec2 pos = pixelToZoomed(vec2(pixel) + vec2(0.5)) * invWidth;
+	vec2 tileMin = pixelToZoomed(vec2(gl_WorkGroupID.xy * gl_WorkGroupSize.xy)) - vec2(width);
+	vec2 tileMax = pixelToZoomed(vec2((gl_WorkGroupID.xy + uvec2(1)) * gl_WorkGroupSize.xy)) + vec2(width);
+	vec2 tileOrigin = vec2(gl_WorkGroupID.xy * gl_WorkGroupSize.xy);
+	vec2 widthPixels = 0.5 * width * transformParam.scale_offset.xy * transformParam.size.xy;
+	uvec2 subTile = gl_LocalInvocationID.xy / uvec2(SUBTILE_SIZE);
+	uint subTileBit = 1u << (subTile.y * SUBTILES + subTile.x);
+
+	uint firstTrack = gl_WorkGroupID.z * uint(trackInfo.y);
+	uint endTrack = min(firstTrack + uint(trackInfo.y), uint(trackInfo.x));
+	uint groupEnd = trackFirstGroup[endTrack];
+
+	// the intensity falls off monotonically with the distance, so the
+	// maximum over the lines of a track is that of its nearest line
+	uint curTrack = firstTrack;
+	float minDist2 = 2.0;
+	float result = 0.0;
+
+	for (uint g = trackFirstGroup[firstTrack]; g < groupEnd; g += BATCH_SIZE) {
+		// cull the groups, one group per invocation
+		uint groupCount;
+		uint gi = g + local;
+		bool keep = false;
+		if (gi < groupEnd) {
+			vec4 bbox = groups[gi].bbox;
+			keep = overlapsTile(dataToZoomed(bbox.xy), dataToZoomed(bbox.zw), tileMin, tileMax);
+		}
+		uint idx = compactIndex(keep, groupCount);
+		if (keep) {
+			sharedGroups[idx] = gi;
+		}
+		memoryBarrierShared();
+		barrier();
+
+		for (uint j = 0; j < groupCount; j += GROUPS_PER_BATCH) {
+			// cull the chunks of the visible groups, one chunk per invocation
+			uint chunkCount;
+			uint jg = j + local / GROUP_CHUNKS;
+			uint jc = local % GROUP_CHUNKS;
+			uint ci = 0;
+			keep = false;
+			if (jg < groupCount && jc < groups[sharedGroups[jg]].count) {
+				ci = groups[sharedGroups[jg]].first + jc;
+				vec4 bbox = chunks[ci].bbox;
+				keep = overlapsTile(dataToZoomed(bbox.xy), dataToZoomed(bbox.zw), tileMin, tileMax);
+			}
+			idx = compactIndex(keep, chunkCount);
+			if (keep) {
+				sharedChunks[idx] = ci;
+			}
+			memoryBarrierShared();
+			barrier();
+
+			for (uint k = 0; k < chunkCount; k += CHUNKS_PER_BATCH) {
+				// fetch the lines of the visible chunks, one line per invocation
+				uint lineCount;
+				uint kc = k + local / CHUNK_LINES;
+				uint kl = local % CHUNK_LINES;
+				vec2 a = vec2(0.0);
+				vec2 b = vec2(0.0);
+				uint track = 0;
+				keep = false;
+				if (kc < chunkCount && kl < chunks[sharedChunks[kc]].count) {
+					uint li = chunks[sharedChunks[kc]].first + kl;
+					track = chunks[sharedChunks[kc]].track;
+					a = dataToZoomed(vertices[li]);
+					b = dataToZoomed(vertices[li + 1]);
+					keep = overlapsTile(min(a, b), max(a, b), tileMin, tileMax);
+				}
+				idx = compactIndex(keep, lineCount);
+				if (keep) {
+					vec2 delta = (b - a) * invWidth;
+					float len2 = dot(delta, delta);
+					sharedLines[idx] = vec4(a * invWidth, delta);
+					sharedLineInvLen2[idx] = (len2 > 0.0) ? (1.0 / len2) : 0.0;
+					sharedLineTrack[idx] = track;
+					// the sub-tiles touched by the bounding box of the line
+					vec2 minPixel = (zoomedToPixel(min(a, b)) - widthPixels - tileOrigin) / float(SUBTILE_SIZE);
+					vec2 maxPixel = (zoomedToPixel(max(a, b)) + widthPixels - tileOrigin) / float(SUBTILE_SIZE);
+					uvec2 minSub = uvec2(clamp(ivec2(floor(minPixel)), ivec2(0), ivec2(SUBTILES - 1)));
+					uvec2 maxSub = uvec2(clamp(ivec2(floor(maxPixel)), ivec2(0), ivec2(SUBTILES - 1)));
+					uint rowMask = ((2u << maxSub.x) - 1u) & ~((1u << minSub.x) - 1u);
+					uint mask = 0u;
+					for (uint y = minSub.y; y <= maxSub.y; y++) {
+						mask |= rowMask << (y * SUBTILES);
+					}
+					sharedLineMask[idx] = mask;
+				}
+				memoryBarrierShared();
+				barrier();
+
+				// squared distance to the line, with round caps
+				for (uint l = 0; l < lineCount; l++) {
+					if (sharedLineTrack[l] != curTrack) {
+						result = combine(result, getIntensity(minDist2));
+						minDist2 = 2.0;
+						curTrack = sharedLineTrack[l];
+					}
+					if ((sharedLineMask[l] & subTileBit) == 0u) {
+						continue;
+					}
+					vec4 line = sharedLines[l];
+					vec2 rel = pos - line.xy;
+					float h = clamp(dot(rel, line.zw) * sharedLineInvLen2[l], 0.0, 1.0);
+					vec2 r = rel - h * line.zw;
+					minDist2 = min(minDist2, dot(r, r));
+				}
+			}
+		}
+	}
+	result = combine(result, getIntensity(minDist2));
+
+	if (result > 0.0 && all(lessThan(pixel, ivec2(transformParam.size.xy)))) {
+		uint fixedValue = uint(result * FIXED_POINT_SCALE + 0.5);
+		if (trackInfo.z != 0) {
+			imageAtomicAdd(accu, pixel, fixedValue);
+		} else {
+			imageAtomicMax(accu, pixel, fixedValue);
+		}
+	}
+}
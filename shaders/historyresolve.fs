@@ -0,0 +1,14 @@
+#version 430 core
+
+in vec2 texCoord;
+layout(location=0) out vec4 color;
+
+layout(location=0, binding=3) uniform usampler2D accu;
+layout(location=1) uniform float scale;
+
+void main()
+{
+	// convert the fixed point accumulation of history.cs back to float
+	float value = float(texelFetch(accu, ivec2(gl_FragCoord.xy), 0).r) * scale;
+	color = vec4(value, value, value, value);
+}
@@ -1,6 +1,7 @@
 #version 430 core
 
 in vec2 lineCoord;
+flat in float lineLength;
 layout(location=0) out vec4 color;
 
 layout(std140, binding=1) uniform lineParamUBO
@@ -14,7 +15,8 @@ layout(std140, binding=1) uniform lineParamUBO
 
 void main()
 {
-	float d = length(lineCoord);
+	// distance to the line, with round caps at both ends
+	float d = length(vec2(lineCoord.x - clamp(lineCoord.x, 0.0, lineLength), lineCoord.y));
 	if (d > 1.0) {
 		discard;
 	}
@@ -2,7 +2,7 @@
 
 layout(std430, binding=0) readonly buffer pointsBuffer
 {
-	vec2 point[];
+	uint data[];
 } points;
 
 layout(std140, binding=0) uniform transformParamUBO
@@ -10,8 +10,15 @@ layout(std140, binding=0) uniform transformParamUBO
 	vec4 scale_offset;
 	vec4 size;
 	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
 } transformParam;
 
+layout(std140, binding=2) uniform polygonParamUBO
+{
+	vec4 decode;
+	ivec4 info;
+} polygonParam;
+
 layout(std140, binding=1) uniform lineParamUBO
 {
 	vec4 colorBase;
@@ -26,18 +33,30 @@ layout(location=1) uniform float upTo;
 out vec2 lineCoord;
 out vec2 texCoord;
 
+vec2 getPoint(int idx)
+{
+	vec2 p;
+	if (polygonParam.info.x != 0) {
+		p = unpackUnorm2x16(points.data[idx]);
+	} else {
+		p = vec2(uintBitsToFloat(points.data[2*idx]), uintBitsToFloat(points.data[2*idx+1]));
+	}
+	// decode maps directly into the zoomed space
+	return polygonParam.decode.xy * p + polygonParam.decode.zw;
+}
+
 void main()
 {
 	int idx = int(upTo);
-	int maxIdx = points.point.length()-1;
-	vec2 line[2] = vec2[2](points.point[min(idx,maxIdx)],points.point[min(idx+1,maxIdx)]);
+	int maxIdx = polygonParam.info.y-1;
+	vec2 line[2] = vec2[2](getPoint(min(idx,maxIdx)),getPoint(min(idx+1,maxIdx)));
 	int vertexIdx = gl_VertexID % 6;
 	vec2 vertices[6]=vec2[6](vec2(-1,-1), vec2(1,-1), vec2(1, 1), vec2(-1,-1), vec2(1,1), vec2(-1,1));
-	vec2 point = transformParam.zoomShift.xy * mix(line[0], line[1], fract(upTo)) + transformParam.zoomShift.zw;
+	vec2 point = mix(line[0], line[1], fract(upTo));
 
 	vec2 vertex = vertices[vertexIdx];
 	lineCoord = vertex;
 	vec2 basePoint = point + lineParam.lineWidths.zw * vertex;
 	gl_Position = vec4(transformParam.scale_offset.xy * basePoint + transformParam.scale_offset.zw, 0, 1);
-	texCoord = 0.5 * (transformParam.scale_offset.xy * point + transformParam.scale_offset.zw) + 0.5;
+	texCoord = (0.5 * (transformParam.scale_offset.xy * point + transformParam.scale_offset.zw) + 0.5) * transformParam.texScale.xy;
 }
@@ -0,0 +1,20 @@
+#version 430 core
+
+in vec2 texCoord;
+layout(location=0) out vec4 color;
+
+layout(location=0, binding=3) uniform sampler2D tex;
+layout(location=1) uniform vec4 texTransform; // scale, offset: view coordinates of this pixel in the source
+layout(location=2) uniform vec4 texRange;     // framebuffer size relative to the texture size, half a texel
+
+void main()
+{
+	// warp the source to the current transform, it has no data outside of its view
+	vec2 pos = texTransform.xy * texCoord + texTransform.zw;
+	if (any(lessThan(pos, vec2(0.0))) || any(greaterThan(pos, vec2(1.0)))) {
+		color = vec4(0.0);
+		return;
+	}
+	vec2 coord = clamp(pos * texRange.xy, texRange.zw, texRange.xy - texRange.zw);
+	color = textureLod(tex, coord, 0.0);
+}
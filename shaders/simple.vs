@@ -2,7 +2,7 @@
 
 layout(std430, binding=0) readonly buffer pointsBuffer
 {
-	vec2 point[];
+	uint data[];
 } points;
 
 layout(std140, binding=0) uniform transformParamUBO
@@ -10,13 +10,32 @@ layout(std140, binding=0) uniform transformParamUBO
 	vec4 scale_offset;
 	vec4 size;
 	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
 } transformParam;
 
+layout(std140, binding=2) uniform polygonParamUBO
+{
+	vec4 decode;
+	ivec4 info;
+} polygonParam;
+
 out vec2 lineCoord;
 
+vec2 getPoint(int idx)
+{
+	vec2 p;
+	if (polygonParam.info.x != 0) {
+		p = unpackUnorm2x16(points.data[idx]);
+	} else {
+		p = vec2(uintBitsToFloat(points.data[2*idx]), uintBitsToFloat(points.data[2*idx+1]));
+	}
+	// decode maps directly into the zoomed space
+	return polygonParam.decode.xy * p + polygonParam.decode.zw;
+}
+
 void main()
 {
-	vec2 basePoint = transformParam.zoomShift.xy * points.point[gl_VertexID] + transformParam.zoomShift.zw;
+	vec2 basePoint = getPoint(gl_VertexID);
 	lineCoord = vec2(0, gl_VertexID & 1);
 	gl_Position = vec4(transformParam.scale_offset.xy * basePoint + transformParam.scale_offset.zw, 0, 1);
 }
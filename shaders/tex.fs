@@ -7,5 +7,6 @@ layout(location=0, binding=3) uniform sampler2D tex;
 
 void main()
 {
-	color = texture(tex, texCoord);
+	// same size as the target, the texture may be larger
+	color = texelFetch(tex, ivec2(gl_FragCoord.xy), 0);
 }
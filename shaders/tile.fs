@@ -0,0 +1,13 @@
+#version 430 core
+
+in vec2 texCoord;
+layout(location=0) out vec4 color;
+
+layout(location=1, binding=3) uniform sampler2D tile;
+
+void main()
+{
+	// a tile of the precomputed history, see CHistoryPyramid
+	float value = textureLod(tile, texCoord, 0.0).r;
+	color = vec4(value, value, value, value);
+}
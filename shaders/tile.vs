@@ -0,0 +1,22 @@
+#version 430 core
+
+layout(std140, binding=0) uniform transformParamUBO
+{
+	vec4 scale_offset;
+	vec4 size;
+	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
+} transformParam;
+
+layout(location=0) uniform vec4 rect; // min.xy, max.xy in the zoomed space
+
+out vec2 texCoord;
+
+void main()
+{
+	// a quad covering the tile, as triangle strip
+	vec2 corners[4] = vec2[4](vec2(0,0), vec2(1,0), vec2(0,1), vec2(1,1));
+	texCoord = corners[gl_VertexID];
+	vec2 pos = mix(rect.xy, rect.zw, texCoord);
+	gl_Position = vec4(transformParam.scale_offset.xy * pos + transformParam.scale_offset.zw, 0, 1);
+}
@@ -1,10 +1,19 @@
 #version 430 core
 
 in vec2 lineCoord;
-in vec2 texCoord;
+flat in float lineLength;
+flat in vec4 texCoordEnds;
 
 layout(location=0) out vec4 color;
 
+layout(std140, binding=0) uniform transformParamUBO
+{
+	vec4 scale_offset;
+	vec4 size;
+	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
+} transformParam;
+
 layout(std140, binding=1) uniform lineParamUBO
 {
 	vec4 colorBase;
@@ -18,7 +27,9 @@ layout(location=0, binding=0) uniform sampler2D texBackground;
 
 void main()
 {
-	float d = length(lineCoord);
+	// distance to the line, with round caps at both ends
+	float along = clamp(lineCoord.x, 0.0, lineLength);
+	float d = length(vec2(lineCoord.x - along, lineCoord.y));
 
 	if (d > 1.0) {
 		discard;
@@ -26,6 +37,9 @@ void main()
 	d = pow(d, lineParam.distExp.x);
 	gl_FragDepth = d;
 
+	vec2 texCoord = mix(texCoordEnds.xy, texCoordEnds.zw, (lineLength > 0.0) ? along / lineLength : 0.0);
+	// the texture is larger than the framebuffer, the texels outside are stale
+	texCoord = clamp(texCoord, transformParam.texScale.zw, transformParam.texScale.xy - transformParam.texScale.zw);
 	float ndHere = texelFetch(texBackground, ivec2(gl_FragCoord.xy), 0).r;
 	float ndLine = textureLod(texBackground, texCoord, 0).r;
 	float nd = 2.0 * clamp(max(ndHere, ndLine), 0.0, 1.999999);
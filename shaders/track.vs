@@ -1,17 +1,19 @@
 #version 430 core
 
-layout(std430, binding=0) readonly buffer pointsBuffer
-{
-	vec2 point[];
-} points;
-
 layout(std140, binding=0) uniform transformParamUBO
 {
 	vec4 scale_offset;
 	vec4 size;
 	vec4 zoomShift;
+	vec4 texScale; // xy: framebuffer size relative to the texture size, zw: half a texel
 } transformParam;
 
+layout(std140, binding=2) uniform polygonParamUBO
+{
+	vec4 decode;
+	ivec4 info;
+} polygonParam;
+
 layout(std140, binding=1) uniform lineParamUBO
 {
 	vec4 colorBase;
@@ -22,20 +24,26 @@ layout(std140, binding=1) uniform lineParamUBO
 } lineParam;
 
 layout(location=1) uniform float upTo;
+layout(location=2) uniform int lineBase; // index of the first line of this draw
+
+// one instance per line, both end points are per-instance attributes
+layout(location=0) in vec2 pointA;
+layout(location=1) in vec2 pointB;
 
 out vec2 lineCoord;
-out vec2 texCoord;
+flat out float lineLength;
+flat out vec4 texCoordEnds;
 
 void main()
 {
-	int lineIdx = gl_VertexID / 18;
-	int partIdx = gl_VertexID % 18;
-	int segmentIdx = partIdx / 6;
-	int vertexIdx = partIdx % 6;
+	int lineIdx = lineBase + gl_InstanceID;
+	// a single quad covers the line including both caps,
+	// the caps are shaped in the fragment shader
 	vec2 vertices[6]=vec2[6](vec2(-1,-1), vec2(1,-1), vec2(1, 1), vec2(-1,-1), vec2(1,1), vec2(-1,1));
-	ivec2 pointSelector[3] = ivec2[3](ivec2(0,0), ivec2(1,1), ivec2(0,1));
 
-	vec2 line[2] = vec2[2](points.point[lineIdx],points.point[lineIdx+1]);
+	// decode maps directly into the zoomed space
+	vec2 line[2] = vec2[2](polygonParam.decode.xy * pointA + polygonParam.decode.zw,
+	                       polygonParam.decode.xy * pointB + polygonParam.decode.zw);
 
 	vec2 delta = line[1] - line[0];
 	if (lineIdx >= int(upTo)) {
@@ -45,28 +53,23 @@ void main()
 	float len = length(delta);
 	vec2 t;
 	if (len > 0.0000001) {
-		t = normalize(delta);
+		t = delta / len;
 	} else {
 		t = vec2(1,0);
 	}
 	vec2 n = vec2(-t.y, t.x);
 
-	ivec2 selector = pointSelector[segmentIdx];
-	vec2 vertex = vertices[vertexIdx];
-
+	vec2 vertex = vertices[gl_VertexID];
 	int side = (vertex.x < 0.0) ? 0 : 1;
-	vec2 basePoint = transformParam.zoomShift.xy * line[selector[side]] + transformParam.zoomShift.zw;
-	if (segmentIdx == selector[0] && side == (1-selector[0])) {
-		vertex.x = 0.0;
-	} else {
-		vertex.x *= float(1 - selector.y + selector.x);
-	}
-	lineCoord = vertex;
+	float width = lineParam.lineWidths.y;
 
-	vertex = lineParam.lineWidths.y * vertex;
+	// lineCoord.x is the position along the line in units of the width
+	lineLength = len / width;
+	lineCoord = vec2(vertex.x + float(side) * lineLength, vertex.y);
 
-	vec2 movedPoint = basePoint + vertex.x * t + vertex.y * n;
+	vec2 movedPoint = line[side] + width * (vertex.x * t + vertex.y * n);
 
 	gl_Position = vec4(transformParam.scale_offset.xy * movedPoint + transformParam.scale_offset.zw, 0, 1);
-	texCoord = 0.5 * (transformParam.scale_offset.xy * basePoint + transformParam.scale_offset.zw) + 0.5;
+	texCoordEnds.xy = (0.5 * (transformParam.scale_offset.xy * line[0] + transformParam.scale_offset.zw) + 0.5) * transformParam.texScale.xy;
+	texCoordEnds.zw = (0.5 * (transformParam.scale_offset.xy * line[1] + transformParam.scale_offset.zw) + 0.5) * transformParam.texScale.xy;
 }
@@ -0,0 +1,269 @@
+#include "stream.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef GPXVIS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef GPXVIS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace gpxstream {
+
+// size of the buffer for compressed input data
+static const size_t compressedBlockSize = 64 * 1024;
+
+/****************************************************************************
+ * FILE NAME SUFFIXES OF SUPPORTED COMPRESSION FORMATS                      *
+ ****************************************************************************/
+
+extern const char *getCompressedSuffix(int index)
+{
+	const char* suffixes[] = {
+#ifdef GPXVIS_WITH_ZLIB
+		".gz",
+#endif
+#ifdef GPXVIS_WITH_ZSTD
+		".zst",
+#endif
+		NULL
+	};
+
+	if (index < 0 || index >= (int)(sizeof(suffixes)/sizeof(suffixes[0]))) {
+		return NULL;
+	}
+	return suffixes[index];
+}
+
+/****************************************************************************
+ * UNCOMPRESSED FILES                                                       *
+ ****************************************************************************/
+
+class CPlainInputStream : public CInputStream {
+	public:
+		CPlainInputStream(FILE *f) : CInputStream(f) {}
+
+		virtual size_t Read(void *buffer, size_t size)
+		{
+			size_t cnt = fread(buffer, 1, size, file);
+			if (cnt < size && ferror(file)) {
+				failed = true;
+			}
+			return cnt;
+		}
+};
+
+/****************************************************************************
+ * GZIP AND ZLIB COMPRESSED FILES                                           *
+ ****************************************************************************/
+
+#ifdef GPXVIS_WITH_ZLIB
+class CGzipInputStream : public CInputStream {
+	public:
+		CGzipInputStream(FILE *f) :
+			CInputStream(f),
+			initialized(false),
+			finished(false)
+		{
+			memset(&zs, 0, sizeof(zs));
+			// 15 + 32: maximum window size, detect gzip or zlib header
+			if (inflateInit2(&zs, 15 + 32) == Z_OK) {
+				initialized = true;
+			} else {
+				failed = true;
+			}
+		}
+
+		virtual ~CGzipInputStream()
+		{
+			if (initialized) {
+				inflateEnd(&zs);
+			}
+		}
+
+		virtual size_t Read(void *buffer, size_t size)
+		{
+			if (!initialized || failed) {
+				return 0;
+			}
+			zs.next_out = (Bytef*)buffer;
+			zs.avail_out = (uInt)size;
+			while (zs.avail_out > 0 && !finished) {
+				if (zs.avail_in == 0) {
+					zs.avail_in = (uInt)fread(input, 1, sizeof(input), file);
+					zs.next_in = input;
+					if (zs.avail_in == 0 && ferror(file)) {
+						failed = true;
+						break;
+					}
+				}
+				// at the end of the file, inflate may still have output pending
+				int res = inflate(&zs, Z_NO_FLUSH);
+				if (res == Z_BUF_ERROR && zs.avail_in == 0) {
+					// no progress without more input: the file is truncated
+					gpxutil::warn("gzip stream ended prematurely");
+					failed = true;
+					break;
+				}
+				if (res == Z_STREAM_END) {
+					// gzip files may consist of several members
+					if (zs.avail_in == 0) {
+						int c = fgetc(file);
+						if (c == EOF) {
+							finished = true;
+							break;
+						}
+						input[0] = (Bytef)c;
+						zs.next_in = input;
+						zs.avail_in = 1;
+					}
+					inflateReset(&zs);
+				} else if (res != Z_OK && res != Z_BUF_ERROR) {
+					gpxutil::warn("gzip stream corrupted: %s", (zs.msg)?zs.msg:"unknown error");
+					failed = true;
+					break;
+				}
+			}
+			return size - zs.avail_out;
+		}
+
+	private:
+		z_stream zs;
+		bool initialized;
+		bool finished;
+		Bytef input[compressedBlockSize];
+};
+#endif // GPXVIS_WITH_ZLIB
+
+/****************************************************************************
+ * ZSTANDARD COMPRESSED FILES                                               *
+ ****************************************************************************/
+
+#ifdef GPXVIS_WITH_ZSTD
+class CZstdInputStream : public CInputStream {
+	public:
+		CZstdInputStream(FILE *f) :
+			CInputStream(f),
+			lastResult(0),
+			finished(false)
+		{
+			ds = ZSTD_createDStream();
+			if (ds) {
+				ZSTD_initDStream(ds);
+			} else {
+				failed = true;
+			}
+			in.src = input;
+			in.size = 0;
+			in.pos = 0;
+		}
+
+		virtual ~CZstdInputStream()
+		{
+			if (ds) {
+				ZSTD_freeDStream(ds);
+			}
+		}
+
+		virtual size_t Read(void *buffer, size_t size)
+		{
+			ZSTD_outBuffer out = {buffer, size, 0};
+
+			if (!ds || failed) {
+				return 0;
+			}
+			while (out.pos < out.size && !finished) {
+				if (in.pos >= in.size) {
+					in.size = fread(input, 1, sizeof(input), file);
+					in.pos = 0;
+					if (in.size == 0 && ferror(file)) {
+						failed = true;
+						break;
+					}
+				}
+				// at the end of the file, the decoder may still have output pending
+				size_t outPos = out.pos;
+				size_t res = ZSTD_decompressStream(ds, &out, &in);
+				if (ZSTD_isError(res)) {
+					gpxutil::warn("zstd stream corrupted: %s", ZSTD_getErrorName(res));
+					failed = true;
+					break;
+				}
+				if (in.size == 0 && out.pos == outPos) {
+					// the stream must end on a frame boundary
+					if (lastResult != 0) {
+						gpxutil::warn("zstd stream ended prematurely");
+						failed = true;
+					}
+					finished = true;
+					break;
+				}
+				lastResult = res; // 0 at the end of a frame
+			}
+			return out.pos;
+		}
+
+	private:
+		ZSTD_DStream *ds;
+		ZSTD_inBuffer in;
+		size_t lastResult;
+		bool finished;
+		unsigned char input[compressedBlockSize];
+};
+#endif // GPXVIS_WITH_ZSTD
+
+/****************************************************************************
+ * SEQUENTIAL INPUT STREAM, TRANSPARENTLY DECOMPRESSES THE DATA             *
+ ****************************************************************************/
+
+CInputStream::CInputStream(FILE *f) :
+	file(f),
+	failed(false)
+{
+}
+
+CInputStream::~CInputStream()
+{
+	if (file) {
+		fclose(file);
+	}
+}
+
+CInputStream* CInputStream::Open(const char *filename)
+{
+	unsigned char magic[4] = {0, 0, 0, 0};
+
+	FILE *file = gpxutil::fopen_wrapper(filename, "rb");
+	if (!file) {
+		return NULL;
+	}
+	size_t cnt = fread(magic, 1, sizeof(magic), file);
+	fseek(file, 0, SEEK_SET);
+
+	if (cnt >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifdef GPXVIS_WITH_ZLIB
+		return new CGzipInputStream(file);
+#else
+		gpxutil::warn("'%s' is gzip compressed, but gzip support is not compiled in", filename);
+		fclose(file);
+		return NULL;
+#endif
+	}
+	if (cnt >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef GPXVIS_WITH_ZSTD
+		return new CZstdInputStream(file);
+#else
+		gpxutil::warn("'%s' is zstd compressed, but zstd support is not compiled in", filename);
+		fclose(file);
+		return NULL;
+#endif
+	}
+	return new CPlainInputStream(file);
+}
+
+} // namespace gpxstream
@@ -0,0 +1,46 @@
+#ifndef GPXVIS_STREAM_H
+#define GPXVIS_STREAM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+namespace gpxstream {
+
+/****************************************************************************
+ * FILE NAME SUFFIXES OF SUPPORTED COMPRESSION FORMATS                      *
+ ****************************************************************************/
+
+/* get the file name suffix of compression format index, NULL if out of range
+ * only the formats which are compiled in are reported */
+extern const char *getCompressedSuffix(int index);
+
+/****************************************************************************
+ * SEQUENTIAL INPUT STREAM, TRANSPARENTLY DECOMPRESSES THE DATA             *
+ ****************************************************************************/
+
+class CInputStream {
+	public:
+		virtual ~CInputStream();
+
+		/* open a file for reading, the compression format is detected
+		 * by the file's contents, not its name.
+		 * Returns NULL if the file can't be opened or the format is not
+		 * supported. Use delete to close the stream. */
+		static CInputStream* Open(const char *filename);
+
+		/* read up to size bytes, returns the number of bytes read,
+		 * less than size only at the end of the stream or on errors */
+		virtual size_t Read(void *buffer, size_t size) = 0;
+
+		bool Failed() const {return failed;}
+
+	protected:
+		CInputStream(FILE *f);
+
+		FILE *file;
+		bool failed;
+};
+
+} // namespace gpxstream
+
+#endif // GPXVIS_STREAM_H
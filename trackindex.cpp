@@ -0,0 +1,186 @@
+#include "trackindex.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace gpx {
+
+/****************************************************************************
+ * METADATA INDEX OF TRACK FILES                                            *
+ ****************************************************************************/
+
+static const char trackIndexMagic[] = "gpxvis-track-index 1";
+
+CTrackIndex::CTrackIndex() :
+	modified(false)
+{
+}
+
+bool CTrackIndex::Open(const char *filename)
+{
+	Close();
+	if (!filename || !filename[0]) {
+		return false;
+	}
+	indexFilename = filename;
+	if (!Load()) {
+		gpxutil::info("track index '%s': no valid index, starting empty", filename);
+		entries.clear();
+	} else {
+		gpxutil::info("track index '%s': %llu files", filename, (unsigned long long)entries.size());
+	}
+	return true;
+}
+
+void CTrackIndex::Close()
+{
+	indexFilename.clear();
+	entries.clear();
+	modified = false;
+}
+
+bool CTrackIndex::Load()
+{
+	FILE *file = gpxutil::fopen_wrapper(indexFilename.c_str(), "rt");
+	if (!file) {
+		return false;
+	}
+
+	char line[8192];
+	bool valid = false;
+	if (fgets(line, sizeof(line), file) && !strncmp(line, trackIndexMagic, strlen(trackIndexMagic))) {
+		valid = true;
+	}
+	entries.clear();
+	while (valid && fgets(line, sizeof(line), file)) {
+		TTrackMetadata meta;
+		long long start = 0;
+		int entryValid = 0;
+		unsigned long long pointCount = 0;
+		int pos = 0;
+		double *a = meta.aabbLonLat;
+		size_t len = strlen(line);
+		if (len > 0 && line[len-1] == '\n') {
+			line[--len] = 0;
+		}
+		if (sscanf(line, "file %llu %lld %d %llu %lld %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %n",
+			   &meta.fileSize, &meta.fileTime, &entryValid, &pointCount, &start,
+			   &meta.startPoint.lon, &meta.startPoint.lat, &meta.startPoint.h,
+			   &meta.length, &meta.duration, &meta.projectionScale,
+			   &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &pos) == 17 && pos > 0 && line[pos]) {
+			meta.filename = line + pos;
+			meta.valid = (entryValid != 0);
+			meta.pointCount = (size_t)pointCount;
+			meta.startPoint.timestamp = (time_t)start;
+			entries[meta.filename] = meta;
+		} else if (line[0] && line[0] != '#') {
+			gpxutil::warn("track index: invalid line '%s'", line);
+			valid = false;
+		}
+	}
+	fclose(file);
+	return valid;
+}
+
+bool CTrackIndex::Save()
+{
+	if (!IsOpen() || !modified) {
+		return IsOpen();
+	}
+	// replace the old index only when the new one is complete
+	std::string tmpname = gpxutil::getTempFilename(indexFilename);
+	FILE *file = gpxutil::fopen_wrapper(tmpname.c_str(), "wt");
+	if (!file) {
+		gpxutil::warn("failed to write track index '%s'", tmpname.c_str());
+		return false;
+	}
+	fprintf(file, "%s\n", trackIndexMagic);
+	fprintf(file, "# size time valid points start lon lat ele length duration projection-scale aabb-lon-lat filename\n");
+	for (auto it = entries.begin(); it != entries.end(); it++) {
+		const TTrackMetadata& meta = it->second;
+		const TPoint& p = meta.startPoint;
+		const double *a = meta.aabbLonLat;
+		fprintf(file, "file %llu %lld %d %llu %lld %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %s\n",
+			meta.fileSize, meta.fileTime, meta.valid ? 1 : 0, (unsigned long long)meta.pointCount, (long long)p.timestamp,
+			p.lon, p.lat, p.h, meta.length, meta.duration, meta.projectionScale,
+			a[0], a[1], a[2], a[3], a[4], a[5], meta.filename.c_str());
+	}
+	bool success = (fclose(file) == 0);
+#ifdef WIN32
+	std::wstring tmpname_wide = gpxutil::utf8ToWide(tmpname);
+	std::wstring filename_wide = gpxutil::utf8ToWide(indexFilename);
+	if (success) {
+		_wremove(filename_wide.c_str());
+		success = (_wrename(tmpname_wide.c_str(), filename_wide.c_str()) == 0);
+	}
+	if (!success) {
+		_wremove(tmpname_wide.c_str());
+	}
+#else
+	if (success) {
+		success = (rename(tmpname.c_str(), indexFilename.c_str()) == 0);
+	}
+	if (!success) {
+		remove(tmpname.c_str());
+	}
+#endif
+	if (!success) {
+		gpxutil::warn("failed to write track index '%s'", indexFilename.c_str());
+		return false;
+	}
+	modified = false;
+	return true;
+}
+
+size_t CTrackIndex::Update(const std::vector<std::string>& filenames)
+{
+	std::vector<TTrackMetadata*> outdated;
+	for (size_t i=0; i<filenames.size(); i++) {
+		const std::string& filename = filenames[i];
+		unsigned long long size = 0;
+		long long modTime = 0;
+		if (!gpxutil::getFileInfo(filename, size, modTime)) {
+			if (entries.erase(filename)) {
+				modified = true;
+			}
+			continue;
+		}
+		TTrackMetadata& meta = entries[filename];
+		if (!meta.filename.empty() && meta.fileSize == size && meta.fileTime == modTime) {
+			continue;
+		}
+		meta.filename = filename;
+		meta.fileSize = size;
+		meta.fileTime = modTime;
+		outdated.push_back(&meta);
+	}
+
+	// each outdated entry is a file of its own
+	gpxutil::parallelFor(outdated.size(), [&](size_t i) {
+		TTrackMetadata& meta = *outdated[i];
+		CTrack track;
+		if (track.Load(meta.filename.c_str())) {
+			track.GetMetadata(meta);
+		} else {
+			meta.valid = false;
+		}
+	});
+	if (!outdated.empty()) {
+		modified = true;
+	}
+	gpxutil::info("track index: %llu files, %llu parsed", (unsigned long long)filenames.size(), (unsigned long long)outdated.size());
+	return outdated.size();
+}
+
+const TTrackMetadata* CTrackIndex::Find(const std::string& filename) const
+{
+	auto it = entries.find(filename);
+	if (it == entries.end()) {
+		return NULL;
+	}
+	return &it->second;
+}
+
+} // namespace gpx
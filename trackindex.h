@@ -0,0 +1,47 @@
+#ifndef GPXVIS_TRACKINDEX_H
+#define GPXVIS_TRACKINDEX_H
+
+#include "gpx.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace gpx {
+
+/****************************************************************************
+ * METADATA INDEX OF TRACK FILES                                            *
+ ****************************************************************************/
+
+// The TTrackMetadata of each file, kept in a text file so that the track
+// list of a large archive can be built, sorted and filtered without parsing
+// all of the files again. An entry is valid as long as the size and the
+// modification time of its file did not change.
+
+class CTrackIndex {
+	public:
+		CTrackIndex();
+
+		bool Open(const char *filename); // loads the index if there is one, otherwise it is empty
+		void Close();
+		bool IsOpen() const {return !indexFilename.empty();}
+		const char *GetFilename() const {return indexFilename.c_str();}
+		size_t GetCount() const {return entries.size();}
+
+		// parse the new and changed files in parallel, drops the entries of files
+		// which do not exist any more, returns the number of files parsed
+		size_t Update(const std::vector<std::string>& filenames);
+		bool Save(); // if anything changed since Open()
+		const TTrackMetadata* Find(const std::string& filename) const; // NULL if not in the index
+
+	private:
+		std::string indexFilename;
+		std::map<std::string, TTrackMetadata> entries;
+		bool modified;
+
+		bool Load();
+};
+
+} // namespace gpx
+
+#endif // GPXVIS_TRACKINDEX_H
@@ -1,12 +1,27 @@
 #include "util.h"
 
+#include <ctype.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #ifdef WIN32
 #include <Windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 #endif
 
 namespace gpxutil {
@@ -15,14 +30,23 @@ namespace gpxutil {
  * SIMPLE MESSAGES                                                          *
  ****************************************************************************/
 
+/* Print a message as a single line, so that messages from different
+ * threads do not get mixed up. */
+static void printLine(FILE *stream, const char *format, va_list args)
+{
+	char buf[4096];
+	vsnprintf(buf, sizeof(buf)-1, format, args);
+	buf[sizeof(buf)-2] = 0;
+	fprintf(stream, "%s\n", buf);
+}
+
 /* Print a info message to stdout, use printf syntax. */
 extern void info (const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stdout,format, args);
+	printLine(stdout, format, args);
 	va_end(args);
-	fputc('\n', stdout);
 }
 
 /* Print a warning message to stderr, use printf syntax. */
@@ -30,9 +54,8 @@ extern void warn (const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr,format, args);
+	printLine(stderr, format, args);
 	va_end(args);
-	fputc('\n', stderr);
 }
 
 /****************************************************************************
@@ -244,39 +267,62 @@ extern GLuint shaderCreateAndCompile(GLenum type, const GLchar *source)
 	return shader;
 }
 
-/* Create a new shader object by loading a file, and compile it.
- * Returns the name of the newly created shader object, or 0 in case of an
- * error.
- */
-extern GLuint shaderCreateFromFileAndCompile(GLenum type, const char *filename)
+/* Read a whole shader source file */
+static bool readShaderFile(const char *filename, std::string& source)
 {
-
 	gpxutil::info("loading shader file '%s'",filename);
 	FILE *file = fopen(filename, "rt");
 	if(!file) {
 		gpxutil::warn("Failed to open shader file '%s'", filename);
-		return 0;
+		return false;
 	}
 	fseek(file, 0, SEEK_END);
 	long size = ftell(file);
-	GLchar *source = (GLchar*)malloc(size+1);
-	if (!source) {
-		gpxutil::warn("Failed to allocate memory for shader file '%s'", filename);
-		fclose(file);
-		return 0;
-	}
+	source.resize((size > 0) ? (size_t)size : 0);
 	fseek(file, 0, SEEK_SET);
-	source[fread(source, 1, size, file)] = 0;
+	source.resize(fread(&source[0], 1, source.size(), file));
 	fclose(file);
+	return true;
+}
 
-	GLuint shader=shaderCreateAndCompile(type, source);
-	free(source);
+/* Create a new shader object by loading a file, and compile it.
+ * Returns the name of the newly created shader object, or 0 in case of an
+ * error.
+ */
+extern GLuint shaderCreateFromFileAndCompile(GLenum type, const char *filename)
+{
+	std::string source;
+	if (!readShaderFile(filename, source)) {
+		return 0;
+	}
+	GLuint shader=shaderCreateAndCompile(type, source.c_str());
 	if (!shader) {
 		gpxutil::warn("Failed to compile shader '%s'", filename);
 	}
 	return shader;
 }
 
+/* link a program and check the result, deletes the program on failure */
+static GLuint programLink(GLuint program)
+{
+	GLint status;
+
+	/* we want to put it into the program cache */
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+	gpxutil::info("linking program %u",program);
+	glLinkProgram(program);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		gpxutil::warn("Failed to link program!");
+		printInfoLog(program,true);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
 /* Create a program by linking a vertex and fragment shader object. The shader
  * objects should already be compiled.
  * Returns the name of the newly created program object, or 0 in case of an
@@ -285,7 +331,6 @@ extern GLuint shaderCreateFromFileAndCompile(GLenum type, const char *filename)
 extern GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader)
 {
 	GLuint program=0;
-	GLint status;
 
 	program=glCreateProgram();
 	gpxutil::info("created program %u",program);
@@ -305,19 +350,305 @@ extern GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader)
 	glBindFragDataLocation(program, 0, "color");
 
 	/* finally link the program */
-	gpxutil::info("linking program %u",program);
-	glLinkProgram(program);
+	return programLink(program);
+}
+
+/****************************************************************************
+ * SHADER PROGRAM BINARY CACHE                                              *
+ ****************************************************************************/
+
+/* bump this whenever the way the programs are built changes in a way
+ * that is not visible in the shader sources */
+static const char programCacheMagic[8] = {'G','P','X','V','P','R','G','1'};
+
+static std::string programCacheDir;
+
+extern void programCacheSetDirectory(const char *dir)
+{
+	programCacheDir = (dir) ? dir : "";
+	if (!programCacheDir.empty()) {
+		gpxutil::info("shader program cache: '%s'", programCacheDir.c_str());
+	}
+}
+
+extern std::string getDefaultCacheDirectory()
+{
+	std::string dir;
+#ifdef WIN32
+	const wchar_t *base = _wgetenv(L"LOCALAPPDATA");
+	if (base && base[0]) {
+		dir = wideToUtf8(std::wstring(base)) + "\\gpxvis\\shadercache";
+	}
+#else
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && base[0]) {
+		dir = std::string(base) + "/gpxvis/shaders";
+	} else {
+		base = getenv("HOME");
+		if (base && base[0]) {
+			dir = std::string(base) + "/.cache/gpxvis/shaders";
+		}
+	}
+#endif
+	return dir;
+}
+
+/* create a directory and all of its parents, ignoring errors */
+extern void makeDirectories(const std::string& path)
+{
+	for (size_t i=1; i<=path.length(); i++) {
+		if (i == path.length() || path[i] == '/' || path[i] == '\\') {
+			std::string part = path.substr(0, i);
+#ifdef WIN32
+			_wmkdir(utf8ToWide(part).c_str());
+#else
+			mkdir(part.c_str(), 0755);
+#endif
+		}
+	}
+}
+
+/* replace linkName by a hard link to the existing file target */
+extern bool linkFile(const std::string& target, const std::string& linkName)
+{
+#ifdef WIN32
+	std::wstring linkWide = utf8ToWide(linkName);
+	_wremove(linkWide.c_str());
+	return CreateHardLinkW(linkWide.c_str(), utf8ToWide(target).c_str(), NULL) != 0;
+#else
+	unlink(linkName.c_str());
+	return link(target.c_str(), linkName.c_str()) == 0;
+#endif
+}
+
+/* size and modification time of a file, false if it does not exist */
+extern bool getFileInfo(const std::string& filename, unsigned long long& size, long long& modTime)
+{
+#ifdef WIN32
+	struct _stat64 s;
+	if (_wstat64(utf8ToWide(filename).c_str(), &s)) {
+		return false;
+	}
+#else
+	struct stat s;
+	if (stat(filename.c_str(), &s)) {
+		return false;
+	}
+#endif
+	size = (unsigned long long)s.st_size;
+	modTime = (long long)s.st_mtime;
+	return true;
+}
+
+/* a name next to filename for writing it completely before renaming, unique
+ * across the threads and the processes */
+extern std::string getTempFilename(const std::string& filename)
+{
+	static std::atomic<unsigned> counter(0);
+	char buf[64];
+#ifdef WIN32
+	unsigned long pid = (unsigned long)_getpid();
+#else
+	unsigned long pid = (unsigned long)getpid();
+#endif
+	mysnprintf(buf, sizeof(buf), ".%lu.%u.tmp", pid, counter++);
+	return filename + buf;
+}
+
+/* the absolute path of a file which does not need to exist, without "." and
+ * ".." components, empty on error */
+extern std::string getAbsolutePath(const std::string& filename)
+{
+#ifdef WIN32
+	wchar_t *full = _wfullpath(NULL, utf8ToWide(filename).c_str(), 0);
+	if (!full) {
+		return std::string();
+	}
+	std::string result = wideToUtf8(std::wstring(full));
+	free(full);
+	return result;
+#else
+	std::string path = filename;
+	if (path.empty() || path[0] != '/') {
+		char cwd[4096];
+		if (!getcwd(cwd, sizeof(cwd))) {
+			return std::string();
+		}
+		path = std::string(cwd) + "/" + path;
+	}
+	// resolved lexically, like _wfullpath
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (start <= path.length()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos) {
+			end = path.length();
+		}
+		std::string part = path.substr(start, end - start);
+		if (part == "..") {
+			if (!parts.empty()) {
+				parts.pop_back();
+			}
+		} else if (!part.empty() && part != ".") {
+			parts.push_back(part);
+		}
+		start = end + 1;
+	}
+	std::string result;
+	for (size_t i=0; i<parts.size(); i++) {
+		result += "/" + parts[i];
+	}
+	return result.empty() ? std::string("/") : result;
+#endif
+}
+
+/* 64 bit FNV-1a */
+static void hashBytes(unsigned long long& hash, const void *data, size_t size)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= ptr[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+static void hashString(unsigned long long& hash, const char *str)
+{
+	if (!str) {
+		str = "";
+	}
+	hashBytes(hash, str, strlen(str) + 1);
+}
+
+/* file name for a program consisting of the given shader stages,
+ * empty if the cache can't be used */
+static std::string programCacheFilename(const GLenum *types, const std::string *sources, int count)
+{
+	GLint formats = 0;
+	if (programCacheDir.empty()) {
+		return std::string();
+	}
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats < 1) {
+		return std::string();
+	}
+
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	hashBytes(hash, programCacheMagic, sizeof(programCacheMagic));
+	hashString(hash, (const char*)glGetString(GL_VENDOR));
+	hashString(hash, (const char*)glGetString(GL_RENDERER));
+	hashString(hash, (const char*)glGetString(GL_VERSION));
+	for (int i=0; i<count; i++) {
+		hashBytes(hash, &types[i], sizeof(types[i]));
+		hashString(hash, sources[i].c_str());
+	}
+
+	char name[32];
+	mysnprintf(name, sizeof(name), "%016llx.bin", hash);
+	return programCacheDir + "/" + name;
+}
+
+/* try to create a program from a cached binary */
+static GLuint programCacheLoad(const std::string& filename)
+{
+	if (filename.empty()) {
+		return 0;
+	}
+	FILE *file = fopen_wrapper(filename.c_str(), "rb");
+	if (!file) {
+		return 0;
+	}
+
+	char magic[sizeof(programCacheMagic)];
+	unsigned int header[2]; // format, size
+	std::vector<unsigned char> binary;
+	bool valid = (fread(magic, sizeof(magic), 1, file) == 1) &&
+		     (fread(header, sizeof(header), 1, file) == 1) &&
+		     !memcmp(magic, programCacheMagic, sizeof(magic)) &&
+		     (header[1] > 0) && (header[1] < 64U*1024U*1024U);
+	if (valid) {
+		binary.resize(header[1]);
+		valid = (fread(binary.data(), binary.size(), 1, file) == 1);
+	}
+	fclose(file);
+	if (!valid) {
+		gpxutil::warn("ignoring invalid program cache file '%s'", filename.c_str());
+		return 0;
+	}
 
+	GLuint program = glCreateProgram();
+	GLint status = GL_FALSE;
+	glProgramBinary(program, (GLenum)header[0], binary.data(), (GLsizei)binary.size());
 	glGetProgramiv(program, GL_LINK_STATUS, &status);
 	if (status != GL_TRUE) {
-		gpxutil::warn("Failed to link program!");
-		printInfoLog(program,true);
+		/* the driver may reject binaries at any time, e.g. after an update */
+		gpxutil::info("program cache file '%s' rejected by the GL", filename.c_str());
 		glDeleteProgram(program);
 		return 0;
 	}
+	gpxutil::info("created program %u from cache file '%s'", program, filename.c_str());
 	return program;
 }
 
+/* store the binary of a linked program in the cache */
+static void programCacheStore(GLuint program, const std::string& filename)
+{
+	if (!program || filename.empty()) {
+		return;
+	}
+
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length < 1) {
+		return;
+	}
+	std::vector<unsigned char> binary((size_t)length);
+	glGetProgramBinary(program, length, &written, &format, binary.data());
+	if (written < 1) {
+		return;
+	}
+
+	/* write to a temporary file first, so that concurrent instances never
+	 * see partial files */
+	makeDirectories(programCacheDir);
+	std::string tmpname = getTempFilename(filename);
+	FILE *file = fopen_wrapper(tmpname.c_str(), "wb");
+	if (!file) {
+		gpxutil::warn("failed to create program cache file '%s'", tmpname.c_str());
+		return;
+	}
+	unsigned int header[2] = {(unsigned int)format, (unsigned int)written};
+	bool success = (fwrite(programCacheMagic, sizeof(programCacheMagic), 1, file) == 1) &&
+		       (fwrite(header, sizeof(header), 1, file) == 1) &&
+		       (fwrite(binary.data(), (size_t)written, 1, file) == 1);
+	success = (fclose(file) == 0) && success;
+#ifdef WIN32
+	std::wstring tmpname_wide = utf8ToWide(tmpname);
+	std::wstring filename_wide = utf8ToWide(filename);
+	if (success) {
+		_wremove(filename_wide.c_str());
+		success = (_wrename(tmpname_wide.c_str(), filename_wide.c_str()) == 0);
+	}
+	if (!success) {
+		_wremove(tmpname_wide.c_str());
+	}
+#else
+	if (success) {
+		success = (rename(tmpname.c_str(), filename.c_str()) == 0);
+	}
+	if (!success) {
+		remove(tmpname.c_str());
+	}
+#endif
+	if (success) {
+		gpxutil::info("stored program %u in cache file '%s'", program, filename.c_str());
+	} else {
+		gpxutil::warn("failed to write program cache file '%s'", filename.c_str());
+	}
+}
+
 /* Create a program object directly from vertex and fragment shader source
  * files.
  * Returns the name of the newly created program object, or 0 in case of an
@@ -325,9 +656,25 @@ extern GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader)
  */
 extern GLuint programCreateFromFiles(const char *vs, const char *fs)
 {
-	GLuint id_vs=shaderCreateFromFileAndCompile(GL_VERTEX_SHADER, vs);
-	GLuint id_fs=shaderCreateFromFileAndCompile(GL_FRAGMENT_SHADER, fs);
-	GLuint program = 0;
+	const GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+	std::string sources[2];
+	if (!readShaderFile(vs, sources[0]) || !readShaderFile(fs, sources[1])) {
+		return 0;
+	}
+	std::string cacheFile = programCacheFilename(types, sources, 2);
+	GLuint program = programCacheLoad(cacheFile);
+	if (program) {
+		return program;
+	}
+
+	GLuint id_vs=shaderCreateAndCompile(GL_VERTEX_SHADER, sources[0].c_str());
+	GLuint id_fs=shaderCreateAndCompile(GL_FRAGMENT_SHADER, sources[1].c_str());
+	if (!id_vs) {
+		gpxutil::warn("Failed to compile shader '%s'", vs);
+	}
+	if (!id_fs) {
+		gpxutil::warn("Failed to compile shader '%s'", fs);
+	}
 	if (id_vs && id_fs) {
 		program=programCreate(id_vs,id_fs);
 	}
@@ -339,6 +686,40 @@ extern GLuint programCreateFromFiles(const char *vs, const char *fs)
 	glDeleteShader(id_vs);
 	gpxutil::info("destroying shader object %u",id_fs);
 	glDeleteShader(id_fs);
+	programCacheStore(program, cacheFile);
+	return program;
+}
+
+/* Create a compute program object directly from a compute shader source
+ * file.
+ * Returns the name of the newly created program object, or 0 in case of an
+ * error.
+ */
+extern GLuint programCreateComputeFromFile(const char *cs)
+{
+	const GLenum types[1] = {GL_COMPUTE_SHADER};
+	std::string sources[1];
+	if (!readShaderFile(cs, sources[0])) {
+		return 0;
+	}
+	std::string cacheFile = programCacheFilename(types, sources, 1);
+	GLuint program = programCacheLoad(cacheFile);
+	if (program) {
+		return program;
+	}
+
+	GLuint id_cs=shaderCreateAndCompile(GL_COMPUTE_SHADER, sources[0].c_str());
+	if (id_cs) {
+		program=glCreateProgram();
+		gpxutil::info("created program %u",program);
+		glAttachShader(program, id_cs);
+		program=programLink(program);
+		gpxutil::info("destroying shader object %u",id_cs);
+		glDeleteShader(id_cs);
+	} else {
+		gpxutil::warn("Failed to compile shader '%s'", cs);
+	}
+	programCacheStore(program, cacheFile);
 	return program;
 }
 
@@ -488,6 +869,139 @@ bool durationToString(double seconds, char *buffer, size_t bufSize)
 	return true;
 }
 
+/* thread-safe variant of localtime() */
+extern void localTime(time_t t, struct tm& result)
+{
+#ifdef WIN32
+	localtime_s(&result, &t);
+#else
+	localtime_r(&t, &result);
+#endif
+}
+
+/* monotonic wall clock time in seconds, for measuring durations */
+extern double getTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/****************************************************************************
+ * PARALLEL EXECUTION                                                       *
+ ****************************************************************************/
+
+/* get the number of worker threads to use for parallel work */
+extern unsigned getWorkerThreadCount()
+{
+	unsigned cnt = std::thread::hardware_concurrency();
+	if (cnt < 1) {
+		cnt = 1;
+	}
+	return cnt;
+}
+
+/* call func(i) for all i in [0,count) from up to maxThreads worker threads,
+ * 0 means getWorkerThreadCount(). Returns when all calls are finished. */
+extern void parallelFor(size_t count, const std::function<void(size_t)>& func, unsigned maxThreads)
+{
+	if (maxThreads < 1) {
+		maxThreads = getWorkerThreadCount();
+	}
+	if ((size_t)maxThreads > count) {
+		maxThreads = (unsigned)count;
+	}
+	if (maxThreads <= 1) {
+		for (size_t i=0; i<count; i++) {
+			func(i);
+		}
+		return;
+	}
+
+	// the workers fetch the next index until everything is processed
+	std::atomic<size_t> next(0);
+	auto worker = [&next, count, &func]() {
+		size_t i;
+		while ( (i = next++) < count) {
+			func(i);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned t=1; t<maxThreads; t++) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (size_t t=0; t<threads.size(); t++) {
+		threads[t].join();
+	}
+}
+
+/****************************************************************************
+ * INI FILES                                                                *
+ ****************************************************************************/
+
+static std::string trimmed(const char *begin, const char *end)
+{
+	while (begin < end && isspace((unsigned char)*begin)) {
+		begin++;
+	}
+	while (end > begin && isspace((unsigned char)end[-1])) {
+		end--;
+	}
+	return std::string(begin, end);
+}
+
+extern bool readIniFile(const char *filename, std::vector<TIniSection>& sections)
+{
+	FILE *file = fopen_wrapper(filename, "rt");
+	if (!file) {
+		warn("failed to open '%s'", filename);
+		return false;
+	}
+
+	char buf[4096];
+	int line = 0;
+	bool success = true;
+	sections.clear();
+	sections.push_back(TIniSection());
+	while (fgets(buf, sizeof(buf), file)) {
+		line++;
+		std::string text = trimmed(buf, buf + strlen(buf));
+		if (text.empty() || text[0] == '#' || text[0] == ';') {
+			continue;
+		}
+		if (text[0] == '[') {
+			if (text[text.size() - 1] != ']') {
+				warn("%s:%d: invalid section header", filename, line);
+				success = false;
+				break;
+			}
+			sections.push_back(TIniSection());
+			sections.back().name = trimmed(text.c_str() + 1, text.c_str() + text.size() - 1);
+			continue;
+		}
+		TIniEntry entry;
+		size_t equals = text.find('=');
+		entry.line = line;
+		if (equals == std::string::npos) {
+			entry.key = text;
+		} else {
+			entry.key = trimmed(text.c_str(), text.c_str() + equals);
+			entry.value = trimmed(text.c_str() + equals + 1, text.c_str() + text.size());
+			if (entry.value.size() >= 2 && entry.value[0] == '"' && entry.value[entry.value.size() - 1] == '"') {
+				entry.value = entry.value.substr(1, entry.value.size() - 2);
+			}
+		}
+		if (entry.key.empty()) {
+			warn("%s:%d: missing key", filename, line);
+			success = false;
+			break;
+		}
+		sections.back().entries.push_back(entry);
+	}
+	fclose(file);
+	return success;
+}
+
 #ifdef WIN32
 /****************************************************************************
  * WINDOWS WIDE STRING <-> UTF8                                             *
@@ -4,10 +4,14 @@
 #include <glad/gl.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
+
+#include <functional>
+#include <string>
+#include <vector>
 
 /* define mysnprintf to be either snprintf (POSIX) or sprintf_s (MS Windows) */
 #ifdef WIN32
-#include <string>
 #define mysnprintf sprintf_s
 #else
 #define mysnprintf snprintf
@@ -115,6 +119,26 @@ extern GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader);
  */
 extern GLuint programCreateFromFiles(const char *vs, const char *fs);
 
+/* Create a compute program object directly from a compute shader source
+ * file.
+ * Returns the name of the newly created program object, or 0 in case of an
+ * error.
+ */
+extern GLuint programCreateComputeFromFile(const char *cs);
+
+/****************************************************************************
+ * SHADER PROGRAM BINARY CACHE                                              *
+ ****************************************************************************/
+
+/* programCreateFromFiles() and programCreateComputeFromFile() keep the
+ * linked program binaries in this directory, keyed by the shader sources
+ * and the GL vendor, renderer and version. Binaries which the driver rejects
+ * are silently rebuilt from source. NULL or "" disables the cache. */
+extern void programCacheSetDirectory(const char *dir);
+
+/* Per-user cache directory for this application, may be empty */
+extern std::string getDefaultCacheDirectory();
+
 /****************************************************************************
  * AABBs                                                                    *
  ****************************************************************************/
@@ -166,6 +190,60 @@ extern GLsizei roundNextMultiple(GLsizei value, GLsizei base);
 /* get duration in human-readable string format */
 extern bool durationToString(double seconds, char *buffer, size_t bufSize);
 
+/* thread-safe variant of localtime() */
+extern void localTime(time_t t, struct tm& result);
+
+/* monotonic wall clock time in seconds, for measuring durations */
+extern double getTime();
+
+/* create a directory and all of its parents, ignoring errors */
+extern void makeDirectories(const std::string& path);
+
+/* replace linkName by a hard link to the existing file target */
+extern bool linkFile(const std::string& target, const std::string& linkName);
+
+/* size and modification time of a file, false if it does not exist */
+extern bool getFileInfo(const std::string& filename, unsigned long long& size, long long& modTime);
+
+/* a name next to filename for writing it completely before renaming, unique
+ * across the threads and the processes */
+extern std::string getTempFilename(const std::string& filename);
+
+/* the absolute path of a file which does not need to exist, without "." and
+ * ".." components, empty on error */
+extern std::string getAbsolutePath(const std::string& filename);
+
+/****************************************************************************
+ * PARALLEL EXECUTION                                                       *
+ ****************************************************************************/
+
+/* get the number of worker threads to use for parallel work */
+extern unsigned getWorkerThreadCount();
+
+/* call func(i) for all i in [0,count) from up to maxThreads worker threads,
+ * 0 means getWorkerThreadCount(). Returns when all calls are finished. */
+extern void parallelFor(size_t count, const std::function<void(size_t)>& func, unsigned maxThreads=0);
+
+/****************************************************************************
+ * INI FILES                                                                *
+ ****************************************************************************/
+
+struct TIniEntry {
+	std::string key;
+	std::string value; // empty for a line with a key only
+	int line;
+};
+
+struct TIniSection {
+	std::string name; // empty for the entries before the first [section]
+	std::vector<TIniEntry> entries;
+};
+
+/* read "key = value" lines grouped by "[section]" headers, '#' and ';' start
+ * comment lines, values may be enclosed in double quotes. The first section
+ * is always the unnamed one. */
+extern bool readIniFile(const char *filename, std::vector<TIniSection>& sections);
+
 /****************************************************************************
  * WINDOWS WIDE STRING <-> UTF8                                             *
  ****************************************************************************/
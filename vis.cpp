@@ -1,7 +1,10 @@
 #include "vis.h"
 
 #include <algorithm>
+#include <chrono>
+#include <ctype.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -19,6 +22,12 @@ struct transformParam {
 	GLfloat scale_offset[4];
 	GLfloat size[4];
 	GLfloat zoomShift[4];
+	GLfloat texScale[4];
+};
+
+struct polygonParam {
+	GLfloat decode[4];
+	GLint   info[4];
 };
 
 struct lineParam {
@@ -31,6 +40,85 @@ struct lineParam {
 
 } // namespace ubo
 
+/****************************************************************************
+ * LINES OF MANY TRACKS FOR THE COMPUTE HISTORY                             *
+ ****************************************************************************/
+
+CHistoryBatch::CHistoryBatch()
+{
+	Reset();
+}
+
+void CHistoryBatch::Reset()
+{
+	vertices.clear();
+	chunks.clear();
+	groups.clear();
+	trackGroups.assign(1, 0);
+	lineCount = 0;
+}
+
+void CHistoryBatch::AddTrack(const gpx::CTrack& track, const double *origin, const double *scale)
+{
+	size_t base = GetVertexCount();
+	size_t firstChunk = chunks.size();
+	// unlike SetPolygon(), these are floats relative to the AABB of all
+	// tracks, so the compute history still jitters at very large zoom
+	// factors (the CPU rasterizer works in double precision)
+	track.GetVertices(false, origin, scale, vertices);
+
+	// split each segment into chunks of consecutive lines, the bounding
+	// boxes of the chunks are used for culling in the compute shader
+	for (size_t i=0; i<track.GetSegmentCount(); i++) {
+		size_t first = track.GetSegments()[i];
+		size_t end = track.GetSegmentEnd(i);
+		for (size_t j=first; j+1<end; j+=chunkLines) {
+			THistoryChunk c;
+			size_t cnt = end - 1 - j;
+			if (cnt > chunkLines) {
+				cnt = chunkLines;
+			}
+			c.first = (GLuint)(base + j);
+			c.count = (GLuint)cnt;
+			c.track = (GLuint)GetTrackCount();
+			c.reserved = 0;
+			const GLfloat *v = &vertices[2*(base + j)];
+			c.bbox[0] = c.bbox[2] = v[0];
+			c.bbox[1] = c.bbox[3] = v[1];
+			for (size_t k=1; k<=cnt; k++) {
+				const GLfloat *w = v + 2*k;
+				if (w[0] < c.bbox[0]) c.bbox[0] = w[0];
+				if (w[1] < c.bbox[1]) c.bbox[1] = w[1];
+				if (w[0] > c.bbox[2]) c.bbox[2] = w[0];
+				if (w[1] > c.bbox[3]) c.bbox[3] = w[1];
+			}
+			chunks.push_back(c);
+			lineCount += cnt;
+		}
+	}
+
+	// groups of chunks for a coarser culling level
+	for (size_t i=firstChunk; i<chunks.size(); i+=groupChunks) {
+		THistoryChunk g;
+		size_t cnt = chunks.size() - i;
+		if (cnt > groupChunks) {
+			cnt = groupChunks;
+		}
+		g = chunks[i];
+		g.first = (GLuint)i;
+		g.count = (GLuint)cnt;
+		for (size_t k=1; k<cnt; k++) {
+			const GLfloat *b = chunks[i+k].bbox;
+			if (b[0] < g.bbox[0]) g.bbox[0] = b[0];
+			if (b[1] < g.bbox[1]) g.bbox[1] = b[1];
+			if (b[2] > g.bbox[2]) g.bbox[2] = b[2];
+			if (b[3] > g.bbox[3]) g.bbox[3] = b[3];
+		}
+		groups.push_back(g);
+	}
+	trackGroups.push_back((GLuint)groups.size());
+}
+
 
 /****************************************************************************
  * VISUALIZE A SINGLE POLYGON, MIX IT WITH THE HISTORY                      *
@@ -128,19 +216,77 @@ void CVis::TConfig::ClampTransform()
 	}
 }
 
+unsigned CVis::TConfig::GetChangedStages(const TConfig& other) const
+{
+	unsigned stages = 0;
+	bool additive = (historyAdditive > BACKGROUND_ADD_NONE);
+	bool otherAdditive = (other.historyAdditive > BACKGROUND_ADD_NONE);
+
+	if (historyWideLine != other.historyWideLine ||
+	    historyWidth != other.historyWidth ||
+	    historyExp != other.historyExp ||
+	    additive != otherAdditive) {
+		stages |= STAGE_BACKGROUND;
+	}
+	if (neighborhoodWidth != other.neighborhoodWidth ||
+	    neighborhoodExp != other.neighborhoodExp) {
+		stages |= STAGE_NEIGHBORHOOD;
+	}
+	if (trackWidth != other.trackWidth ||
+	    trackExp != other.trackExp ||
+	    trackPointWidth != other.trackPointWidth ||
+	    trackPointExp != other.trackPointExp ||
+	    memcmp(colorGradient, other.colorGradient, sizeof(colorGradient))) {
+		stages |= STAGE_TRACK;
+	}
+	if (historyAdditive != other.historyAdditive ||
+	    historyAddExp != other.historyAddExp ||
+	    historyAddSaturationOffset != other.historyAddSaturationOffset ||
+	    memcmp(colorBackground, other.colorBackground, sizeof(colorBackground)) ||
+	    memcmp(colorBase, other.colorBase, sizeof(colorBase)) ||
+	    memcmp(colorHistoryAdd, other.colorHistoryAdd, sizeof(colorHistoryAdd))) {
+		stages |= STAGE_FINAL;
+	}
+	// the track samples the neighborhood, and everything ends up in the final image
+	if (stages & STAGE_NEIGHBORHOOD) {
+		stages |= STAGE_TRACK;
+	}
+	if (stages) {
+		stages |= STAGE_FINAL;
+	}
+	return stages;
+}
+
 CVis::CVis() :
 	bufferVertexCount(0),
 	vertexCount(0),
+	polygonEncoding(gpx::VERTEX_ENCODING_FLOAT),
 	width(0),
 	height(0),
+	capacityWidth(0),
+	capacityHeight(0),
+	viewWidth(0),
+	viewHeight(0),
 	dataAspect(1.0f),
+	rebuildStages(0),
+	buildSwapped(0),
+	snapshotStages(0),
+	withRebuildTargets(false),
 	vaoEmpty(0),
-	texTrackDepth(0)
+	vaoLine(0),
+	texTrackDepth(0),
+	texHistoryAccu(0),
+	texTile(0),
+	texTileSize(0)
 {
 	scaleOffset[0] = 2.0f;
 	scaleOffset[1] = 2.0f;
 	scaleOffset[2] =-1.0f;
 	scaleOffset[3] =-1.0f;
+	cfg.GetZoomShift(previousZoomShift);
+	viewOffset[0] = viewOffset[1] = 0;
+	polygonOrigin[0] = polygonOrigin[1] = 0.0;
+	polygonExtent[0] = polygonExtent[1] = 1.0;
 
 	for (int i=0; i<SSBO_COUNT; i++) {
 		ssbo[i] = 0;
@@ -154,6 +300,7 @@ CVis::CVis() :
 	}
 	for (int i=0; i<PROG_COUNT; i++) {
 		program[i] = 0;
+		programMissing[i] = false;
 	}
 }
 
@@ -169,9 +316,13 @@ GLenum CVis::GetFramebufferTextureFormat(TFramebuffer fb) const
 	switch(fb) {
 		case FB_BACKGROUND:
 		case FB_BACKGROUND_SCRATCH:
+		case FB_BACKGROUND_BUILD:
+		case FB_BACKGROUND_SNAPSHOT:
 			format = GL_R32F;
 			break;
 		case FB_NEIGHBORHOOD:
+		case FB_NEIGHBORHOOD_BUILD:
+		case FB_NEIGHBORHOOD_SNAPSHOT:
 			format = GL_R8;
 			break;
 		default:
@@ -184,8 +335,9 @@ bool CVis::InitializeGL(GLsizei w, GLsizei h, float dataAspectRatio)
 {
 	dataAspect = dataAspectRatio;
 
-	if (w != width || h != height) {
-		DropGL();
+	if (w < 1 || h < 1) {
+		gpxutil::warn("invalid framebuffer size %dx%d", (int)w, (int)h);
+		return false;
 	}
 
 	if (!vaoEmpty) {
@@ -194,32 +346,125 @@ bool CVis::InitializeGL(GLsizei w, GLsizei h, float dataAspectRatio)
 		glBindVertexArray(0);
 		gpxutil::info("created VAO %u (empty)", vaoEmpty);
 	}
+	if (!vaoLine) {
+		glGenVertexArrays(1, &vaoLine);
+		glBindVertexArray(vaoLine);
+		// both attributes read from the same buffer, the second one
+		// is one vertex further, one step per instance
+		for (GLuint i=0; i<2; i++) {
+			glEnableVertexAttribArray(i);
+			glVertexAttribBinding(i, 0);
+		}
+		glVertexBindingDivisor(0, 1);
+		glBindVertexArray(0);
+		gpxutil::info("created VAO %u (line)", vaoLine);
+		UpdateLineVAO();
+	}
+
+	if (!InitializeFramebuffers(w, h)) {
+		return false;
+	}
+
+	width = w;
+	height = h;
+	
+	for (int i=0; i<UBO_COUNT; i++) {
+		if (!InitializeUBO(i)) {
+			return false;
+		}
+	}
+	appliedCfg = cfg;
+	GetZoomShift(previousZoomShift);
+
+	static const char* programs[PROG_COUNT][2] = {
+		{ "shaders/simple.vs", "shaders/simple.fs" },
+		{ "shaders/track.vs", "shaders/track.fs"},
+		{ "shaders/line.vs", "shaders/line.fs"},
+		{ "shaders/point.vs", "shaders/point.fs"},
+		{ "shaders/fullscreen.vs", "shaders/tex.fs"},
+		{ "shaders/fullscreen.vs", "shaders/blend.fs"},
+		{ "shaders/history.cs", NULL},
+		{ "shaders/fullscreen.vs", "shaders/historyresolve.fs"},
+		{ "shaders/fullscreen.vs", "shaders/reproject.fs"},
+		{ "shaders/tile.vs", "shaders/tile.fs"},
+	};
+
+	for (int i=0; i<PROG_COUNT; i++) {
+		if (!program[i] && !programMissing[i]) {
+			if (programs[i][1]) {
+				program[i] = gpxutil::programCreateFromFiles(programs[i][0], programs[i][1]);
+			} else {
+				program[i] = gpxutil::programCreateComputeFromFile(programs[i][0]);
+			}
+			if (!program[i]) {
+				gpxutil::warn("program idx %d (%s, %s) failed", i, programs[i][0], programs[i][1]?programs[i][1]:"-");
+				// the compute history falls back to the raster backend,
+				// rebuilds without reprojection start from scratch and
+				// the history is rendered instead of the pyramid tiles
+				if (i == PROG_HISTORY_SPLAT || i == PROG_HISTORY_RESOLVE || i == PROG_REPROJECT || i == PROG_TILE) {
+					programMissing[i] = true;
+					continue;
+				}
+				return false;
+			}
+			gpxutil::info("created program %u (idx %d)", program[i], i);
+		}
+	}
+	Clear();
+	return true;
+}
+
+bool CVis::InitializeFramebuffers(GLsizei w, GLsizei h)
+{
+	// The textures are allocated with some headroom and we render into the
+	// lower left part of them, so that resizing the window by a few pixels
+	// does not reallocate everything. Much smaller sizes release the memory.
+	const GLsizei granularity = 256;
+	if (w > capacityWidth || h > capacityHeight ||
+	    (GLsizeiptr)4 * w * h < (GLsizeiptr)capacityWidth * capacityHeight) {
+		DropFramebuffers();
+	}
+	GLsizei capW = capacityWidth;
+	GLsizei capH = capacityHeight;
+	if (!tex[0]) {
+		capW = gpxutil::roundNextMultiple(w, granularity);
+		capH = gpxutil::roundNextMultiple(h, granularity);
+		GLint maxSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if (maxSize > 0) {
+			capW = std::max(std::min(capW, (GLsizei)maxSize), w);
+			capH = std::max(std::min(capH, (GLsizei)maxSize), h);
+		}
+	}
 
 	for (int i=0; i<FB_COUNT; i++) {
+		if (i >= FB_BACKGROUND_BUILD && !withRebuildTargets) {
+			break;
+		}
 		if (!tex[i]) {
 			GLenum format = GetFramebufferTextureFormat((TFramebuffer)i);
 			glGenTextures(1, &tex[i]);
 			glBindTexture(GL_TEXTURE_2D, tex[i]);
-			glTexStorage2D(GL_TEXTURE_2D, 1, format, w, h);
+			glTexStorage2D(GL_TEXTURE_2D, 1, format, capW, capH);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 			glBindTexture(GL_TEXTURE_2D, 0);
-			gpxutil::info("created texture %u %ux%u fmt 0x%x (frambeuffer idx %d color attachment)", tex[i], (unsigned)w, (unsigned)h, (unsigned)format, i);
+			gpxutil::info("created texture %u %ux%u fmt 0x%x (frambeuffer idx %d color attachment)", tex[i], (unsigned)capW, (unsigned)capH, (unsigned)format, i);
 		}
 		if (i == FB_TRACK) {
 			if (!texTrackDepth) {
 				GLenum format = GL_DEPTH_COMPONENT32F;
 				glGenTextures(1, &texTrackDepth);
 				glBindTexture(GL_TEXTURE_2D, texTrackDepth);
-				glTexStorage2D(GL_TEXTURE_2D, 1, format, w, h);
+				glTexStorage2D(GL_TEXTURE_2D, 1, format, capW, capH);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 				glBindTexture(GL_TEXTURE_2D, 0);
-				gpxutil::info("created texture %u %ux%u fmt 0x%x (frambeuffer idx %d depth attachment)", texTrackDepth, (unsigned)w, (unsigned)h, (unsigned)format, i);
+				gpxutil::info("created texture %u %ux%u fmt 0x%x (frambeuffer idx %d depth attachment)", texTrackDepth, (unsigned)capW, (unsigned)capH, (unsigned)format, i);
 			}
 		}
 
@@ -240,35 +485,22 @@ bool CVis::InitializeGL(GLsizei w, GLsizei h, float dataAspectRatio)
 		}
 	}
 
-	width = w;
-	height = h;
-	
-	for (int i=0; i<UBO_COUNT; i++) {
-		if (!InitializeUBO(i)) {
-			return false;
-		}
+	if (!texHistoryAccu) {
+		GLenum format = GL_R32UI;
+		glGenTextures(1, &texHistoryAccu);
+		glBindTexture(GL_TEXTURE_2D, texHistoryAccu);
+		glTexStorage2D(GL_TEXTURE_2D, 1, format, capW, capH);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glClearTexImage(texHistoryAccu, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+		gpxutil::info("created texture %u %ux%u fmt 0x%x (history accumulation)", texHistoryAccu, (unsigned)capW, (unsigned)capH, (unsigned)format);
 	}
 
-	static const char* programs[PROG_COUNT][2] = {
-		{ "shaders/simple.vs", "shaders/simple.fs" },
-		{ "shaders/track.vs", "shaders/track.fs"},
-		{ "shaders/line.vs", "shaders/line.fs"},
-		{ "shaders/point.vs", "shaders/point.fs"},
-		{ "shaders/fullscreen.vs", "shaders/tex.fs"},
-		{ "shaders/fullscreen.vs", "shaders/blend.fs"},
-	};
-
-	for (int i=0; i<PROG_COUNT; i++) {
-		if (!program[i]) {
-			program[i] = gpxutil::programCreateFromFiles(programs[i][0], programs[i][1]);
-			if (!program[i]) {
-				gpxutil::warn("program idx %d (%s, %s) failed", i, programs[i][0], programs[i][1]);
-				return false;
-			}
-			gpxutil::info("created program %u (idx %d)", program[i], i);
-		}
-	}
-	Clear();
+	capacityWidth = capW;
+	capacityHeight = capH;
 	return true;
 }
 
@@ -286,17 +518,20 @@ bool CVis::InitializeUBO(int i)
 	glBindBuffer(GL_UNIFORM_BUFFER, ubo[i]);
 
 	ubo::transformParam transformParam;
+	ubo::polygonParam polygonParam;
 	ubo::lineParam lineParam;
 
 	float screenAspect;
 	float tscale[2];
 	float screenSize;
+	GLsizei vw = GetViewWidth();
+	GLsizei vh = GetViewHeight();
 
 	switch(i) {
 		case UBO_TRANSFORM:
 			size = sizeof(ubo::transformParam);
 			ptr = &transformParam;
-			screenAspect = (float)width / (float)height;
+			screenAspect = (float)vw / (float)vh;
 			if (dataAspect > 1.0f) {
 				tscale[0] = 1.0f;
 				tscale[1] = dataAspect;
@@ -319,15 +554,37 @@ bool CVis::InitializeUBO(int i)
 			scaleOffset[1] = 2.0f * tscale[1];
 			scaleOffset[2] =-1.0f * tscale[0];
 			scaleOffset[3] =-1.0f * tscale[1];
-			transformParam.scale_offset[0] = scaleOffset[0];
-			transformParam.scale_offset[1] = scaleOffset[1];
-			transformParam.scale_offset[2] = scaleOffset[2];
-			transformParam.scale_offset[3] = scaleOffset[3];
+			// map the NDC of the whole view to those of the framebuffer
+			transformParam.scale_offset[0] = scaleOffset[0] * (float)vw / (float)width;
+			transformParam.scale_offset[1] = scaleOffset[1] * (float)vh / (float)height;
+			transformParam.scale_offset[2] = ((scaleOffset[2] + 1.0f) * (float)vw - 2.0f * (float)viewOffset[0]) / (float)width - 1.0f;
+			transformParam.scale_offset[3] = ((scaleOffset[3] + 1.0f) * (float)vh - 2.0f * (float)viewOffset[1]) / (float)height - 1.0f;
 			transformParam.size[0] = (GLfloat)width;
 			transformParam.size[1] = (GLfloat)height;
 			transformParam.size[2] = 1.0f/transformParam.size[0];
 			transformParam.size[3] = 1.0f/transformParam.size[1];
 			GetZoomShift(transformParam.zoomShift);
+			transformParam.texScale[0] = (capacityWidth > 0) ? (GLfloat)width / (GLfloat)capacityWidth : 1.0f;
+			transformParam.texScale[1] = (capacityHeight > 0) ? (GLfloat)height / (GLfloat)capacityHeight : 1.0f;
+			// half a texel, the linear samples stay within the used part
+			transformParam.texScale[2] = (capacityWidth > 0) ? 0.5f / (GLfloat)capacityWidth : 0.0f;
+			transformParam.texScale[3] = (capacityHeight > 0) ? 0.5f / (GLfloat)capacityHeight : 0.0f;
+			break;
+		case UBO_POLYGON:
+			size = sizeof(ubo::polygonParam);
+			ptr = &polygonParam;
+			// combine the per-polygon decoding with the zoom in double
+			// precision, so that the shaders only deal with values in the
+			// zoomed space, where float precision is sufficient
+			for (int j=0; j<2; j++) {
+				double zoom = (double)cfg.zoomFactor;
+				polygonParam.decode[j] = (GLfloat)(zoom * polygonExtent[j]);
+				polygonParam.decode[2+j] = (GLfloat)(zoom * (polygonOrigin[j] - (double)cfg.centerNormalized[j]) + 0.5);
+			}
+			polygonParam.info[0] = (GLint)polygonEncoding;
+			polygonParam.info[1] = (GLint)vertexCount;
+			polygonParam.info[2] = 0;
+			polygonParam.info[3] = 0;
 			break;
 		case UBO_LINE_TRACK:
 		case UBO_LINE_HISTORY:
@@ -388,7 +645,7 @@ bool CVis::InitializeUBO(int i)
 			}
 			lineParam.distExp[2] = 1.0f;
 			lineParam.distExp[3] = 1.0f;
-			screenSize = (width < height)?(float)width:(float)height;
+			screenSize = (vw < vh)?(float)vw:(float)vh;
 			if ((i == UBO_LINE_HISTORY) || (i == UBO_LINE_HISTORY_FINAL)) {
 				lineParam.lineWidths[0] = (float)cfg.historyWidth / screenSize;
 			} else {
@@ -414,12 +671,44 @@ bool CVis::InitializeUBO(int i)
 }
 
 void CVis::DropGL()
+{
+	DropFramebuffers();
+	DropBuffers();
+	DropPrograms();
+	width = 0;
+	height = 0;
+}
+
+void CVis::DropPrograms()
+{
+	for (int i=0; i<PROG_COUNT; i++) {
+		if (program[i]) {
+			gpxutil::info("destroying program %u (idx %d)", program[i], i);
+			glDeleteProgram(program[i]);
+			program[i] = 0;
+		}
+		programMissing[i] = false;
+	}
+}
+
+void CVis::DropBuffers()
 {
 	if (vaoEmpty) {
 		gpxutil::info("destroying VAO %u (empty)", vaoEmpty);
 		glDeleteVertexArrays(1, &vaoEmpty);
 		vaoEmpty = 0;
 	}
+	if (vaoLine) {
+		gpxutil::info("destroying VAO %u (line)", vaoLine);
+		glDeleteVertexArrays(1, &vaoLine);
+		vaoLine = 0;
+	}
+	if (texTile) {
+		gpxutil::info("destroying texture %u (history tile)", texTile);
+		glDeleteTextures(1, &texTile);
+		texTile = 0;
+		texTileSize = 0;
+	}
 	for (int i=0; i<SSBO_COUNT; i++) {
 		if (ssbo[i]) {
 			gpxutil::info("destroying buffer %u (SSBO %d)", ssbo[i], i);
@@ -427,6 +716,17 @@ void CVis::DropGL()
 			ssbo[i] = 0;
 		}
 	}
+	for (int i=0; i<UBO_COUNT; i++) {
+		if (ubo[i]) {
+			gpxutil::info("destroying buffer %u (UBO idx %d)", ubo[i], i);
+			glDeleteBuffers(1, &ubo[i]);
+			ubo[i] = 0;
+		}
+	}
+}
+
+void CVis::DropFramebuffers()
+{
 	for (int i=0; i<FB_COUNT; i++) {
 		if (fbo[i]) {
 			gpxutil::info("destroying FBO %u (frambeuffer idx %d)", fbo[i], i);
@@ -446,25 +746,32 @@ void CVis::DropGL()
 			}
 		}
 	}
-	for (int i=0; i<UBO_COUNT; i++) {
-		if (ubo[i]) {
-			gpxutil::info("destroying buffer %u (UBO idx %d)", ubo[i], i);
-			glDeleteBuffers(1, &ubo[i]);
-			ubo[i] = 0;
-		}
-	}
-	for (int i=0; i<PROG_COUNT; i++) {
-		if (program[i]) {
-			gpxutil::info("destroying program %u (idx %d)", program[i], i);
-			glDeleteProgram(program[i]);
-			program[i] = 0;
-		}
+	if (texHistoryAccu) {
+		gpxutil::info("destroying texture %u (history accumulation)", texHistoryAccu);
+		glDeleteTextures(1, &texHistoryAccu);
+		texHistoryAccu = 0;
 	}
-	width = 0;
-	height = 0;
+	capacityWidth = 0;
+	capacityHeight = 0;
 }
 
 void CVis::SetPolygon(const std::vector<GLfloat>& vertices2D)
+{
+	SetPolygon(vertices2D, std::vector<size_t>());
+}
+
+void CVis::SetPolygon(const std::vector<GLfloat>& vertices2D, const std::vector<size_t>& segmentStarts)
+{
+	std::vector<GLuint> data(vertices2D.size());
+	const double origin[2] = {0.0, 0.0};
+	const double extent[2] = {1.0, 1.0};
+	if (!data.empty()) {
+		memcpy(data.data(), vertices2D.data(), sizeof(GLuint) * data.size());
+	}
+	SetPolygon(data, gpx::VERTEX_ENCODING_FLOAT, origin, extent, segmentStarts);
+}
+
+void CVis::SetPolygon(const std::vector<GLuint>& data, gpx::TVertexEncoding encoding, const double origin[2], const double extent[2], const std::vector<size_t>& segmentStarts)
 {
 	if (ssbo[SSBO_LINE]) {
 		gpxutil::info("destroying buffer %u (SSBO %d line)", ssbo[SSBO_LINE], (int)SSBO_LINE);
@@ -473,9 +780,102 @@ void CVis::SetPolygon(const std::vector<GLfloat>& vertices2D)
 	}
 	glGenBuffers(1, &ssbo[SSBO_LINE]);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[SSBO_LINE]);
-	glBufferStorage(GL_SHADER_STORAGE_BUFFER, sizeof(GLfloat) * vertices2D.size(), vertices2D.data(), 0);
-	bufferVertexCount = vertexCount = vertices2D.size() / 2;
-	gpxutil::info("created buffer %u (SSBO %d line) for %u vertices", ssbo[SSBO_LINE], (int)SSBO_LINE, (unsigned)bufferVertexCount);
+	glBufferStorage(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * data.size(), data.data(), 0);
+	polygonEncoding = encoding;
+	polygonOrigin[0] = origin[0];
+	polygonOrigin[1] = origin[1];
+	polygonExtent[0] = extent[0];
+	polygonExtent[1] = extent[1];
+	bufferVertexCount = vertexCount = (encoding == gpx::VERTEX_ENCODING_UNORM16) ? data.size() : data.size() / 2;
+	segments = segmentStarts;
+	if (segments.empty()) {
+		segments.push_back(0);
+	}
+	gpxutil::info("created buffer %u (SSBO %d line) for %u vertices in %u segments, encoding %d", ssbo[SSBO_LINE], (int)SSBO_LINE, (unsigned)bufferVertexCount, (unsigned)segments.size(), (int)encoding);
+	InitializeUBO(UBO_POLYGON);
+	UpdateLineVAO();
+}
+
+void CVis::UpdateLineVAO()
+{
+	// the line buffer is also used as vertex buffer for the per-instance
+	// attributes, the attribute format does the decoding of the encoding
+	if (!vaoLine || !ssbo[SSBO_LINE]) {
+		return;
+	}
+	GLenum type;
+	GLboolean normalized;
+	GLsizei stride;
+	if (polygonEncoding == gpx::VERTEX_ENCODING_UNORM16) {
+		type = GL_UNSIGNED_SHORT;
+		normalized = GL_TRUE;
+		stride = 2 * sizeof(GLushort);
+	} else {
+		type = GL_FLOAT;
+		normalized = GL_FALSE;
+		stride = 2 * sizeof(GLfloat);
+	}
+	glBindVertexArray(vaoLine);
+	glVertexAttribFormat(0, 2, type, normalized, 0);
+	glVertexAttribFormat(1, 2, type, normalized, (GLuint)stride);
+	glBindVertexBuffer(0, ssbo[SSBO_LINE], 0, stride);
+	glBindVertexArray(0);
+}
+
+void CVis::GetLineRanges(size_t lineCount)
+{
+	// Get the ranges of the first lineCount lines, but skip the lines
+	// connecting the last vertex of a segment with the first one of the
+	// next segment. Line i connects vertex i and i+1.
+	drawFirst.clear();
+	drawCount.clear();
+	for (size_t i=0; i<segments.size(); i++) {
+		size_t first = segments[i];
+		size_t end = (i + 1 < segments.size()) ? segments[i+1] : vertexCount;
+		if (first >= lineCount) {
+			break;
+		}
+		if (end - 1 > lineCount) {
+			end = lineCount + 1;
+		}
+		if (end <= first + 1) {
+			continue;
+		}
+		drawFirst.push_back((GLint)first);
+		drawCount.push_back((GLsizei)(end - first - 1));
+	}
+}
+
+void CVis::DrawLineStrips(size_t lineCount)
+{
+	// gl_VertexID includes the first index of each draw, so the shader
+	// does not need to know about the segments at all.
+	GetLineRanges(lineCount);
+	for (size_t i=0; i<drawCount.size(); i++) {
+		drawCount[i]++; // number of vertices
+	}
+	if (drawFirst.size() == 1) {
+		glDrawArrays(GL_LINE_STRIP, drawFirst[0], drawCount[0]);
+	} else if (drawFirst.size() > 1) {
+		glMultiDrawArrays(GL_LINE_STRIP, drawFirst.data(), drawCount.data(), (GLsizei)drawFirst.size());
+	}
+}
+
+void CVis::DrawLineInstances(size_t lineCount, GLint lineBaseLocation)
+{
+	// one instance with a single quad per line, the end points are fetched
+	// as per-instance attributes, and the base instance selects the segment.
+	// gl_InstanceID does not include the base instance, so the shader gets
+	// the index of the first line via the lineBaseLocation uniform (if >= 0)
+	GetLineRanges(lineCount);
+	glBindVertexArray(vaoLine);
+	for (size_t i=0; i<drawFirst.size(); i++) {
+		if (lineBaseLocation >= 0) {
+			glUniform1i(lineBaseLocation, drawFirst[i]);
+		}
+		glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 6, drawCount[i], (GLuint)drawFirst[i]);
+	}
+	glBindVertexArray(vaoEmpty);
 }
 
 void CVis::DrawTrackInternal(float upTo)
@@ -504,11 +904,12 @@ void CVis::DrawTrackInternal(float upTo)
 
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo[SSBO_LINE]);
 		glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo[UBO_TRANSFORM]);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 2, ubo[UBO_POLYGON]);
 		glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo[UBO_LINE_TRACK]);
 
 		glBindTextures(0, 1, &tex[FB_NEIGHBORHOOD]);
 		glUniform1f(1, upTo);
-		glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(18*cnt));
+		DrawLineInstances(cnt, 2);
 		glDisable(GL_DEPTH_TEST);
 
 		if (drawPoint) {
@@ -545,6 +946,7 @@ void CVis::DrawHistory()
 	glBindVertexArray(vaoEmpty);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo[SSBO_LINE]);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo[UBO_TRANSFORM]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, ubo[UBO_POLYGON]);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo[UBO_LINE_HISTORY]);
 
 	if (cfg.historyWideLine) {
@@ -552,7 +954,7 @@ void CVis::DrawHistory()
 		glBlendEquation(GL_MAX);
 		glBlendFunc(GL_ONE, GL_ONE);
 		glEnable(GL_BLEND);
-		glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(18*(vertexCount-1)));
+		DrawLineInstances(vertexCount-1);
 	} else {
 		glUseProgram(program[PROG_LINE_SIMPLE]);
 
@@ -564,7 +966,7 @@ void CVis::DrawHistory()
 			glDisable(GL_BLEND);
 		}
 
-		glDrawArrays(GL_LINE_STRIP, 0, (GLsizei)vertexCount);
+		DrawLineStrips(vertexCount-1);
 	}
 }
 
@@ -579,8 +981,9 @@ void CVis::DrawNeighborhood()
 
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo[SSBO_LINE]);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo[UBO_TRANSFORM]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, ubo[UBO_POLYGON]);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo[UBO_LINE_NEIGHBORHOOD]);
-	glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(18*(vertexCount-1)));
+	DrawLineInstances(vertexCount-1);
 }
 
 void CVis::AddHistory()
@@ -603,18 +1006,152 @@ void CVis::AddHistory()
 	}
 }
 
+bool CVis::SupportsHistoryBatch() const
+{
+	return cfg.historyWideLine && program[PROG_HISTORY_SPLAT] && program[PROG_HISTORY_RESOLVE] && texHistoryAccu;
+}
+
+void CVis::UploadSSBO(TSSBO idx, const void *data, size_t size)
+{
+	if (ssbo[idx]) {
+		glDeleteBuffers(1, &ssbo[idx]);
+		ssbo[idx] = 0;
+	}
+	glGenBuffers(1, &ssbo[idx]);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[idx]);
+	glBufferStorage(GL_SHADER_STORAGE_BUFFER, (size > 0) ? size : 4, (size > 0) ? data : NULL, 0);
+}
+
+void CVis::AddHistoryBatch(const CHistoryBatch& batch)
+{
+	// Same result as AddHistory() for each of the tracks, but all lines are
+	// splatted in a single dispatch, so there is no scratch clear and
+	// fullscreen pass per track. See shaders/history.cs.
+	GLuint trackCount = (GLuint)batch.GetTrackCount();
+	if (trackCount < 1 || batch.chunks.empty()) {
+		return;
+	}
+	UploadSSBO(SSBO_HISTORY_VERTEX, batch.vertices.data(), sizeof(GLfloat) * batch.vertices.size());
+	UploadSSBO(SSBO_HISTORY_CHUNK, batch.chunks.data(), sizeof(THistoryChunk) * batch.chunks.size());
+	UploadSSBO(SSBO_HISTORY_GROUP, batch.groups.data(), sizeof(THistoryChunk) * batch.groups.size());
+	UploadSSBO(SSBO_HISTORY_TRACK, batch.trackGroups.data(), sizeof(GLuint) * batch.trackGroups.size());
+
+	// One work group per 16x16 tile. The tracks are split into slices
+	// (the z dimension) so that small images still get enough work groups,
+	// each slice costs one more atomic per pixel.
+	const GLuint minWorkGroups = 1024;
+	GLuint tilesX = ((GLuint)width + 15) / 16;
+	GLuint tilesY = ((GLuint)height + 15) / 16;
+	GLuint slices = (minWorkGroups + tilesX * tilesY - 1) / (tilesX * tilesY);
+	if (slices > trackCount) {
+		slices = trackCount;
+	}
+	GLuint tracksPerSlice = (trackCount + slices - 1) / slices;
+	slices = (trackCount + tracksPerSlice - 1) / tracksPerSlice;
+	bool additive = (cfg.historyAdditive > BACKGROUND_ADD_NONE);
+
+	glUseProgram(program[PROG_HISTORY_SPLAT]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo[UBO_TRANSFORM]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo[UBO_LINE_HISTORY]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssbo[SSBO_HISTORY_VERTEX]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbo[SSBO_HISTORY_CHUNK]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo[SSBO_HISTORY_GROUP]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssbo[SSBO_HISTORY_TRACK]);
+	glBindImageTexture(0, texHistoryAccu, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+	glUniform4i(0, (GLint)trackCount, (GLint)tracksPerSlice, additive?1:0, 0);
+	glDispatchCompute(tilesX, tilesY, slices);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	// add the fixed point result to the history, and clear it for the next batch
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_BACKGROUND]);
+	glViewport(0,0,width,height);
+	glBindVertexArray(vaoEmpty);
+	glUseProgram(program[PROG_HISTORY_RESOLVE]);
+	glBindTextures(3, 1, &texHistoryAccu);
+	glUniform1f(1, 1.0f / 65536.0f); // FIXED_POINT_SCALE in shaders/history.cs
+	glBlendEquation(additive ? GL_FUNC_ADD : GL_MAX);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glEnable(GL_BLEND);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glClearTexImage(texHistoryAccu, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+}
+
+void CVis::AddHistoryTile(const double rectNormalized[4], GLsizei size, const GLfloat *data)
+{
+	if (texTile && texTileSize != size) {
+		glDeleteTextures(1, &texTile);
+		texTile = 0;
+	}
+	if (!texTile) {
+		glGenTextures(1, &texTile);
+		glBindTexture(GL_TEXTURE_2D, texTile);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, size, size);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		texTileSize = size;
+		gpxutil::info("created texture %u %ux%u fmt 0x%x (history tile)", texTile, (unsigned)size, (unsigned)size, (unsigned)GL_R32F);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTextureSubImage2D(texTile, 0, 0, 0, size, size, GL_RED, GL_FLOAT, data);
+
+	// like the polygons, apply the zoom in double precision
+	GLfloat rect[4];
+	for (int j=0; j<2; j++) {
+		double zoom = (double)cfg.zoomFactor;
+		double center = (double)cfg.centerNormalized[j];
+		rect[j] = (GLfloat)(zoom * (rectNormalized[j] - center) + 0.5);
+		rect[2+j] = (GLfloat)(zoom * (rectNormalized[2+j] - center) + 0.5);
+	}
+
+	// the tiles do not overlap, and the history is empty before
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_BACKGROUND]);
+	glViewport(0,0,width,height);
+	glBindVertexArray(vaoEmpty);
+	glUseProgram(program[PROG_TILE]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo[UBO_TRANSFORM]);
+	glBindTextures(3, 1, &texTile);
+	glUniform4fv(0, 1, rect);
+	glDisable(GL_BLEND);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+void CVis::AddHistoryImage(const GLfloat *data)
+{
+	// upload once into the scratch buffer, and add it like a track
+	bool additive = (cfg.historyAdditive > BACKGROUND_ADD_NONE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTextureSubImage2D(tex[FB_BACKGROUND_SCRATCH], 0, 0, 0, width, height, GL_RED, GL_FLOAT, data);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_BACKGROUND]);
+	glViewport(0,0,width,height);
+	glBindVertexArray(vaoEmpty);
+	glUseProgram(program[PROG_FULLSCREEN_TEX]);
+	glBindTextures(3, 1, &tex[FB_BACKGROUND_SCRATCH]);
+	glBlendEquation(additive ? GL_FUNC_ADD : GL_MAX);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glEnable(GL_BLEND);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
 void CVis::AddToBackground()
 {
-	glViewport(0,0,width,height);		
-	AddHistory();
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_NEIGHBORHOOD]);
-	DrawNeighborhood();
+	AddLineToBackground();
+	AddLineToNeighborhood();
 }
 
 void CVis::AddLineToBackground()
 {
 	glViewport(0,0,width,height);
 	AddHistory();
+	if (BeginBuildDraw(STAGE_BACKGROUND)) {
+		// a rebuild in progress must not lose it
+		AddHistory();
+		EndBuildDraw();
+	}
 }
 
 void CVis::AddLineToNeighborhood()
@@ -622,6 +1159,11 @@ void CVis::AddLineToNeighborhood()
 	glViewport(0,0,width,height);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_NEIGHBORHOOD]);
 	DrawNeighborhood();
+	if (BeginBuildDraw(STAGE_NEIGHBORHOOD)) {
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_NEIGHBORHOOD]);
+		DrawNeighborhood();
+		EndBuildDraw();
+	}
 }
 
 void CVis::MixTrackAndBackground(float factor)
@@ -640,6 +1182,8 @@ void CVis::MixTrackAndBackground(float factor)
 
 void CVis::ClearHistory()
 {
+	// what is drawn from now on is up to date
+	CancelRebuild(STAGE_BACKGROUND);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_BACKGROUND]);
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	//glClearColor(cfg.colorBackground[0], cfg.colorBackground[1], cfg.colorBackground[2], cfg.colorBackground[3]);
@@ -648,6 +1192,7 @@ void CVis::ClearHistory()
 
 void CVis::ClearNeighborHood()
 {
+	CancelRebuild(STAGE_NEIGHBORHOOD);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[FB_NEIGHBORHOOD]);
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -656,8 +1201,10 @@ void CVis::ClearNeighborHood()
 void CVis::Clear()
 {
 	ClearHistory();
+	CancelRebuild(STAGE_ALL);
+	snapshotStages = 0;
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-	for (int i=0; i<FB_COUNT; i++) {
+	for (int i=0; i<FB_BACKGROUND_BUILD; i++) {
 		if (i != FB_BACKGROUND) {
 			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[i]);
 			if (i == FB_TRACK) { 
@@ -669,42 +1216,295 @@ void CVis::Clear()
 	}
 }
 
-bool CVis::GetImage(gpximg::CImg& img) const
+void CVis::SwapFramebuffers(TFramebuffer a, TFramebuffer b)
 {
-	if (!tex[FB_FINAL]) {
-		gpxutil::warn("no image available");
-		return false;
-	}
-	if (!img.Allocate((int)width,(int)height,3)) {
-		return false;
-	}
-	glGetTextureImage(tex[FB_FINAL],0,GL_RGB,GL_UNSIGNED_BYTE, (GLsizei)img.GetSize(), img.GetData());
-	return true;
+	std::swap(fbo[a], fbo[b]);
+	std::swap(tex[a], tex[b]);
 }
 
-void CVis::UpdateConfig()
+void CVis::Reproject(TFramebuffer dst, TFramebuffer src, const GLfloat srcZoomShift[4])
 {
-	InitializeUBO(UBO_LINE_TRACK);
-	InitializeUBO(UBO_LINE_HISTORY);
-	InitializeUBO(UBO_LINE_HISTORY_FINAL);
-	InitializeUBO(UBO_LINE_NEIGHBORHOOD);
+	// Both states only differ in the zoom and the center, so a pixel of the
+	// current view maps affinely to the source: scale r = z_src / z and
+	// offset c in the zoomed space, and through scaleOffset to the
+	// normalized view coordinates.
+	GLfloat zoomShift[4];
+	GLfloat texTransform[4];
+	GLfloat texRange[4];
+	GetZoomShift(zoomShift);
+	for (int j=0; j<2; j++) {
+		float r = srcZoomShift[j] / zoomShift[j];
+		float c = srcZoomShift[2+j] - r * zoomShift[2+j];
+		float k = scaleOffset[2+j] * (1.0f - r) + scaleOffset[j] * c;
+		texTransform[j] = r;
+		texTransform[2+j] = 0.5f * (k - r + 1.0f);
+	}
+	texRange[0] = (GLfloat)width / (GLfloat)capacityWidth;
+	texRange[1] = (GLfloat)height / (GLfloat)capacityHeight;
+	texRange[2] = 0.5f / (GLfloat)capacityWidth;
+	texRange[3] = 0.5f / (GLfloat)capacityHeight;
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[dst]);
+	glViewport(0,0,width,height);
+	glBindVertexArray(vaoEmpty);
+	glUseProgram(program[PROG_REPROJECT]);
+	glBindTextures(3, 1, &tex[src]);
+	glUniform4fv(1, 1, texTransform);
+	glUniform4fv(2, 1, texRange);
+	glDisable(GL_BLEND);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
-void CVis::UpdateTransform()
+bool CVis::BeginRebuild(unsigned stages, bool reproject)
 {
-	cfg.ClampTransform();
-	InitializeUBO(UBO_TRANSFORM);
-}
+	static const TFramebuffer targets[2][3] = {
+		{FB_BACKGROUND, FB_BACKGROUND_BUILD, FB_BACKGROUND_SNAPSHOT},
+		{FB_NEIGHBORHOOD, FB_NEIGHBORHOOD_BUILD, FB_NEIGHBORHOOD_SNAPSHOT},
+	};
+	static const unsigned targetStages[2] = {STAGE_BACKGROUND, STAGE_NEIGHBORHOOD};
 
-void CVis::GetZoomShift(GLfloat zoomShift[4]) const
-{
-	zoomShift[0] = cfg.zoomFactor;
-	zoomShift[1] = cfg.zoomFactor;
-	zoomShift[2] = 0.5f - cfg.zoomFactor * cfg.centerNormalized[0];
-	zoomShift[3] = 0.5f - cfg.zoomFactor * cfg.centerNormalized[1];
+	stages &= (STAGE_BACKGROUND | STAGE_NEIGHBORHOOD);
+	if (!stages || width < 1 || height < 1 || buildSwapped) {
+		return false;
+	}
+	if (!withRebuildTargets) {
+		withRebuildTargets = true;
+		if (!InitializeFramebuffers(width, height)) {
+			gpxutil::warn("rebuild targets not available");
+			withRebuildTargets = false;
+			return false;
+		}
+	}
+	if (reproject && !program[PROG_REPROJECT]) {
+		reproject = false;
+	}
+
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	for (int j=0; j<2; j++) {
+		if (!(stages & targetStages[j])) {
+			continue;
+		}
+		if (reproject) {
+			if (!(snapshotStages & targetStages[j])) {
+				// the visible state is complete, for the previous transform
+				SwapFramebuffers(targets[j][0], targets[j][2]);
+				memcpy(snapshotZoomShift[j], previousZoomShift, sizeof(previousZoomShift));
+				snapshotStages |= targetStages[j];
+			}
+			Reproject(targets[j][0], targets[j][2], snapshotZoomShift[j]);
+		}
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[targets[j][1]]);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	rebuildStages |= stages;
+	return true;
 }
 
-void CVis::TransformToPos(const GLfloat posNormalized[2], GLfloat pos[2]) const
+bool CVis::BeginBuildDraw(unsigned stages)
+{
+	stages &= rebuildStages;
+	if (!stages || buildSwapped) {
+		return false;
+	}
+	if (stages & STAGE_BACKGROUND) {
+		SwapFramebuffers(FB_BACKGROUND, FB_BACKGROUND_BUILD);
+	}
+	if (stages & STAGE_NEIGHBORHOOD) {
+		SwapFramebuffers(FB_NEIGHBORHOOD, FB_NEIGHBORHOOD_BUILD);
+	}
+	buildSwapped = stages;
+	return true;
+}
+
+void CVis::EndBuildDraw()
+{
+	if (buildSwapped & STAGE_BACKGROUND) {
+		SwapFramebuffers(FB_BACKGROUND, FB_BACKGROUND_BUILD);
+	}
+	if (buildSwapped & STAGE_NEIGHBORHOOD) {
+		SwapFramebuffers(FB_NEIGHBORHOOD, FB_NEIGHBORHOOD_BUILD);
+	}
+	buildSwapped = 0;
+}
+
+void CVis::FinishRebuild()
+{
+	EndBuildDraw();
+	if (rebuildStages & STAGE_BACKGROUND) {
+		SwapFramebuffers(FB_BACKGROUND, FB_BACKGROUND_BUILD);
+	}
+	if (rebuildStages & STAGE_NEIGHBORHOOD) {
+		SwapFramebuffers(FB_NEIGHBORHOOD, FB_NEIGHBORHOOD_BUILD);
+	}
+	snapshotStages &= ~rebuildStages;
+	rebuildStages = 0;
+}
+
+void CVis::CancelRebuild(unsigned stages)
+{
+	if (buildSwapped) {
+		// clearing while drawing into the rebuild targets
+		return;
+	}
+	stages &= rebuildStages;
+	snapshotStages &= ~stages;
+	rebuildStages &= ~stages;
+}
+
+bool CVis::GetImage(gpximg::CImg& img, bool topDown) const
+{
+	if (!tex[FB_FINAL]) {
+		gpxutil::warn("no image available");
+		return false;
+	}
+	if (!img.Allocate((int)width,(int)height,3)) {
+		return false;
+	}
+	TFramebuffer fb = FB_FINAL;
+	if (topDown) {
+		// a blit is much cheaper than a pass over the image on the CPU
+		fb = FB_FINAL_FLIPPED;
+		glBlitNamedFramebuffer(fbo[FB_FINAL], fbo[fb], 0, 0, width, height, 0, height, width, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glGetTextureSubImage(tex[fb], 0, 0, 0, 0, width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, (GLsizei)img.GetSize(), img.GetData());
+	img.SetBottomUp(!topDown);
+	return true;
+}
+
+bool CVis::GetImageRows(GLint x, GLint y, GLsizei w, GLsizei h, GLsizei rowLength, unsigned char *data, size_t size) const
+{
+	if (!tex[FB_FINAL]) {
+		gpxutil::warn("no image available");
+		return false;
+	}
+	if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > width || y + h > height || rowLength < w) {
+		gpxutil::warn("invalid image region %d,%d %dx%d", (int)x, (int)y, (int)w, (int)h);
+		return false;
+	}
+	glPixelStorei(GL_PACK_ROW_LENGTH, rowLength);
+	glGetTextureSubImage(tex[FB_FINAL], 0, x, y, 0, w, h, 1, GL_RGB, GL_UNSIGNED_BYTE, (GLsizei)size, data);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	return true;
+}
+
+bool CVis::GetHistoryRows(GLint x, GLint y, GLsizei w, GLsizei h, GLsizei rowLength, GLfloat *data, size_t size) const
+{
+	if (!tex[FB_BACKGROUND]) {
+		gpxutil::warn("no history available");
+		return false;
+	}
+	if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > width || y + h > height || rowLength < w) {
+		gpxutil::warn("invalid history region %d,%d %dx%d", (int)x, (int)y, (int)w, (int)h);
+		return false;
+	}
+	glPixelStorei(GL_PACK_ROW_LENGTH, rowLength);
+	glGetTextureSubImage(tex[FB_BACKGROUND], 0, x, y, 0, w, h, 1, GL_RED, GL_FLOAT, (GLsizei)(size * sizeof(GLfloat)), data);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	return true;
+}
+
+void CVis::SetRenderWindow(GLsizei viewW, GLsizei viewH, GLint offsetX, GLint offsetY)
+{
+	viewWidth = viewW;
+	viewHeight = viewH;
+	viewOffset[0] = offsetX;
+	viewOffset[1] = offsetY;
+	if (width > 0 && height > 0) {
+		InitializeUBO(UBO_TRANSFORM);
+		UpdateConfig();
+	}
+}
+
+GLsizei CVis::GetGuardBand() const
+{
+	// The line widths are relative to the smaller side of the view, the
+	// shaders use them as radius in the zoomed space. track.fs also samples
+	// the neighborhood at the closest point of the line, up to one track
+	// width away, with linear filtering.
+	GLsizei vw = GetViewWidth();
+	GLsizei vh = GetViewHeight();
+	float screenSize = (vw < vh)?(float)vw:(float)vh;
+	float maxWidth = cfg.trackWidth;
+	maxWidth = (cfg.trackPointWidth > maxWidth) ? cfg.trackPointWidth : maxWidth;
+	maxWidth = (cfg.historyWidth > maxWidth) ? cfg.historyWidth : maxWidth;
+	maxWidth = (cfg.neighborhoodWidth > maxWidth) ? cfg.neighborhoodWidth : maxWidth;
+	float pixelsX = 0.5f * scaleOffset[0] * (float)vw;
+	float pixelsY = 0.5f * scaleOffset[1] * (float)vh;
+	float pixels = maxWidth / screenSize * ((pixelsX > pixelsY) ? pixelsX : pixelsY);
+	return (GLsizei)ceilf(pixels) + 2;
+}
+
+unsigned CVis::UpdateConfig()
+{
+	unsigned stages = cfg.GetChangedStages(appliedCfg);
+	InitializeUBO(UBO_LINE_TRACK);
+	InitializeUBO(UBO_LINE_HISTORY);
+	InitializeUBO(UBO_LINE_HISTORY_FINAL);
+	InitializeUBO(UBO_LINE_NEIGHBORHOOD);
+	// the transform is applied separately by UpdateTransform()
+	GLfloat zoomFactor = appliedCfg.zoomFactor;
+	GLfloat center[2] = {appliedCfg.centerNormalized[0], appliedCfg.centerNormalized[1]};
+	appliedCfg = cfg;
+	appliedCfg.zoomFactor = zoomFactor;
+	appliedCfg.centerNormalized[0] = center[0];
+	appliedCfg.centerNormalized[1] = center[1];
+	return stages;
+}
+
+unsigned CVis::UpdateTransform()
+{
+	appliedCfg.GetZoomShift(previousZoomShift);
+	cfg.ClampTransform();
+	InitializeUBO(UBO_TRANSFORM);
+	InitializeUBO(UBO_POLYGON);
+	appliedCfg.zoomFactor = cfg.zoomFactor;
+	appliedCfg.centerNormalized[0] = cfg.centerNormalized[0];
+	appliedCfg.centerNormalized[1] = cfg.centerNormalized[1];
+	return STAGE_ALL;
+}
+
+double CVis::GetPixelsPerUnit() const
+{
+	// scaleOffset maps to the NDC of the view, which span 2 units
+	return 0.5 * (double)scaleOffset[0] * (double)GetViewWidth();
+}
+
+void CVis::GetPixelTransform(double transform[4]) const
+{
+	// zoomed space to the NDC of the view, like the transform UBO, and on
+	// to the pixels of the framebuffer window
+	GLsizei vw = GetViewWidth();
+	GLsizei vh = GetViewHeight();
+	double zoom = (double)cfg.zoomFactor;
+	transform[0] = 0.5 * (double)scaleOffset[0] * vw * zoom;
+	transform[1] = 0.5 * (double)scaleOffset[1] * vh * zoom;
+	transform[2] = 0.5 * ((double)scaleOffset[0] * vw * (0.5 - zoom * cfg.centerNormalized[0]) + ((double)scaleOffset[2] + 1.0) * vw) - viewOffset[0];
+	transform[3] = 0.5 * ((double)scaleOffset[1] * vh * (0.5 - zoom * cfg.centerNormalized[1]) + ((double)scaleOffset[3] + 1.0) * vh) - viewOffset[1];
+}
+
+float CVis::GetHistoryLineRadius() const
+{
+	// the line widths are relative to the smaller side, see InitializeUBO
+	GLsizei vw = GetViewWidth();
+	GLsizei vh = GetViewHeight();
+	float screenSize = (vw < vh)?(float)vw:(float)vh;
+	return (float)(cfg.historyWidth / screenSize * GetPixelsPerUnit());
+}
+
+void CVis::TConfig::GetZoomShift(GLfloat zoomShift[4]) const
+{
+	zoomShift[0] = zoomFactor;
+	zoomShift[1] = zoomFactor;
+	zoomShift[2] = 0.5f - zoomFactor * centerNormalized[0];
+	zoomShift[3] = 0.5f - zoomFactor * centerNormalized[1];
+}
+
+void CVis::GetZoomShift(GLfloat zoomShift[4]) const
+{
+	cfg.GetZoomShift(zoomShift);
+}
+
+void CVis::TransformToPos(const GLfloat posNormalized[2], GLfloat pos[2]) const
 {
 	GLfloat zoomShift[4];
 	GetZoomShift(zoomShift);
@@ -730,6 +1530,14 @@ void CVis::TransformFromPos(const GLfloat pos[2], GLfloat posNormalized[2]) cons
  * MANAGE ANIMATIONS AND MULTIPLE TRACKS                                    *
  ****************************************************************************/
 
+CAnimController::TTrackMemoryStats::TTrackMemoryStats() :
+	hits(0),
+	misses(0),
+	evictions(0),
+	loadedBytes(0)
+{
+}
+
 CAnimController::TAnimConfig::TAnimConfig()
 {
 	Reset();
@@ -741,6 +1549,12 @@ void CAnimController::TAnimConfig::Reset()
 	accuMode = ACCU_MONTH;
 	accuCount = 1;
 	accuWeekDayStart = 3; /* wednesday */
+	vertexEncoding = gpx::VERTEX_ENCODING_FLOAT;
+	historyBackend = HISTORY_BACKEND_RASTER;
+	progressiveHistory = true;
+	progressiveBudget = 8.0;
+	progressiveTracks = 8;
+	historyPyramid = true;
 	ResetSpeeds();
 	ResetAtCycle();
 	ResetModes();
@@ -789,13 +1603,22 @@ CAnimController::CAnimController() :
 	curTime(0.0),
 	curPhase(PHASE_INIT),
 	prepared(false),
+	splitSubTracks(false),
 	newCycle(true),
 	animEndReached(false),
+	synchronousHistory(false),
 	animationTime(0.0),
+	restoreBegin(0),
+	restoreNext(0),
+	lastUpdatedTrack(0),
 	allTrackLength(0.0),
-	allTrackDuration(0.0)
+	allTrackDuration(0.0),
+	trackMemoryBudget(0),
+	trackUseCounter(0)
 {
 	avgStart[0] = avgStart[1] = avgStart[2] = 0.0;
+	restoreRange[0][0] = restoreRange[0][1] = 0;
+	restoreRange[1][0] = restoreRange[1][1] = 0;
 	frameInfoBuffer[0]=0;
 	frameInfoBuffer[sizeof(frameInfoBuffer)-1]=0;
 	accuInfoBuffer[0]=0;
@@ -804,15 +1627,243 @@ CAnimController::CAnimController() :
 
 bool CAnimController::AddTrack(const char *filename)
 {
-	size_t idx = tracks.size();
-	tracks.emplace_back();
-	if (!tracks[idx].Load(filename)) {
-		tracks.resize(idx);
+	if (trackIndex.IsOpen() && !splitSubTracks) {
+		return (AddIndexedTracks(std::vector<std::string>(1, filename)) > 0);
+	}
+	gpx::CTrack track;
+	// with split tracks, each part is checked on its own
+	if (!track.Load(filename, splitSubTracks ? NULL : &trackFilter)) {
 		return false;
 	}
-	tracks[idx].SetInternalID(trackIDManager.GenerateID());
-	prepared = false;
-	return true;
+	size_t rejected = 0;
+	return (AppendTrack(track, rejected) > 0);
+}
+
+size_t CAnimController::AddTracks(const std::vector<std::string>& filenames)
+{
+	if (trackIndex.IsOpen() && !splitSubTracks) {
+		return AddIndexedTracks(filenames);
+	}
+	if (trackMemoryBudget && splitSubTracks) {
+		gpxutil::warn("the parts of split tracks can not be read again, the track memory budget does not apply to them");
+	}
+
+	// parsing and decompression is independent per file,
+	// with split tracks each part is checked on its own
+	const gpx::TTrackFilter *filter = splitSubTracks ? NULL : &trackFilter;
+	size_t cnt = filenames.size();
+	size_t added = 0;
+	size_t rejected = 0;
+	// with a memory budget the files are loaded in batches and evicted in
+	// between, so that the peak stays near the budget, the batch size
+	// follows the average size of the points loaded so far
+	size_t batch = trackMemoryBudget ? std::min(cnt, (size_t)64) : cnt;
+	size_t loadedFiles = 0;
+	size_t loadedBytes = 0;
+	for (size_t first=0; first<cnt; first+=batch) {
+		if (trackMemoryBudget && loadedBytes > 0) {
+			batch = std::max((trackMemoryBudget / 8) / (loadedBytes / loadedFiles + 1), (size_t)16);
+		}
+		size_t end = std::min(first + batch, cnt);
+		std::vector<gpx::CTrack> loaded(end - first);
+		std::vector<char> ok(end - first, 0);
+		gpxutil::parallelFor(end - first, [&](size_t i) {
+			ok[i] = loaded[i].Load(filenames[first + i].c_str(), filter) ? 1 : 0;
+		});
+
+		// keep the order of the list, and assign the IDs in that order
+		for (size_t i=0; i<loaded.size(); i++) {
+			if (ok[i]) {
+				loadedFiles++;
+				loadedBytes += loaded[i].GetPointMemory();
+				added += AppendTrack(loaded[i], rejected);
+			} else if (loaded[i].WasRejected()) {
+				rejected++;
+			}
+		}
+		EvictTracks(trackUseCounter + 1);
+	}
+	if (trackFilter.IsActive()) {
+		// with split tracks, the parts are counted
+		gpxutil::info("track filter: %llu of %llu tracks rejected", (unsigned long long)rejected, (unsigned long long)(added + rejected));
+	}
+	return added;
+}
+
+size_t CAnimController::AddIndexedTracks(const std::vector<std::string>& filenames)
+{
+	// only the files which are new or changed are parsed, and always
+	// completely since the index describes the whole file: the filter
+	// works on the metadata here, all of the tracks start without their
+	// points
+	trackIndex.Update(filenames);
+	trackIndex.Save();
+
+	size_t added = 0;
+	size_t rejected = 0;
+	for (size_t i=0; i<filenames.size(); i++) {
+		const gpx::TTrackMetadata *meta = trackIndex.Find(filenames[i]);
+		if (!meta || !meta->valid) {
+			continue;
+		}
+		gpx::CTrack track;
+		track.SetMetadata(*meta);
+		added += AppendTrack(track, rejected);
+	}
+	if (trackFilter.IsActive()) {
+		gpxutil::info("track filter: %llu of %llu tracks rejected", (unsigned long long)rejected, (unsigned long long)(added + rejected));
+	}
+	return added;
+}
+
+size_t CAnimController::AppendTrack(gpx::CTrack& track, size_t& rejected)
+{
+	size_t cnt = track.GetSubTrackCount();
+	size_t added = 0;
+	if (splitSubTracks && cnt > 1) {
+		for (size_t i=0; i<cnt; i++) {
+			gpx::CTrack subTrack;
+			if (!track.ExtractSubTrack(i, subTrack)) {
+				continue;
+			}
+			if (trackFilter.IsActive() && !trackFilter.Accepts(subTrack)) {
+				rejected++;
+				continue;
+			}
+			tracks.push_back(std::move(subTrack));
+			tracks.back().SetInternalID(trackIDManager.GenerateID());
+			added++;
+		}
+	} else if (!trackFilter.IsActive() || trackFilter.Accepts(track)) {
+		tracks.push_back(std::move(track));
+		tracks.back().SetInternalID(trackIDManager.GenerateID());
+		added++;
+	} else {
+		rejected++;
+	}
+	for (size_t i=tracks.size()-added; i<tracks.size(); i++) {
+		tracks[i].SetLastUse(++trackUseCounter);
+		if (tracks[i].IsLoaded()) {
+			trackMemoryStats.loadedBytes += tracks[i].GetPointMemory();
+		}
+	}
+	if (added) {
+		prepared = false;
+	}
+	return added;
+}
+
+bool CAnimController::OpenTrackIndex(const char *filename)
+{
+	return trackIndex.Open(filename);
+}
+
+void CAnimController::SetTrackMemoryBudget(size_t bytes)
+{
+	trackMemoryBudget = bytes;
+	EvictTracks(trackUseCounter + 1);
+}
+
+void CAnimController::LoadTracks(const std::vector<size_t>& indices)
+{
+	// the tracks used by this call are the most recent ones and stay
+	unsigned long long keepFrom = trackUseCounter + 1;
+	std::vector<size_t> missing;
+	for (size_t i=0; i<indices.size(); i++) {
+		if (indices[i] >= tracks.size()) {
+			continue;
+		}
+		tracks[indices[i]].SetLastUse(++trackUseCounter);
+		if (tracks[indices[i]].IsLoaded()) {
+			trackMemoryStats.hits++;
+		} else {
+			missing.push_back(indices[i]);
+		}
+	}
+	if (missing.empty()) {
+		return;
+	}
+	gpxutil::parallelFor(missing.size(), [&](size_t i) {
+		tracks[missing[i]].LoadPoints();
+	});
+	trackMemoryStats.misses += missing.size();
+	for (size_t i=0; i<missing.size(); i++) {
+		if (tracks[missing[i]].IsLoaded()) {
+			trackMemoryStats.loadedBytes += tracks[missing[i]].GetPointMemory();
+		}
+	}
+	EvictTracks(keepFrom);
+}
+
+void CAnimController::LoadTracks(size_t first, size_t end)
+{
+	std::vector<size_t> indices;
+	for (size_t i=first; i<end && i<tracks.size(); i++) {
+		indices.push_back(i);
+	}
+	LoadTracks(indices);
+}
+
+void CAnimController::LoadTrackAhead(size_t idx, size_t end)
+{
+	// the history loops go through the tracks in order, so the
+	// next ones are read along with this one on the other threads
+	const size_t loadAhead = 64;
+	if (idx < tracks.size() && !tracks[idx].IsLoaded()) {
+		LoadTracks(idx, GetTrackChunkEnd(idx, std::min(std::max(end, idx + 1), idx + loadAhead)));
+	} else {
+		LoadTracks(idx, idx + 1);
+	}
+}
+
+size_t CAnimController::GetTrackChunkEnd(size_t first, size_t end) const
+{
+	end = std::min(end, tracks.size());
+	if (!trackMemoryBudget) {
+		return end;
+	}
+	size_t bytes = 0;
+	for (size_t i=first; i<end; i++) {
+		bytes += tracks[i].GetPointMemory();
+		if (bytes > trackMemoryBudget && i > first) {
+			return i;
+		}
+	}
+	return end;
+}
+
+void CAnimController::EvictTracks(unsigned long long keepFrom)
+{
+	// loadedBytes is only counted up between two passes, tracks can also
+	// be removed or copied through GetTracks()
+	if (!trackMemoryBudget || trackMemoryStats.loadedBytes <= trackMemoryBudget) {
+		return;
+	}
+	size_t bytes = 0;
+	std::vector<size_t> candidates;
+	for (size_t i=0; i<tracks.size(); i++) {
+		if (tracks[i].IsLoaded()) {
+			bytes += tracks[i].GetPointMemory();
+			if (tracks[i].GetLastUse() < keepFrom && i != curTrack) {
+				candidates.push_back(i);
+			}
+		}
+	}
+	// down to 7/8 of the budget, so that the next pass is not due right away
+	size_t target = trackMemoryBudget - trackMemoryBudget / 8;
+	if (bytes > trackMemoryBudget) {
+		std::sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+			return tracks[a].GetLastUse() < tracks[b].GetLastUse();
+		});
+		for (size_t i=0; i<candidates.size() && bytes > target; i++) {
+			size_t size = tracks[candidates[i]].GetPointMemory();
+			if (tracks[candidates[i]].UnloadPoints()) {
+				bytes -= size;
+				trackMemoryStats.evictions++;
+			}
+		}
+	}
+	trackMemoryStats.loadedBytes = bytes;
 }
 
 bool CAnimController::Prepare(GLsizei width, GLsizei height)
@@ -833,11 +1884,11 @@ bool CAnimController::Prepare(GLsizei width, GLsizei height)
 		aabb.MergeWith(tracks[i].GetAABB());
 		totalLen += tracks[i].GetLength();
 		totalDur += tracks[i].GetDuration();
-		const std::vector<gpx::TPoint>& points = tracks[i].GetPoints();
-		if (points.size() > 0) {
-			avgStart[0] += points[0].x;
-			avgStart[1] += points[0].y;
-			avgStart[2] += points[0].h;
+		if (tracks[i].GetCount() > 0) {
+			const gpx::TPoint& start = tracks[i].GetStartPoint();
+			avgStart[0] += start.x;
+			avgStart[1] += start.y;
+			avgStart[2] += start.h;
 		}
 	}
 	if (tracks.size() > 0) {
@@ -925,142 +1976,700 @@ bool CAnimController::Prepare(GLsizei width, GLsizei height)
 	}
 	*/
 
-	/*
-	std::vector<GLfloat> vertices;
-	tracks[0].GetVertices(false, offset, scale, vertices);
-	vis.SetPolygon(vertices);
-	vis.AddToBackground();
-	vertices.clear();
-	vertices.push_back(0.0f);
-	vertices.push_back(0.0f);
-	vertices.push_back(0.75f);
-	vertices.push_back(0.5f);
-	vertices.push_back(1.0f);
-	vertices.push_back(1.0f);
-	vertices.push_back(0.05f);
-	vertices.push_back(0.95f);
-	vertices.push_back(0.95f);
-	vertices.push_back(0.05f);
-	vis.SetPolygon(vertices);
-	*/
-	prepared = true;
+	/*
+	std::vector<GLfloat> vertices;
+	tracks[0].GetVertices(false, offset, scale, vertices);
+	vis.SetPolygon(vertices);
+	vis.AddToBackground();
+	vertices.clear();
+	vertices.push_back(0.0f);
+	vertices.push_back(0.0f);
+	vertices.push_back(0.75f);
+	vertices.push_back(0.5f);
+	vertices.push_back(1.0f);
+	vertices.push_back(1.0f);
+	vertices.push_back(0.05f);
+	vertices.push_back(0.95f);
+	vertices.push_back(0.95f);
+	vertices.push_back(0.05f);
+	vis.SetPolygon(vertices);
+	*/
+	if (pyramid.IsOpen()) {
+		pyramid.Synchronize(tracks);
+	}
+	prepared = true;
+	return true;
+}
+
+void CAnimController::UpdateTrack(size_t idx)
+{
+	// read ahead only when the tracks come in order
+	LoadTrackAhead(idx, (idx == lastUpdatedTrack + 1) ? tracks.size() : idx + 1);
+	lastUpdatedTrack = idx;
+	std::vector<GLuint> data;
+	double trackOrigin[2];
+	double trackExtent[2];
+	tracks[idx].GetEncodedVertices(animCfg.vertexEncoding, offset, scale, data, trackOrigin, trackExtent);
+	vis.SetPolygon(data, animCfg.vertexEncoding, trackOrigin, trackExtent, tracks[idx].GetSegments());
+}
+
+void CAnimController::RestoreHistoryUpTo(size_t idx, bool history, bool neighborhood)
+{
+	size_t cnt = tracks.size();
+	if (animCfg.progressiveHistory && !synchronousHistory && (history || neighborhood)) {
+		// the other stage is cleared right away, as below
+		size_t range[2][2] = {{0, 0}, {0, 0}};
+		size_t end = std::min(idx, cnt);
+		if (history) {
+			range[0][1] = end;
+		} else {
+			vis.ClearHistory();
+		}
+		if (neighborhood) {
+			range[1][1] = end;
+		} else {
+			vis.ClearNeighborHood();
+		}
+		if (BeginProgressiveRestoreRange((history ? CVis::STAGE_BACKGROUND : 0) | (neighborhood ? CVis::STAGE_NEIGHBORHOOD : 0), range, false)) {
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			return;
+		}
+	}
+	vis.Clear();
+
+	if (cnt > 0) {
+		if (idx > cnt) {
+			idx = cnt;
+		}
+		for (size_t i=0; i<idx; i++) {
+			UpdateTrack(i);
+			if (history && neighborhood) {
+				vis.AddToBackground();
+			} else if (history) {
+				vis.AddLineToBackground();
+			} else if (neighborhood) {
+				vis.AddLineToNeighborhood();
+			}
+		}
+		UpdateTrack(curTrack);
+	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+void CAnimController::RestoreHistory(bool history, bool neighborhood)
+{
+	bool tryPyramid = true;
+	if (animCfg.progressiveHistory && !synchronousHistory) {
+		// the pyramid tiles are quick, the tracks are drawn over the next frames
+		if (history && RestoreHistoryFromPyramid()) {
+			history = false;
+		}
+		tryPyramid = false;
+		if ((history || neighborhood) && BeginProgressiveRestore(history, neighborhood, false)) {
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			return;
+		}
+	}
+	RestoreHistoryInternal(history, neighborhood, tryPyramid);
+}
+
+void CAnimController::RestoreHistoryInternal(bool history, bool neighborhood, bool tryPyramid)
+{
+	size_t cnt = tracks.size();
+	size_t idx = curTrack;
+	if (history && neighborhood) {
+		vis.Clear();
+	} else if (history) {
+		vis.ClearHistory();
+	} else if (neighborhood) {
+		vis.ClearNeighborHood();
+	}
+
+	if (cnt > 0) {
+		if (idx > cnt) {
+			idx = cnt;
+		}
+		if (history && tryPyramid && RestoreHistoryFromPyramid()) {
+			history = false;
+		}
+		if (history && (animCfg.historyBackend == HISTORY_BACKEND_COMPUTE) && vis.SupportsHistoryBatch()) {
+			size_t first, end;
+			GetBackgroundRange(animCfg.historyMode, idx, first, end);
+			RestoreHistoryCompute(first, end);
+			history = false;
+		}
+		if (history && (animCfg.historyBackend == HISTORY_BACKEND_CPU) && vis.SupportsHistoryImage()) {
+			size_t first, end;
+			GetBackgroundRange(animCfg.historyMode, idx, first, end);
+			RestoreHistoryCPU(first, end);
+			history = false;
+		}
+		if (history && neighborhood && (animCfg.historyMode == animCfg.neighborhoodMode) ) {
+			switch (animCfg.historyMode) {
+				case BACKGROUND_UPTO:
+					for (size_t i=0; i<idx; i++) {
+						UpdateTrack(i);
+						vis.AddToBackground();
+					}
+					break;
+				case BACKGROUND_ALL:
+					for (size_t i=0; i<tracks.size(); i++) {
+						UpdateTrack(i);
+						vis.AddToBackground();
+					}
+					break;
+				case BACKGROUND_CURRENT:
+					UpdateTrack(curTrack);
+					vis.AddToBackground();
+					break;
+				case BACKGROUND_NONE:
+				default:
+					(void)0;
+			}
+		} else {
+		       	if (history) {
+				switch (animCfg.historyMode) {
+					case BACKGROUND_UPTO:
+						for (size_t i=0; i<idx; i++) {
+							UpdateTrack(i);
+							vis.AddLineToBackground();
+						}
+						break;
+					case BACKGROUND_ALL:
+						for (size_t i=0; i<tracks.size(); i++) {
+							UpdateTrack(i);
+							vis.AddLineToBackground();
+						}
+						break;
+					case BACKGROUND_CURRENT:
+						UpdateTrack(curTrack);
+						vis.AddLineToBackground();
+						break;
+					case BACKGROUND_NONE:
+					default:
+						(void)0;
+				}
+			}
+			if (neighborhood) {
+				switch (animCfg.neighborhoodMode) {
+					case BACKGROUND_UPTO:
+						for (size_t i=0; i<idx; i++) {
+							UpdateTrack(i);
+							vis.AddLineToNeighborhood();
+						}
+						break;
+					case BACKGROUND_ALL:
+						for (size_t i=0; i<tracks.size(); i++) {
+							UpdateTrack(i);
+							vis.AddLineToNeighborhood();
+						}
+						break;
+					case BACKGROUND_CURRENT:
+						UpdateTrack(curTrack);
+						vis.AddLineToNeighborhood();
+						break;
+					case BACKGROUND_NONE:
+					default:
+						(void)0;
+				}
+			}
+		}
+		UpdateTrack(curTrack);
+	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+void CAnimController::RefreshStages(unsigned stages, bool reproject)
+{
+	bool history = (stages & CVis::STAGE_BACKGROUND) != 0;
+	bool neighborhood = (stages & CVis::STAGE_NEIGHBORHOOD) != 0;
+
+	if (history && RestoreHistoryFromPyramid()) {
+		// complete already, only the rest needs a rebuild
+		history = false;
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	}
+	if (history || neighborhood) {
+		if (animCfg.progressiveHistory && !synchronousHistory && BeginProgressiveRestore(history, neighborhood, reproject)) {
+			// against the old neighborhood until the rebuild is done
+			RefreshCurrentTrack(false);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			return;
+		}
+		// the pyramid was tried above already
+		RestoreHistoryInternal(history, neighborhood, false);
+	}
+	if (stages & (CVis::STAGE_BACKGROUND | CVis::STAGE_NEIGHBORHOOD | CVis::STAGE_TRACK)) {
+		RefreshCurrentTrack(history);
+	}
+	// STAGE_FINAL: MixTrackAndBackground runs in every UpdateStep
+}
+
+void CAnimController::GetBackgroundRange(TBackgroundMode mode, size_t idx, size_t& first, size_t& end) const
+{
+	first = 0;
+	end = 0;
+	switch (mode) {
+		case BACKGROUND_UPTO:
+			end = idx;
+			break;
+		case BACKGROUND_ALL:
+			end = tracks.size();
+			break;
+		case BACKGROUND_CURRENT:
+			if (curTrack < tracks.size()) {
+				first = curTrack;
+				end = curTrack + 1;
+			}
+			break;
+		case BACKGROUND_NONE:
+		default:
+			(void)0;
+	}
+}
+
+bool CAnimController::BeginProgressiveRestore(bool history, bool neighborhood, bool reproject)
+{
+	unsigned stages = (history ? CVis::STAGE_BACKGROUND : 0) | (neighborhood ? CVis::STAGE_NEIGHBORHOOD : 0);
+	size_t idx = (curTrack < tracks.size()) ? curTrack : tracks.size();
+	size_t range[2][2];
+
+	// the same state as RestoreHistoryInternal() followed by RefreshCurrentTrack(true)
+	GetBackgroundRange(history ? animCfg.historyMode : BACKGROUND_NONE, idx, range[0][0], range[0][1]);
+	if (history && (animCfg.historyMode == BACKGROUND_UPTO) && (curPhase >= PHASE_FADEOUT) && (idx < tracks.size())) {
+		range[0][1] = idx + 1;
+	}
+	GetBackgroundRange(neighborhood ? animCfg.neighborhoodMode : BACKGROUND_NONE, idx, range[1][0], range[1][1]);
+	return BeginProgressiveRestoreRange(stages, range, reproject);
+}
+
+bool CAnimController::BeginProgressiveRestoreRange(unsigned stages, const size_t range[2][2], bool reproject)
+{
+	if (!vis.BeginRebuild(stages, reproject)) {
+		return false;
+	}
+	for (int j=0; j<2; j++) {
+		restoreRange[j][0] = range[j][0];
+		restoreRange[j][1] = range[j][1];
+	}
+	restoreBegin = std::min(restoreRange[0][0], restoreRange[1][0]);
+	restoreNext = restoreBegin;
+	return true;
+}
+
+void CAnimController::ContinueProgressiveRestore()
+{
+	unsigned stages = vis.GetRebuildStages();
+	if (!stages) {
+		return;
+	}
+
+	bool history = (stages & CVis::STAGE_BACKGROUND) != 0;
+	bool neighborhood = (stages & CVis::STAGE_NEIGHBORHOOD) != 0;
+	bool compute = history && (animCfg.historyBackend == HISTORY_BACKEND_COMPUTE) && vis.SupportsHistoryBatch();
+	bool cpu = history && (animCfg.historyBackend == HISTORY_BACKEND_CPU) && vis.SupportsHistoryImage();
+	size_t last = std::max(history ? restoreRange[0][1] : 0, neighborhood ? restoreRange[1][1] : 0);
+	double budget = synchronousHistory ? -1.0 : animCfg.progressiveBudget;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool drawn = false;
+
+	// Draw slices of tracks until the budget is used up. The budget covers
+	// the GPU work, so each slice is waited for with a fence. There is at
+	// least one slice per frame.
+	while (restoreNext < last && vis.BeginBuildDraw(stages)) {
+		size_t end = std::min(restoreNext + std::max(animCfg.progressiveTracks, (size_t)1), last);
+		if (compute) {
+			RestoreHistoryCompute(std::max(restoreNext, restoreRange[0][0]), std::min(end, restoreRange[0][1]));
+		} else if (cpu) {
+			RestoreHistoryCPU(std::max(restoreNext, restoreRange[0][0]), std::min(end, restoreRange[0][1]));
+		}
+		for (size_t i=restoreNext; i<end; i++) {
+			bool h = history && !compute && !cpu && (i >= restoreRange[0][0]) && (i < restoreRange[0][1]);
+			bool n = neighborhood && (i >= restoreRange[1][0]) && (i < restoreRange[1][1]);
+			if (h || n) {
+				UpdateTrack(i);
+				if (h) {
+					vis.AddLineToBackground();
+				}
+				if (n) {
+					vis.AddLineToNeighborhood();
+				}
+			}
+		}
+		vis.EndBuildDraw();
+		restoreNext = end;
+		drawn = true;
+		if (budget >= 0.0) {
+			GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (elapsed < budget) {
+				glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, (GLuint64)((budget - elapsed) * 1.0e6));
+				elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+			glDeleteSync(fence);
+			if (elapsed >= budget) {
+				break;
+			}
+		}
+	}
+	if (drawn) {
+		UpdateTrack(curTrack);
+	}
+	if (restoreNext >= last) {
+		vis.FinishRebuild();
+		RefreshCurrentTrack(false);
+	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+float CAnimController::GetRestoreProgress() const
+{
+	unsigned stages = vis.GetRebuildStages();
+	if (!stages) {
+		return 1.0f;
+	}
+	size_t last = std::max((stages & CVis::STAGE_BACKGROUND) ? restoreRange[0][1] : 0,
+	                       (stages & CVis::STAGE_NEIGHBORHOOD) ? restoreRange[1][1] : 0);
+	if (last <= restoreBegin) {
+		return 1.0f;
+	}
+	return (float)(restoreNext - restoreBegin) / (float)(last - restoreBegin);
+}
+
+void CAnimController::SetSynchronousHistory(bool enabled)
+{
+	synchronousHistory = enabled;
+}
+
+bool CAnimController::RestoreHistoryCompute(size_t first, size_t end)
+{
+	// all tracks of the history at once, in batches to limit the
+	// size of the buffers
+	const size_t maxBatchVertices = 4*1024*1024;
+	if (first >= end) {
+		return false;
+	}
+
+	CHistoryBatch batch;
+	for (size_t i=first; i<end; i++) {
+		LoadTrackAhead(i, end);
+		batch.AddTrack(tracks[i], offset, scale);
+		if ((batch.GetVertexCount() >= maxBatchVertices) || (i + 1 == end)) {
+			vis.AddHistoryBatch(batch);
+			batch.Reset();
+		}
+	}
+	return true;
+}
+
+void CAnimController::GetKmToPixelTransform(double transform[4]) const
+{
+	// mercator km to normalized data to framebuffer pixels
+	double t[4];
+	vis.GetPixelTransform(t);
+	for (int j=0; j<2; j++) {
+		transform[j] = t[j] * scale[j];
+		transform[2+j] = t[2+j] - t[j] * scale[j] * offset[j];
+	}
+}
+
+void CAnimController::GetGeoReference(gpximg::TGeoReference& geo) const
+{
+	// the outer edges of the whole view, not just of the framebuffer window
+	double t[4];
+	const GLint *viewOffset = vis.GetViewOffset();
+	GetKmToPixelTransform(t);
+	double km[4] = {
+		(-viewOffset[0] - t[2]) / t[0],
+		(-viewOffset[1] - t[3]) / t[1],
+		(vis.GetViewWidth() - viewOffset[0] - t[2]) / t[0],
+		(vis.GetViewHeight() - viewOffset[1] - t[3]) / t[1]
+	};
+	geo.epsg = 3857;
+	gpx::mercatorToWebMercator(km[0], km[1], geo.bounds[0], geo.bounds[1]);
+	gpx::mercatorToWebMercator(km[2], km[3], geo.bounds[2], geo.bounds[3]);
+}
+
+void CAnimController::GetHistoryRasterParams(THistoryRasterParams& params) const
+{
+	const CVis::TConfig& cfg = vis.GetConfig();
+	GetKmToPixelTransform(params.transform);
+	params.radius = vis.GetHistoryLineRadius();
+	params.exponent = cfg.historyExp;
+	params.additive = (cfg.historyAdditive > CVis::BACKGROUND_ADD_NONE);
+}
+
+bool CAnimController::RestoreHistoryCPU(size_t first, size_t end)
+{
+	// the whole image on the worker threads, uploaded once
+	if (first >= end) {
+		return false;
+	}
+
+	THistoryRasterParams params;
+	std::vector<float> data;
+	GetHistoryRasterParams(params);
+	RasterizeHistory(first, end, params, data);
+	vis.AddHistoryImage(data.data());
+	return true;
+}
+
+void CAnimController::RasterizeHistory(size_t first, size_t end, const THistoryRasterParams& params, std::vector<float>& data)
+{
+	// in chunks which fit into the track memory budget, each track is
+	// combined with the others on its own, so the chunks can be combined
+	// the same way
+	std::vector<float> part;
+	size_t i = first;
+	do {
+		size_t chunkEnd = GetTrackChunkEnd(i, end);
+		LoadTracks(i, chunkEnd);
+		rasterizeHistory(tracks, i, chunkEnd, params, vis.GetWidth(), vis.GetHeight(), (i == first) ? data : part);
+		if (i != first) {
+			for (size_t j=0; j<data.size(); j++) {
+				if (params.additive) {
+					data[j] += part[j];
+				} else if (part[j] > data[j]) {
+					data[j] = part[j];
+				}
+			}
+		}
+		i = chunkEnd;
+	} while (i < end);
+}
+
+bool CAnimController::ComputeHistoryDensity(std::vector<float>& data)
+{
+	if (!prepared) {
+		gpxutil::warn("history density: no tracks");
+		return false;
+	}
+	size_t first, end;
+	THistoryRasterParams params;
+	GetBackgroundRange(animCfg.historyMode, std::min(curTrack, tracks.size()), first, end);
+	GetHistoryRasterParams(params);
+	RasterizeHistory(first, end, params, data);
+	return true;
+}
+
+void CAnimController::GetHistoryPyramidParams(TPyramidParams& params, int levels) const
+{
+	// the normalization scale is the same in x and y, see Prepare(). Level
+	// 0 gets the next power of two of the resolution at zoom 1, so that the
+	// tiles stay valid when tracks are added and the data bounds grow.
+	const CVis::TConfig& cfg = vis.GetConfig();
+	double kmPerPixel = 1.0 / (scale[0] * vis.GetPixelsPerUnit());
+	params.kmPerPixel = ldexp(1.0, (int)ceil(log2(kmPerPixel)));
+	params.tileSize = 256;
+	params.levels = levels;
+	params.radius = vis.GetHistoryLineRadius();
+	params.exponent = cfg.historyExp;
+	params.additive = (cfg.historyAdditive > CVis::BACKGROUND_ADD_NONE);
+}
+
+bool CAnimController::OpenHistoryPyramid(const char *dir)
+{
+	if (!pyramid.Open(dir)) {
+		return false;
+	}
+	if (prepared) {
+		pyramid.Synchronize(tracks);
+	}
 	return true;
 }
 
-void CAnimController::UpdateTrack(size_t idx)
+bool CAnimController::UpdateHistoryPyramid(int levels)
 {
-	std::vector<GLfloat> vertices;
-	tracks[idx].GetVertices(false, offset, scale, vertices);
-	vis.SetPolygon(vertices);
+	if (!pyramid.IsOpen() || !prepared) {
+		gpxutil::warn("history pyramid: not open or no tracks");
+		return false;
+	}
+	if (levels < 1) {
+		levels = pyramid.GetParams().levels;
+	}
+	TPyramidParams params;
+	GetHistoryPyramidParams(params, levels);
+	pyramid.Synchronize(tracks);
+	if (!pyramid.HasOutdatedRegions() && pyramid.GetParams().Matches(params)) {
+		return true;
+	}
+	// the tiles need all of the tracks at once, the budget only applies afterwards
+	LoadTracks(0, tracks.size());
+	bool success = pyramid.Update(tracks, params);
+	EvictTracks(trackUseCounter + 1);
+	return success;
 }
 
-void CAnimController::RestoreHistoryUpTo(size_t idx, bool history, bool neighborhood)
+float CAnimController::GetHistoryPyramidZoom(float zoomFactor, bool notLarger) const
 {
-	size_t cnt = tracks.size();
-	vis.Clear();
+	const TPyramidParams& params = pyramid.GetParams();
+	if (!prepared || !params.IsValid() || zoomFactor <= 0.0f) {
+		return zoomFactor;
+	}
+	// level L matches at the zoom where kmPerPixel / zoom == params.kmPerPixel / 2^L
+	double kmPerPixel = 1.0 / (scale[0] * vis.GetPixelsPerUnit());
+	double base = kmPerPixel / params.kmPerPixel;
+	double level = log2((double)zoomFactor / base);
+	level = notLarger ? floor(level + 1e-3) : floor(level + 0.5);
+	level = std::max(0.0, std::min(level, (double)(params.levels - 1)));
+	return (float)ldexp(base, (int)level);
+}
 
-	if (cnt > 0) {
-		if (idx > cnt) {
-			idx = cnt;
+bool CAnimController::RestoreHistoryFromPyramid()
+{
+	const CVis::TConfig& cfg = vis.GetConfig();
+	if (!animCfg.historyPyramid || !pyramid.IsOpen() || (animCfg.historyMode != BACKGROUND_ALL) || !cfg.historyWideLine || !vis.SupportsHistoryTiles()) {
+		return false;
+	}
+	TPyramidParams current;
+	GetHistoryPyramidParams(current, 1);
+	if (!pyramid.GetParams().HasSameLines(current)) {
+		return false;
+	}
+	double kmPerPixel = 1.0 / (scale[0] * vis.GetPixelsPerUnit() * cfg.zoomFactor);
+	int level = pyramid.FindLevel(kmPerPixel, 0.01);
+	if (level < 0) {
+		return false;
+	}
+
+	// the visible part of the data, in km
+	static const GLfloat viewCorners[2][2] = {{0.0f, 0.0f}, {1.0f, 1.0f}};
+	double rect[4];
+	for (int k=0; k<2; k++) {
+		GLfloat posNormalized[2];
+		double pos[2];
+		vis.TransformToPos(viewCorners[k], posNormalized);
+		TransformToPos(posNormalized, pos);
+		rect[2*k] = pos[0];
+		rect[2*k+1] = pos[1];
+	}
+	if (!pyramid.IsUpToDate(level, rect)) {
+		return false;
+	}
+
+	// all tiles are read before the history is touched, so that
+	// the caller can draw it the usual way if one of them fails
+	std::vector<TPyramidTile> tiles;
+	pyramid.GetTiles(level, rect, tiles);
+	std::vector<std::vector<float>> data(tiles.size());
+	for (size_t i=0; i<tiles.size(); i++) {
+		if (!pyramid.LoadTile(tiles[i], data[i])) {
+			return false;
 		}
-		for (size_t i=0; i<idx; i++) {
-			UpdateTrack(i);
-			if (history && neighborhood) {
-				vis.AddToBackground();
-			} else if (history) {
-				vis.AddLineToBackground();
-			} else if (neighborhood) {
-				vis.AddLineToNeighborhood();
-			}
+	}
+	vis.ClearHistory();
+	for (size_t i=0; i<tiles.size(); i++) {
+		double tileRect[4];
+		pyramid.GetTileRect(tiles[i], tileRect);
+		for (int j=0; j<4; j++) {
+			tileRect[j] = (tileRect[j] - offset[j&1]) * scale[j&1];
 		}
-		UpdateTrack(curTrack);
+		vis.AddHistoryTile(tileRect, (GLsizei)pyramid.GetParams().tileSize, data[i].data());
 	}
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	gpxutil::info("history from pyramid level %d: %u tiles", level, (unsigned)tiles.size());
+	return true;
 }
 
-void CAnimController::RestoreHistory(bool history, bool neighborhood)
+bool CAnimController::RenderTiled(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype)
 {
-	size_t cnt = tracks.size();
-	size_t idx = curTrack;
-	vis.Clear();
+	return RenderTiledInternal(fullWidth, fullHeight, maxTileSize, filename, filetype, false);
+}
 
-	if (cnt > 0) {
-		if (idx > cnt) {
-			idx = cnt;
-		}
-		if (history && neighborhood && (animCfg.historyMode == animCfg.neighborhoodMode) ) {
-			switch (animCfg.historyMode) {
-				case BACKGROUND_UPTO:
-					for (size_t i=0; i<idx; i++) {
-						UpdateTrack(i);
-						vis.AddToBackground();
-					}
-					break;
-				case BACKGROUND_ALL:
-					for (size_t i=0; i<tracks.size(); i++) {
-						UpdateTrack(i);
-						vis.AddToBackground();
-					}
-					break;
-				case BACKGROUND_CURRENT:
-					UpdateTrack(curTrack);
-					vis.AddToBackground();
-					break;
-				case BACKGROUND_NONE:
-				default:
-					(void)0;
-			}
+bool CAnimController::RenderHistoryDensityTiled(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype)
+{
+	return RenderTiledInternal(fullWidth, fullHeight, maxTileSize, filename, filetype, true);
+}
+
+bool CAnimController::RenderTiledInternal(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype, bool density)
+{
+	if (!prepared) {
+		gpxutil::warn("tiled rendering: anim controller not prepared");
+		return false;
+	}
+	if (fullWidth < 1 || fullHeight < 1) {
+		gpxutil::warn("tiled rendering: invalid size %dx%d", (int)fullWidth, (int)fullHeight);
+		return false;
+	}
+
+	// Each tile is rendered with a guard band around it, so that lines
+	// just outside of the tile still contribute to its pixels. Only the
+	// core of the tile goes into the image.
+	GLsizei oldWidth = vis.GetWidth();
+	GLsizei oldHeight = vis.GetHeight();
+	vis.SetRenderWindow(fullWidth, fullHeight, 0, 0);
+	GLsizei guard = vis.GetGuardBand();
+	GLsizei core = maxTileSize - 2 * guard;
+	if (core < 16) {
+		gpxutil::warn("tiled rendering: tile size %d too small for guard band %d", (int)maxTileSize, (int)guard);
+		vis.ResetRenderWindow();
+		return false;
+	}
+	GLsizei coreWidth = std::min(fullWidth, core);
+	GLsizei coreHeight = std::min(fullHeight, core);
+	gpxutil::info("tiled rendering: %dx%d in tiles of %dx%d, guard band %d",
+		(int)fullWidth, (int)fullHeight, (int)coreWidth, (int)coreHeight, (int)guard);
+
+	// the density is a single float channel, read back before the track is drawn
+	gpximg::CImgStreamWriter writer;
+	gpximg::TGeoReference geo;
+	size_t pixelSize = density ? sizeof(GLfloat) : 3;
+	GetGeoReference(geo);
+	bool success = vis.InitializeGL(coreWidth + 2 * guard, coreHeight + 2 * guard, vis.GetDataAspect());
+	if (success) {
+		if (density) {
+			success = writer.Open(filename, filetype, (int)fullWidth, (int)fullHeight, 1, gpximg::SAMPLE_FLOAT32, &geo);
 		} else {
-		       	if (history) {
-				switch (animCfg.historyMode) {
-					case BACKGROUND_UPTO:
-						for (size_t i=0; i<idx; i++) {
-							UpdateTrack(i);
-							vis.AddLineToBackground();
-						}
-						break;
-					case BACKGROUND_ALL:
-						for (size_t i=0; i<tracks.size(); i++) {
-							UpdateTrack(i);
-							vis.AddLineToBackground();
-						}
-						break;
-					case BACKGROUND_CURRENT:
-						UpdateTrack(curTrack);
-						vis.AddLineToBackground();
-						break;
-					case BACKGROUND_NONE:
-					default:
-						(void)0;
-				}
-			}
-			if (neighborhood) {
-				switch (animCfg.neighborhoodMode) {
-					case BACKGROUND_UPTO:
-						for (size_t i=0; i<idx; i++) {
-							UpdateTrack(i);
-							vis.AddLineToNeighborhood();
-						}
-						break;
-					case BACKGROUND_ALL:
-						for (size_t i=0; i<tracks.size(); i++) {
-							UpdateTrack(i);
-							vis.AddLineToNeighborhood();
-						}
-						break;
-					case BACKGROUND_CURRENT:
-						UpdateTrack(curTrack);
-						vis.AddLineToNeighborhood();
-						break;
-					case BACKGROUND_NONE:
-					default:
-						(void)0;
-				}
+			success = writer.Open(filename, filetype, (int)fullWidth, (int)fullHeight, 3, gpximg::SAMPLE_UINT8, &geo);
+		}
+	}
+
+	// one band of tiles, the GL delivers the rows bottom-up
+	std::vector<GLfloat> band; // floats keep the density aligned, the RGB bytes don't care
+	size_t rowSize = (size_t)fullWidth * pixelSize;
+	if (success) {
+		band.resize((rowSize * (size_t)coreHeight + sizeof(GLfloat) - 1) / sizeof(GLfloat));
+	}
+	unsigned char *bandData = (unsigned char*)band.data();
+	size_t bandSize = band.size() * sizeof(GLfloat);
+	for (GLsizei top = 0; success && top < fullHeight; top += coreHeight) {
+		GLsizei rows = std::min(coreHeight, fullHeight - top);
+		GLint bottom = fullHeight - top - rows;
+		for (GLsizei left = 0; success && left < fullWidth; left += coreWidth) {
+			GLsizei cols = std::min(coreWidth, fullWidth - left);
+			vis.SetRenderWindow(fullWidth, fullHeight, left - guard, bottom - guard);
+			// never progressive, the tile is read back right away
+			if (density) {
+				RestoreHistoryInternal(true, false, true);
+				success = vis.GetHistoryRows(guard, guard, cols, rows, fullWidth, band.data() + left, band.size() - left);
+			} else {
+				RestoreHistoryInternal(true, true, true);
+				vis.DrawTrack(curTrackUpTo);
+				vis.MixTrackAndBackground(1.0f - curFadeRatio);
+				success = vis.GetImageRows(guard, guard, cols, rows, fullWidth, bandData + (size_t)left * 3, bandSize - (size_t)left * 3);
 			}
 		}
-		UpdateTrack(curTrack);
+		for (GLsizei r = rows - 1; success && r >= 0; r--) {
+			success = writer.WriteRows(bandData + (size_t)r * rowSize, 1);
+		}
+		gpxutil::info("tiled rendering: %d of %d rows", (int)(top + rows), (int)fullHeight);
 	}
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	if (writer.IsOpen() && !writer.Close()) {
+		success = false;
+	}
+
+	// back to normal
+	vis.ResetRenderWindow();
+	if (oldWidth > 0 && oldHeight > 0) {
+		vis.InitializeGL(oldWidth, oldHeight, vis.GetDataAspect());
+		RestoreHistoryInternal(true, true, true);
+		vis.DrawTrack(curTrackUpTo);
+		vis.MixTrackAndBackground(1.0f - curFadeRatio);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	}
+	if (!success) {
+		gpxutil::warn("tiled rendering to '%s' failed", filename);
+	}
+	return success;
 }
 
 void CAnimController::DropGL()
@@ -1075,6 +2684,7 @@ bool CAnimController::UpdateStep(double timeDelta)
 	if (!prepared) {
 		return false;
 	}
+	ContinueProgressiveRestore();
 	/*
 	vis.DrawTrack(-1.0f);
 	vis.MixTrackAndBackground(1.0f);
@@ -1545,6 +3155,10 @@ bool CAnimController::RemoveDuplicateTracks()
 		const gpx::CTrack &t = tracks[i];
 		bool keep = true;
 		for (size_t j=0; j<i; j++) {
+			if (t.GetCount() == tracks[j].GetCount() && gpx::IsEqual(t.GetStartPoint(), tracks[j].GetStartPoint())) {
+				// only the points can tell these apart
+				LoadTracks(std::vector<size_t>{i, j});
+			}
 			if (IsEqual(t, tracks[j])) {
 				keep = false;
 				gpxutil::warn("'%s' is duplicate of '%s', removed", t.GetInfo(), tracks[j].GetInfo());
@@ -1595,6 +3209,230 @@ bool CAnimController::StatsToCSV(const char *filename) const
 	return success;
 }
 
+/****************************************************************************
+ * CONFIGURATION FILES                                                      *
+ ****************************************************************************/
+
+typedef enum {
+	CONFIG_FLOAT,
+	CONFIG_DOUBLE,
+	CONFIG_INT,  // also the enums, which are all based on int
+	CONFIG_SIZE,
+	CONFIG_BOOL
+} TConfigFieldType;
+
+typedef struct {
+	const char *name;
+	TConfigFieldType type;
+	int count;
+	size_t offset;
+	int minValue; // the range of a CONFIG_INT, unchecked if minValue > maxValue
+	int maxValue;
+} TConfigField;
+
+#define CONFIG_FIELD(s, name, type, count) {#name, type, count, offsetof(s, name), 0, -1}
+#define CONFIG_ENUM(s, name, first, last) {#name, CONFIG_INT, 1, offsetof(s, name), first, last}
+
+static const TConfigField visConfigFields[] = {
+	CONFIG_FIELD(CVis::TConfig, colorBackground, CONFIG_FLOAT, 4),
+	CONFIG_FIELD(CVis::TConfig, colorBase, CONFIG_FLOAT, 4),
+	CONFIG_FIELD(CVis::TConfig, colorHistoryAdd, CONFIG_FLOAT, 4),
+	CONFIG_FIELD(CVis::TConfig, colorGradient, CONFIG_FLOAT, 16),
+	CONFIG_FIELD(CVis::TConfig, trackWidth, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, trackExp, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, trackPointWidth, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, trackPointExp, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, historyWidth, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, historyExp, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, neighborhoodWidth, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, neighborhoodExp, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, zoomFactor, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, centerNormalized, CONFIG_FLOAT, 2),
+	CONFIG_FIELD(CVis::TConfig, historyWideLine, CONFIG_BOOL, 1),
+	CONFIG_ENUM(CVis::TConfig, historyAdditive, CVis::BACKGROUND_ADD_NONE, CVis::BACKGROUND_ADD_GRADIENT),
+	CONFIG_FIELD(CVis::TConfig, historyAddExp, CONFIG_FLOAT, 1),
+	CONFIG_FIELD(CVis::TConfig, historyAddSaturationOffset, CONFIG_FLOAT, 1),
+};
+
+static const TConfigField animConfigFields[] = {
+	CONFIG_ENUM(CAnimController::TAnimConfig, mode, CAnimController::ANIM_MODE_TRACK, CAnimController::ANIM_MODE_HISTORY),
+	CONFIG_FIELD(CAnimController::TAnimConfig, animDeltaPerFrame, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, trackSpeed, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, fadeoutTime, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, fadeinTime, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, endTime, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, paused, CONFIG_BOOL, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, pauseAtCycle, CONFIG_BOOL, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, clearAtCycle, CONFIG_BOOL, 1),
+	CONFIG_ENUM(CAnimController::TAnimConfig, historyMode, CAnimController::BACKGROUND_NONE, CAnimController::BACKGROUND_ALL),
+	CONFIG_ENUM(CAnimController::TAnimConfig, neighborhoodMode, CAnimController::BACKGROUND_NONE, CAnimController::BACKGROUND_ALL),
+	CONFIG_FIELD(CAnimController::TAnimConfig, adjustToAspect, CONFIG_BOOL, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, resolutionGranularity, CONFIG_INT, 1),
+	CONFIG_ENUM(CAnimController::TAnimConfig, accuMode, CAnimController::ACCU_COUNT, CAnimController::ACCU_YEAR),
+	CONFIG_FIELD(CAnimController::TAnimConfig, accuCount, CONFIG_SIZE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, accuWeekDayStart, CONFIG_INT, 1),
+	CONFIG_ENUM(CAnimController::TAnimConfig, vertexEncoding, gpx::VERTEX_ENCODING_FLOAT, gpx::VERTEX_ENCODING_UNORM16),
+	CONFIG_ENUM(CAnimController::TAnimConfig, historyBackend, CAnimController::HISTORY_BACKEND_RASTER, CAnimController::HISTORY_BACKEND_CPU),
+	CONFIG_FIELD(CAnimController::TAnimConfig, progressiveHistory, CONFIG_BOOL, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, progressiveBudget, CONFIG_DOUBLE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, progressiveTracks, CONFIG_SIZE, 1),
+	CONFIG_FIELD(CAnimController::TAnimConfig, historyPyramid, CONFIG_BOOL, 1),
+};
+
+#undef CONFIG_FIELD
+#undef CONFIG_ENUM
+
+static void writeConfigFields(FILE *file, const char *section, const TConfigField *fields, size_t fieldCount, const void *data)
+{
+	fprintf(file, "[%s]\n", section);
+	for (size_t i=0; i<fieldCount; i++) {
+		const unsigned char *ptr = (const unsigned char*)data + fields[i].offset;
+		fprintf(file, "%s =", fields[i].name);
+		for (int j=0; j<fields[i].count; j++) {
+			// enough digits to read back the same values
+			switch (fields[i].type) {
+				case CONFIG_FLOAT:
+					fprintf(file, " %.9g", (double)((const GLfloat*)ptr)[j]);
+					break;
+				case CONFIG_DOUBLE:
+					fprintf(file, " %.17g", ((const double*)ptr)[j]);
+					break;
+				case CONFIG_INT:
+					fprintf(file, " %d", ((const int*)ptr)[j]);
+					break;
+				case CONFIG_SIZE:
+					fprintf(file, " %llu", (unsigned long long)((const size_t*)ptr)[j]);
+					break;
+				default:
+					fprintf(file, " %d", ((const bool*)ptr)[j] ? 1 : 0);
+			}
+		}
+		fputc('\n', file);
+	}
+}
+
+static bool readConfigFields(const char *filename, const gpxutil::TIniSection& section, const TConfigField *fields, size_t fieldCount, void *data)
+{
+	for (size_t e=0; e<section.entries.size(); e++) {
+		const gpxutil::TIniEntry& entry = section.entries[e];
+		size_t i;
+		for (i=0; i<fieldCount; i++) {
+			if (entry.key == fields[i].name) {
+				break;
+			}
+		}
+		if (i >= fieldCount) {
+			gpxutil::warn("%s:%d: unknown setting '%s' ignored", filename, entry.line, entry.key.c_str());
+			continue;
+		}
+
+		double values[16];
+		const char *pos = entry.value.c_str();
+		int count;
+		for (count=0; count<fields[i].count; count++) {
+			char *end;
+			values[count] = strtod(pos, &end);
+			if (end == pos) {
+				break;
+			}
+			pos = end;
+		}
+		while (isspace((unsigned char)*pos)) {
+			pos++;
+		}
+		if (count != fields[i].count || *pos) {
+			gpxutil::warn("%s:%d: '%s' needs %d numbers", filename, entry.line, entry.key.c_str(), fields[i].count);
+			return false;
+		}
+
+		if (fields[i].type == CONFIG_INT && fields[i].minValue <= fields[i].maxValue &&
+		    (values[0] < fields[i].minValue || values[0] > fields[i].maxValue)) {
+			gpxutil::warn("%s:%d: '%s' must be in %d..%d", filename, entry.line, entry.key.c_str(), fields[i].minValue, fields[i].maxValue);
+			return false;
+		}
+
+		unsigned char *ptr = (unsigned char*)data + fields[i].offset;
+		for (int j=0; j<count; j++) {
+			switch (fields[i].type) {
+				case CONFIG_FLOAT:
+					((GLfloat*)ptr)[j] = (GLfloat)values[j];
+					break;
+				case CONFIG_DOUBLE:
+					((double*)ptr)[j] = values[j];
+					break;
+				case CONFIG_INT:
+					((int*)ptr)[j] = (int)values[j];
+					break;
+				case CONFIG_SIZE:
+					((size_t*)ptr)[j] = (size_t)values[j];
+					break;
+				default:
+					((bool*)ptr)[j] = (values[j] != 0.0);
+			}
+		}
+	}
+	return true;
+}
+
+bool CAnimController::SaveConfig(const char *filename) const
+{
+	FILE *file = gpxutil::fopen_wrapper(filename, "wt");
+	if (!file) {
+		gpxutil::warn("failed to open \"%s\" for writing", filename);
+		return false;
+	}
+	fprintf(file, "# gpxvis configuration\n");
+	writeConfigFields(file, "vis", visConfigFields, sizeof(visConfigFields)/sizeof(visConfigFields[0]), &vis.GetConfig());
+	writeConfigFields(file, "anim", animConfigFields, sizeof(animConfigFields)/sizeof(animConfigFields[0]), &animCfg);
+	if (fclose(file)) {
+		gpxutil::warn("I/O error writing config to \"%s\"", filename);
+		return false;
+	}
+	gpxutil::info("wrote config to \"%s\"", filename);
+	return true;
+}
+
+bool CAnimController::LoadConfig(const char *filename)
+{
+	std::vector<gpxutil::TIniSection> sections;
+	if (!gpxutil::readIniFile(filename, sections)) {
+		return false;
+	}
+
+	// nothing changes unless the whole file is valid
+	CVis::TConfig newVisCfg = vis.GetConfig();
+	TAnimConfig newAnimCfg = animCfg;
+	for (size_t i=0; i<sections.size(); i++) {
+		bool success = true;
+		if (sections[i].name == "vis") {
+			success = readConfigFields(filename, sections[i], visConfigFields, sizeof(visConfigFields)/sizeof(visConfigFields[0]), &newVisCfg);
+		} else if (sections[i].name == "anim") {
+			success = readConfigFields(filename, sections[i], animConfigFields, sizeof(animConfigFields)/sizeof(animConfigFields[0]), &newAnimCfg);
+		} else if (!sections[i].entries.empty()) {
+			gpxutil::warn("%s: unknown section '%s' ignored", filename, sections[i].name.c_str());
+		}
+		if (!success) {
+			return false;
+		}
+	}
+	newVisCfg.ClampTransform();
+	vis.GetConfig() = newVisCfg;
+	animCfg = newAnimCfg;
+	gpxutil::info("loaded config from \"%s\"", filename);
+	return true;
+}
+
+void CAnimController::ApplyConfig()
+{
+	if (!prepared) {
+		return;
+	}
+	vis.UpdateTransform();
+	vis.UpdateConfig();
+	UpdateTrack(curTrack); // for the vertex encoding
+	RefreshStages(CVis::STAGE_ALL);
+}
+
 void CAnimController::TransformToPos(const GLfloat posNormalized[2], double pos[2]) const
 {
 	pos[0] = ((double)posNormalized[0]) / scale[0] + offset[0];
@@ -1612,7 +3450,7 @@ static bool CloserThan(const TTrackDist& a, const TTrackDist& b)
 	return (a.d < b.d);
 }
 
-void CAnimController::GetTracksAt(double x, double y, double radius, std::vector<TTrackDist>& indices, TBackgroundMode mode) const
+void CAnimController::GetTracksAt(double x, double y, double radius, std::vector<TTrackDist>& indices, TBackgroundMode mode)
 {
 	const size_t cnt = tracks.size();
 	const double r2 = radius*radius;
@@ -1638,13 +3476,39 @@ void CAnimController::GetTracksAt(double x, double y, double radius, std::vector
 			(void)0; // already set up for "all"
 	}
 
+	// only the tracks with the bounding box in range need their points
+	std::vector<size_t> candidates;
 	for (size_t i=from; i<to; i++) {
-		double d2 = tracks[i].GetDistanceSqrTo(x,y);
-		if (d2 <= r2) {
-			TTrackDist td;
-			td.idx = i;
-			td.d = sqrt(d2);
-			indices.push_back(td);
+		const double *a = tracks[i].GetAABB().Get();
+		double dx = std::max(std::max(a[0] - x, x - a[3]), 0.0);
+		double dy = std::max(std::max(a[1] - y, y - a[4]), 0.0);
+		if (dx * dx + dy * dy <= r2) {
+			candidates.push_back(i);
+		}
+	}
+
+	// in chunks which fit into the track memory budget
+	size_t k = 0;
+	while (k < candidates.size()) {
+		std::vector<size_t> chunk;
+		size_t bytes = 0;
+		for (; k<candidates.size(); k++) {
+			bytes += tracks[candidates[k]].GetPointMemory();
+			if (trackMemoryBudget && bytes > trackMemoryBudget && !chunk.empty()) {
+				break;
+			}
+			chunk.push_back(candidates[k]);
+		}
+		LoadTracks(chunk);
+		for (size_t j=0; j<chunk.size(); j++) {
+			size_t i = chunk[j];
+			double d2 = tracks[i].GetDistanceSqrTo(x,y);
+			if (d2 <= r2) {
+				TTrackDist td;
+				td.idx = i;
+				td.d = sqrt(d2);
+				indices.push_back(td);
+			}
 		}
 	}
 	std::sort(indices.begin(),indices.end(), CloserThan);
@@ -5,7 +5,10 @@
 
 #include "gpx.h"
 #include "img.h"
+#include "pyramid.h"
+#include "trackindex.h"
 
+#include <string>
 #include <vector>
 
 namespace gpxvis {
@@ -19,6 +22,41 @@ struct TTrackDist {
 	size_t idx;
 };
 
+/****************************************************************************
+ * LINES OF MANY TRACKS FOR THE COMPUTE HISTORY                             *
+ ****************************************************************************/
+
+struct THistoryChunk { // layout must match the chunk in shaders/history.cs
+	GLfloat bbox[4]; // min x, min y, max x, max y
+	GLuint  first;   // first line of a chunk (line i connects vertex i and i+1), first chunk of a group
+	GLuint  count;
+	GLuint  track;   // index of the track in the batch
+	GLuint  reserved;
+};
+
+class CHistoryBatch {
+	public:
+		static const size_t chunkLines = 32;  // max lines per chunk, must match CHUNK_LINES in shaders/history.cs
+		static const size_t groupChunks = 32; // max chunks per group, must match GROUP_CHUNKS in shaders/history.cs
+
+		CHistoryBatch();
+
+		void   Reset();
+		void   AddTrack(const gpx::CTrack& track, const double *origin, const double *scale);
+		size_t GetTrackCount() const {return trackGroups.size() - 1;}
+		size_t GetVertexCount() const {return vertices.size() / 2;}
+		size_t GetLineCount() const {return lineCount;}
+
+	private:
+		std::vector<GLfloat>       vertices;    // all tracks, 2D in the space of CTrack::GetVertices
+		std::vector<THistoryChunk> chunks;      // consecutive lines of a single segment
+		std::vector<THistoryChunk> groups;      // consecutive chunks of a single track
+		std::vector<GLuint>        trackGroups; // first group of each track, plus end marker
+		size_t                     lineCount;
+
+		friend class CVis;
+};
+
 /****************************************************************************
  * VISUALIZE A SINGLE POLYGON, MIX IT WITH THE HISTORY                      *
  ****************************************************************************/
@@ -34,6 +72,14 @@ class CVis {
 			BACKGROUND_ADD_GRADIENT,
 		} TBackgroundAdditiveMode;
 
+		typedef enum : unsigned {       // the framebuffers a config change invalidates
+			STAGE_BACKGROUND   = 0x1, // history
+			STAGE_NEIGHBORHOOD = 0x2,
+			STAGE_TRACK        = 0x4,
+			STAGE_FINAL        = 0x8,  // mixed anew in every frame anyway
+			STAGE_ALL          = 0xf
+		} TStage;
+
 		struct TConfig {
 			GLfloat colorBackground[4];
 			GLfloat colorBase[4];
@@ -60,6 +106,8 @@ class CVis {
 			void ResetWidths();
 			void ResetTransform();
 			void ClampTransform();
+			unsigned GetChangedStages(const TConfig& other) const; // TStage bits, without the transform
+			void GetZoomShift(GLfloat zoomShift[4]) const;
 		};
 
 		CVis();
@@ -74,6 +122,8 @@ class CVis {
 		void DropGL();
 
 		void SetPolygon(const std::vector<GLfloat>& vertices2D);
+		void SetPolygon(const std::vector<GLfloat>& vertices2D, const std::vector<size_t>& segmentStarts);
+		void SetPolygon(const std::vector<GLuint>& data, gpx::TVertexEncoding encoding, const double origin[2], const double extent[2], const std::vector<size_t>& segmentStarts);
 
 		void DrawTrack(float upTo, bool clear);
 		void DrawTrack(float upTo);
@@ -81,6 +131,12 @@ class CVis {
 		void DrawNeighborhood();
 
 		void AddHistory();
+		bool SupportsHistoryBatch() const; // the compute path only does the wide history lines
+		void AddHistoryBatch(const CHistoryBatch& batch);
+		bool SupportsHistoryTiles() const {return program[PROG_TILE] != 0;}
+		void AddHistoryTile(const double rectNormalized[4], GLsizei size, const GLfloat *data); // a precomputed square of the history
+		bool SupportsHistoryImage() const {return cfg.historyWideLine;} // the CPU path only does the wide history lines
+		void AddHistoryImage(const GLfloat *data); // GetWidth() x GetHeight(), bottom-up, combined with the history like AddHistory()
 		void AddToBackground();
 		void AddLineToBackground();
 		void AddLineToNeighborhood();
@@ -90,17 +146,44 @@ class CVis {
 		void ClearNeighborHood();
 		void Clear();
 
+		// Progressive rebuild of the history and neighborhood stages: they are
+		// drawn into separate targets while the old ones stay visible, and
+		// swapped in by FinishRebuild(). With reproject, the last complete
+		// state is warped to the current transform meanwhile. Clearing a
+		// stage cancels its rebuild, lines added to it are added to both.
+		bool BeginRebuild(unsigned stages, bool reproject);
+		bool BeginBuildDraw(unsigned stages); // redirect the drawing of these stages to the rebuild targets
+		void EndBuildDraw();
+		void FinishRebuild();
+		void CancelRebuild(unsigned stages);
+		unsigned GetRebuildStages() const {return rebuildStages;}
+
 		GLsizei GetWidth() const {return width;}
 		GLsizei GetHeight() const {return height;}
 		GLuint  GetImageFBO() const {return fbo[FB_FINAL];}
-		bool	GetImage(gpximg::CImg& img) const;
+		bool	GetImage(gpximg::CImg& img, bool topDown=false) const; // topDown flips on the GPU
+		bool	GetImageRows(GLint x, GLint y, GLsizei w, GLsizei h, GLsizei rowLength, unsigned char *data, size_t size) const; // RGB, bottom-up
+		bool	GetHistoryRows(GLint x, GLint y, GLsizei w, GLsizei h, GLsizei rowLength, GLfloat *data, size_t size) const; // the raw history values, bottom-up
+
+		// Render only a window of a larger view (the framebuffer placed at
+		// offset, in GL pixel coordinates). Transform and line widths are those
+		// of the whole view, see CAnimController::RenderTiled.
+		void    SetRenderWindow(GLsizei viewW, GLsizei viewH, GLint offsetX, GLint offsetY);
+		void    ResetRenderWindow() {SetRenderWindow(0, 0, 0, 0);}
+		GLsizei GetViewWidth() const {return viewWidth ? viewWidth : width;}
+		GLsizei GetViewHeight() const {return viewHeight ? viewHeight : height;}
+		const GLint *GetViewOffset() const {return viewOffset;} // of the framebuffer within the view
+		GLsizei GetGuardBand() const; // border in pixels a tile needs so that the lines crossing it are complete
 
 		const TConfig& GetConfig() const {return cfg;} // only for reading
 		TConfig& GetConfig() {return cfg;} // use UpdateConfig and/or UpdateTransform after you modified something!
-		void UpdateConfig();
-		void UpdateTransform();
+		unsigned UpdateConfig();    // returns the TStage bits invalidated since the last update
+		unsigned UpdateTransform(); // always invalidates all stages
 
 		float  GetDataAspect() const {return dataAspect;}
+		double GetPixelsPerUnit() const; // of the view per unit of the normalized data space, without the zoom
+		void GetPixelTransform(double transform[4]) const; // normalized data space to framebuffer pixels: scale x, y, offset x, y
+		float  GetHistoryLineRadius() const; // in pixels
 		void GetZoomShift(GLfloat zoomShift[4]) const;
 		void TransformToPos(const GLfloat posNormalized[2], GLfloat pos[2]) const;
 		void TransformFromPos(const GLfloat pos[2], GLfloat posNormalized[2]) const;
@@ -108,6 +191,10 @@ class CVis {
 	private:
 		typedef enum {
 			SSBO_LINE,
+			SSBO_HISTORY_VERTEX,
+			SSBO_HISTORY_CHUNK,
+			SSBO_HISTORY_GROUP,
+			SSBO_HISTORY_TRACK,
 			SSBO_COUNT // end marker
 		} TSSBO;
 
@@ -117,6 +204,11 @@ class CVis {
 			FB_NEIGHBORHOOD,
 			FB_TRACK,
 			FB_FINAL,
+			FB_FINAL_FLIPPED, // top-down copy of FB_FINAL for GetImage()
+			FB_BACKGROUND_BUILD, // only allocated for BeginRebuild()
+			FB_NEIGHBORHOOD_BUILD,
+			FB_BACKGROUND_SNAPSHOT, // last complete state, source of the reprojection
+			FB_NEIGHBORHOOD_SNAPSHOT,
 			FB_COUNT // end marker
 		} TFramebuffer;
 
@@ -126,6 +218,7 @@ class CVis {
 			UBO_LINE_HISTORY,
 			UBO_LINE_HISTORY_FINAL,
 			UBO_LINE_NEIGHBORHOOD,
+			UBO_POLYGON,
 			UBO_COUNT // end marker
 		} TUBO;
 
@@ -136,29 +229,67 @@ class CVis {
 			PROG_POINT_TRACK,
 			PROG_FULLSCREEN_TEX,
 			PROG_FULLSCREEN_BLEND,
+			PROG_HISTORY_SPLAT,
+			PROG_HISTORY_RESOLVE,
+			PROG_REPROJECT,
+			PROG_TILE,
 			PROG_COUNT // end marker
 		} TProgram;
 
 		size_t bufferVertexCount;
 		size_t vertexCount;
+		std::vector<size_t>  segments;  // first vertex of each segment
+		std::vector<GLint>   drawFirst; // scratch buffers for glMultiDrawArrays
+		std::vector<GLsizei> drawCount;
+		gpx::TVertexEncoding polygonEncoding;
+		double  polygonOrigin[2]; // per-polygon decoding of the vertices, see GetEncodedVertices
+		double  polygonExtent[2];
 		GLsizei width;
 		GLsizei height;
+		GLsizei capacityWidth; // allocated size of the framebuffer textures
+		GLsizei capacityHeight;
+		GLsizei viewWidth;  // 0: the framebuffer is the whole view
+		GLsizei viewHeight;
+		GLint   viewOffset[2];
 		float   dataAspect;
-		GLfloat scaleOffset[4];
+		GLfloat scaleOffset[4]; // of the whole view
+		GLfloat previousZoomShift[4]; // before the last UpdateTransform()
+		GLfloat snapshotZoomShift[2][4]; // background, neighborhood
+		unsigned rebuildStages;  // TStage bits being drawn into the FB_*_BUILD targets
+		unsigned buildSwapped;   // TStage bits redirected by BeginBuildDraw()
+		unsigned snapshotStages; // TStage bits with a valid FB_*_SNAPSHOT
+		bool    withRebuildTargets;
 
 		TConfig cfg;
+		TConfig appliedCfg; // the state of cfg the UBOs were built from
 
 		GLuint vaoEmpty;
+		GLuint vaoLine;
 		GLuint texTrackDepth;
+		GLuint texHistoryAccu;
+		GLuint texTile;
+		GLsizei texTileSize;
 		GLuint ssbo[SSBO_COUNT];
 		GLuint fbo[FB_COUNT];
 		GLuint tex[FB_COUNT];
 		GLuint ubo[UBO_COUNT];
 		GLuint program[PROG_COUNT];
+		bool programMissing[PROG_COUNT]; // optional programs which failed, not tried again
 
 		GLenum GetFramebufferTextureFormat(TFramebuffer fb) const;
 		bool InitializeUBO(int i);
+		bool InitializeFramebuffers(GLsizei w, GLsizei h);
+		void DropFramebuffers(); // the size-dependent resources
+		void DropBuffers();
+		void DropPrograms();
 		void DrawTrackInternal(float upTo);
+		void GetLineRanges(size_t lineCount);
+		void DrawLineStrips(size_t lineCount);
+		void DrawLineInstances(size_t lineCount, GLint lineBaseLocation = -1);
+		void UpdateLineVAO();
+		void UploadSSBO(TSSBO idx, const void *data, size_t size);
+		void SwapFramebuffers(TFramebuffer a, TFramebuffer b);
+		void Reproject(TFramebuffer dst, TFramebuffer src, const GLfloat srcZoomShift[4]);
 
 		friend class CAnimController;
 };
@@ -190,6 +321,21 @@ class CAnimController {
 			ACCU_YEAR
 		} TAccuMode;
 
+		typedef enum : int {
+			HISTORY_BACKEND_RASTER,
+			HISTORY_BACKEND_COMPUTE,
+			HISTORY_BACKEND_CPU,
+		} THistoryBackend;
+
+		struct TTrackMemoryStats {
+			unsigned long long hits;      // tracks needed which were loaded
+			unsigned long long misses;    // tracks which had to be read
+			unsigned long long evictions;
+			size_t             loadedBytes; // of the points, see gpx::CTrack::GetPointMemory()
+
+			TTrackMemoryStats();
+		};
+
 		struct TAnimConfig {
 			TAnimMode     mode;
 			double	      animDeltaPerFrame; // negative is a factor for dynamic scale with render time, postive is fixed increment 
@@ -207,6 +353,12 @@ class CAnimController {
 			TAccuMode     accuMode;
 			size_t        accuCount;
 			int           accuWeekDayStart;
+			gpx::TVertexEncoding vertexEncoding;
+			THistoryBackend historyBackend;
+			bool          progressiveHistory; // rebuild the history over several frames, reprojected on view changes
+			double        progressiveBudget;  // milliseconds per frame for the progressive rebuild
+			size_t        progressiveTracks;  // tracks between two checks of the budget
+			bool          historyPyramid;     // draw the history from the pyramid where it matches the view
 
 			TAnimConfig();
 			void Reset();
@@ -221,6 +373,24 @@ class CAnimController {
 		CAnimController();
 
 		bool AddTrack(const char *filename);
+		size_t AddTracks(const std::vector<std::string>& filenames); // loads in parallel, returns number of tracks added
+		void SetSplitSubTracks(bool enabled) {splitSubTracks = enabled;} // split files with several <trk> into separate tracks
+		bool GetSplitSubTracks() const {return splitSubTracks;}
+		void SetTrackFilter(const gpx::TTrackFilter& filter) {trackFilter = filter;} // for the tracks added later
+		const gpx::TTrackFilter& GetTrackFilter() const {return trackFilter;}
+		gpx::TTrackFilter& GetTrackFilter() {return trackFilter;}
+		// Add the tracks from the metadata in a gpx::CTrackIndex, the points of
+		// a track are read when it is drawn. Not used with split tracks.
+		bool OpenTrackIndex(const char *filename);
+		void CloseTrackIndex() {trackIndex.Close();}
+		const gpx::CTrackIndex& GetTrackIndex() const {return trackIndex;}
+		// Keep the points of at most this many bytes loaded, dropping those of
+		// the tracks used least recently. 0 for no limit. Only tracks whose
+		// file can be read again are dropped, so not the split sub-tracks.
+		// Set it before AddTracks(), which then loads the files in batches.
+		void SetTrackMemoryBudget(size_t bytes);
+		size_t GetTrackMemoryBudget() const {return trackMemoryBudget;}
+		const TTrackMemoryStats& GetTrackMemoryStats() const {return trackMemoryStats;}
 		bool Prepare(GLsizei width, GLsizei height);
 		void DropGL();
 
@@ -254,8 +424,30 @@ class CAnimController {
 		void SwitchToTrack(size_t idx);
 		std::vector<gpx::CTrack>& GetTracks() {return tracks;} // call Prepare after you modified these...
 
+		// both are progressive if enabled and not synchronous, see IsRestoringHistory()
 		void RestoreHistory(bool history=true, bool neighborhood=true);
 		void RestoreHistoryUpTo(size_t idx, bool history=true, bool neighborhood=true);
+		void RefreshStages(unsigned stages, bool reproject=false); // rebuild what the CVis::TStage bits say
+		bool IsRestoringHistory() const {return vis.GetRebuildStages() != 0;}
+		float GetRestoreProgress() const; // of the progressive rebuild, 0 to 1
+		void SetSynchronousHistory(bool enabled); // no progressive rebuilds, completes a pending one in the next UpdateStep
+		// render the current state at an arbitrary resolution, in tiles of at most maxTileSize, streamed to a png or tif file
+		bool RenderTiled(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype);
+		// the same for the raw float values of the history, as a GeoTIFF ("tif") or numpy array ("npy") in EPSG:3857
+		bool RenderHistoryDensityTiled(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype);
+		// the history of the current history mode as the wide lines draw it, rasterized on the CPU
+		// without any GL calls, GetWidth() x GetHeight() floats, bottom-up
+		bool ComputeHistoryDensity(std::vector<float>& data);
+
+		// Precomputed history tiles on disk, see CHistoryPyramid. Level 0
+		// has about the resolution of the current view at zoom 1, each
+		// further level doubles it. Only the wide lines with the history of
+		// all tracks can use it, and only at the zoom factors of the levels.
+		bool OpenHistoryPyramid(const char *dir);
+		void CloseHistoryPyramid() {pyramid.Close();}
+		bool UpdateHistoryPyramid(int levels=0); // (re)build it for the current settings, 0 keeps the number of levels
+		const CHistoryPyramid& GetHistoryPyramid() const {return pyramid;}
+		float GetHistoryPyramidZoom(float zoomFactor, bool notLarger=false) const; // the nearest zoom factor of a level
 		void ResetAnimation();
 		void ResetFrameCounter();
 
@@ -280,10 +472,15 @@ class CAnimController {
 
 		bool StatsToCSV(const char *filename) const;
 
+		// the CVis::TConfig and the TAnimConfig as a text file, loading changes only the entries in the file
+		bool SaveConfig(const char *filename) const;
+		bool LoadConfig(const char *filename);
+		void ApplyConfig(); // rebuild everything after the configs were replaced
+
 		void TransformToPos(const GLfloat posNormalized[2], double pos[2]) const;
 		void TransformFromPos(const double pos[2], GLfloat posNormalized[2]) const;
 
-		void GetTracksAt(double x, double y, double radius, std::vector<TTrackDist>& indices, TBackgroundMode mode) const;
+		void GetTracksAt(double x, double y, double radius, std::vector<TTrackDist>& indices, TBackgroundMode mode);
 
 		const gpxutil::CAABB& GetDataAABB() const {return aabb;}
 		const gpxutil::CAABB& GetScreenAABB() const {return screenAABB;}
@@ -313,8 +510,11 @@ class CAnimController {
 		double        curTime;
 		TPhase        curPhase;
 		bool          prepared;
+		bool          splitSubTracks;
+		gpx::TTrackFilter trackFilter;
 		bool          newCycle;
 		bool          animEndReached;
+		bool          synchronousHistory;
 
 		double        animationTime;
 		double        animationTimeDelta;
@@ -325,6 +525,10 @@ class CAnimController {
 		double        curFadeTime;
 		size_t        accumulateStart;
 		size_t        accumulateEnd;
+		size_t        restoreBegin;       // progressive rebuild: first track
+		size_t        restoreNext;        // next track
+		size_t        restoreRange[2][2]; // history, neighborhood: first, end
+		size_t        lastUpdatedTrack;
 		time_t        accumulateStartTime;
 		time_t        accumulateEndTime;
 
@@ -342,9 +546,35 @@ class CAnimController {
 		gpxutil::CAABB screenAABB;
 		std::vector<gpx::CTrack> tracks;
 		gpxutil::CInternalIDGenerator<size_t> trackIDManager;
-
+		CHistoryPyramid pyramid;
+		gpx::CTrackIndex trackIndex;
+		size_t        trackMemoryBudget;
+		unsigned long long trackUseCounter;
+		TTrackMemoryStats trackMemoryStats;
+
+		size_t AddIndexedTracks(const std::vector<std::string>& filenames);
+		size_t AppendTrack(gpx::CTrack& track, size_t& rejected); // returns the tracks added, counts those the filter drops
+		void   LoadTracks(const std::vector<size_t>& indices); // the points of the tracks not loaded yet, in parallel
+		void   LoadTracks(size_t first, size_t end);
+		void   LoadTrackAhead(size_t idx, size_t end); // idx and the tracks after it, up to end
+		size_t GetTrackChunkEnd(size_t first, size_t end) const; // the tracks from first which fit into the budget
+		void   EvictTracks(unsigned long long keepFrom); // drop tracks used before keepFrom until within the budget
+		void   RasterizeHistory(size_t first, size_t end, const THistoryRasterParams& params, std::vector<float>& data);
 		void   UpdateTrack(size_t idx);
 		bool   RestoreCurrentTrack(size_t curId);
+		bool   RestoreHistoryCompute(size_t first, size_t end);
+		bool   RestoreHistoryCPU(size_t first, size_t end);
+		void   GetHistoryRasterParams(THistoryRasterParams& params) const;
+		void   GetKmToPixelTransform(double transform[4]) const;
+		void   GetGeoReference(gpximg::TGeoReference& geo) const;
+		bool   RenderTiledInternal(GLsizei fullWidth, GLsizei fullHeight, GLsizei maxTileSize, const char *filename, const char *filetype, bool density);
+		bool   RestoreHistoryFromPyramid();
+		void   RestoreHistoryInternal(bool history, bool neighborhood, bool tryPyramid);
+		void   GetHistoryPyramidParams(TPyramidParams& params, int levels) const;
+		void   GetBackgroundRange(TBackgroundMode mode, size_t idx, size_t& first, size_t& end) const;
+		bool   BeginProgressiveRestore(bool history, bool neighborhood, bool reproject);
+		bool   BeginProgressiveRestoreRange(unsigned stages, const size_t range[2][2], bool reproject); // [first,end) of the history and the neighborhood
+		void   ContinueProgressiveRestore();
 
 		bool UpdateStepModeTrack();
 		bool UpdateStepModeTrackAccu();